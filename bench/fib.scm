@@ -0,0 +1,9 @@
+;; Doubly recursive fib: calls and small-integer arithmetic.
+(import "lib.scm")
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(fib 25)
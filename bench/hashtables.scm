@@ -0,0 +1,28 @@
+;; Inserts, looks up and deletes 5000 symbol-like string keys.
+(import "lib.scm")
+
+(define (repeat n thunk)
+  (if (= n 0) 'done (begin (thunk) (repeat (- n 1) thunk))))
+
+(define (fill table i n)
+  (if (= i n)
+      table
+      (begin (hash-table-set! table (list "key" i) i)
+             (fill table (+ i 1) n))))
+
+(define (lookup-all table i n acc)
+  (if (= i n)
+      acc
+      (lookup-all table (+ i 1) n (+ acc (hash-table-ref table (list "key" i))))))
+
+(define (delete-all table i n)
+  (if (= i n)
+      table
+      (begin (hash-table-delete! table (list "key" i))
+             (delete-all table (+ i 1) n))))
+
+(repeat 20
+        (lambda ()
+          (define table (fill (make-hash-table) 0 5000))
+          (lookup-all table 0 5000 0)
+          (delete-all table 0 5000)))
@@ -0,0 +1,21 @@
+;; map and append over long lists.
+(import "lib.scm")
+
+(define (iota n)
+  (define (loop i acc)
+    (if (= i 0) acc (loop (- i 1) (cons i acc))))
+  (loop n '()))
+
+(define (sum l acc)
+  (if (null? l) acc (sum (cdr l) (+ acc (car l)))))
+
+(define (repeat n thunk)
+  (if (= n 0) 'done (begin (thunk) (repeat (- n 1) thunk))))
+
+(define numbers (iota 5000))
+
+(repeat 20
+        (lambda ()
+          (sum (append (map (lambda (x) (* x 2)) numbers)
+                       (map + numbers numbers))
+               0)))
@@ -0,0 +1,41 @@
+;; Macro-heavy code: user macros expanding into let and cond.
+(import "lib.scm")
+
+(define-macro when
+  (lambda (test . body)
+    (list 'if test (cons 'begin body) #f)))
+
+(define-macro unless
+  (lambda (test . body)
+    (list 'if test #f (cons 'begin body))))
+
+(define-macro let1
+  (lambda (name value . body)
+    (cons 'let (cons (list (list name value)) body))))
+
+(define-macro swap-args
+  (lambda (f a b)
+    (list f b a)))
+
+(define (classify n)
+  (let1 m (swap-args - 1 n)
+    (cond ((< m 0) 'negative)
+          ((= m 0) 'zero)
+          ((< m 10) (let ((small 'small)) small))
+          (else (let1 big 'big (when #t big))))))
+
+(define (count-big n acc)
+  (if (= n 0)
+      acc
+      (let ((class (classify n)))
+        (count-big (- n 1)
+                   (cond ((eq? class 'big) (+ acc 1))
+                         (else acc))))))
+
+(define (loop n)
+  (let1 k n
+    (unless (= k 0)
+      (when (> (count-big 50 0) 0)
+        (loop (- k 1))))))
+
+(loop 2000)
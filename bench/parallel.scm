@@ -0,0 +1,20 @@
+;; pmap and futures over independent fib calls.  Run with --threads n to
+;; compare thread counts.
+(import "lib.scm")
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (iota n)
+  (define (loop i acc)
+    (if (= i 0) acc (loop (- i 1) (cons i acc))))
+  (loop n '()))
+
+(pmap (lambda (i) (fib 21)) (iota 32))
+
+(define (sum list)
+  (if (null? list) 0 (+ (car list) (sum (cdr list)))))
+
+(sum (map touch (map (lambda (i) (future (fib 21))) (iota 32))))
@@ -0,0 +1,101 @@
+#!/bin/sh
+# Runs the benchmarks in bench/ and writes bench_output.txt.
+#
+# Usage: bench/run.sh [-n runs] [--vm | --aot] [scheme-binary]
+#
+# Without a binary, scheme.cc is built with -O2 first.  Each benchmark runs
+# `runs` times from the repository root.  With --aot, each is compiled
+# with --emit-cpp and built with -O2 first, against a runtime object built
+# once, and the program is timed instead; large-load, which times loading,
+# is skipped.  bench_output.txt gets one tab-separated line per benchmark,
+# after a header naming the columns:
+#
+#   wall-ms-min/mean  wall time of the fastest run and the mean over all runs
+#   calls-per-sec     closure and builtin calls per second, over the mean
+#   peak-rss-kb       peak resident set size of the last run
+#   pairs/frames/closures  heap allocations of each kind in one run
+#   stack-frames      call frames taken from the frame stack instead
+#   allocs-per-call   pairs, frames and closures allocated per call
+#
+# The counts come from the interpreter's --stats output.
+set -e
+
+cd "$(dirname "$0")/.."
+
+runs=5
+backend=
+scheme=
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -n) runs="$2"; shift 2 ;;
+    --vm) backend=--vm; shift ;;
+    --aot) backend=--aot; shift ;;
+    *) scheme="$1"; shift ;;
+  esac
+done
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+if [ -z "$scheme" ]; then
+  scheme="$tmp/scheme"
+  g++ -std=c++14 -O2 -pthread -o "$scheme" scheme.cc
+fi
+if [ "$backend" = --aot ]; then
+  g++ -std=c++14 -O2 -pthread -DSCHEME_NO_MAIN -c -o "$tmp/scheme.o" scheme.cc
+fi
+
+# large-load: 20000 top-level defines of quoted data and small functions.
+awk 'BEGIN {
+  for (i = 0; i < 10000; i++) {
+    printf "(define data-%d (quote (%d \"row %d\" #t (a b c) %d.5 sym-%d)))\n",
+      i, i, i, i, i
+    printf "(define (f-%d x) (cond ((< x %d) (quote lo)) (else (quote hi))))\n",
+      i, i
+  }
+}' > "$tmp/large-load.scm"
+
+printf 'benchmark\tbackend\truns\twall-ms-min\twall-ms-mean\tcalls\tcalls-per-sec\tpeak-rss-kb\tpairs\tframes\tclosures\tstack-frames\tallocs-per-call\n' > bench_output.txt
+
+for file in bench/*.scm "$tmp/large-load.scm"; do
+  name=$(basename "$file" .scm)
+  run="$scheme $backend"
+  if [ "$backend" = --aot ]; then
+    if [ "$name" = large-load ]; then
+      continue
+    fi
+    "$scheme" --emit-cpp "$tmp/$name.cc" "$file"
+    g++ -std=c++14 -O2 -pthread -I. -o "$tmp/$name" "$tmp/$name.cc" \
+      "$tmp/scheme.o"
+    run="$tmp/$name"
+  fi
+  min=
+  total=0
+  i=0
+  while [ $i -lt $runs ]; do
+    start=$(date +%s%N)
+    $run --quiet --stats "$file" > /dev/null 2> "$tmp/stats"
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    total=$(( total + ms ))
+    if [ -z "$min" ] || [ $ms -lt $min ]; then
+      min=$ms
+    fi
+    i=$(( i + 1 ))
+  done
+  awk -F': ' -v name="$name" -v backend="${backend:---tree}" -v runs="$runs" \
+      -v min="$min" -v total="$total" '
+    { stat[$1] = $2 }
+    END {
+      mean = total / runs
+      rate = mean > 0 ? stat["calls"] * 1000 / mean : 0
+      allocs = stat["pairs"] + stat["frames"] + stat["closures"]
+      perCall = stat["calls"] > 0 ? allocs / stat["calls"] : 0
+      printf "%s\t%s\t%d\t%d\t%.1f\t%d\t%.0f\t%d\t%d\t%d\t%d\t%d\t%.3f\n",
+        name, substr(backend, 3), runs, min, mean, stat["calls"], rate,
+        stat["peak-rss-kb"], stat["pairs"], stat["frames"], stat["closures"],
+        stat["stack-frames"], perCall
+    }' "$tmp/stats" >> bench_output.txt
+done
+
+cat bench_output.txt
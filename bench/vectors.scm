@@ -0,0 +1,13 @@
+;; The lists benchmark's work on f64vectors, plus dot products.
+(import "lib.scm")
+
+(define (repeat n thunk)
+  (if (= n 0) 'done (begin (thunk) (repeat (- n 1) thunk))))
+
+(define numbers (make-f64vector 5000 1.5))
+
+(repeat 20000
+        (lambda ()
+          (f64vector-sum (f64vector-add (f64vector-mul numbers numbers)
+                                        (f64vector-map + numbers numbers)))
+          (f64vector-dot numbers numbers)))
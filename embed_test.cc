@@ -0,0 +1,206 @@
+// Exercises the Interpreter embedding API.  From the repository root:
+//   g++ -std=c++14 -pthread -DSCHEME_NO_MAIN -I. -o embed_test embed_test.cc
+//   ./embed_test
+// It prints nothing and exits 0 if every check passes.
+#include "scheme.cc"
+
+#include <sstream>
+
+namespace {
+
+// Counts flushes, to check that output isn't left in a buffer.
+class SyncCounter : public std::stringbuf {
+ public:
+  int syncs() const { return syncs_; }
+
+ protected:
+  int sync() override {
+    syncs_++;
+    return std::stringbuf::sync();
+  }
+
+ private:
+  int syncs_ = 0;
+};
+
+void testEval(bool useVM) {
+  std::ostringstream out;
+  std::ostringstream err;
+  Interpreter interp(useVM);
+  interp.setOutput(out);
+  interp.setErrors(err);
+  SchemeType result = interp.evalString("(+ 1 2) (* 2 3)");
+  assert(result.isNum() && result.num() == 6);
+  interp.evalString("(display \"hi\") (newline)");
+  assert(out.str() == "hi\n");
+  // A syntax error.
+  assert(interp.evalString("(1 . 2").sexpType() ==
+         SchemeType::SexpType::ERR);
+  assert(err.str().find("syntax error") != string::npos);
+}
+
+void testProcedures(bool useVM) {
+  Interpreter interp(useVM);
+  interp.evalString("(define (square x) (* x x))"
+                    "(define (greet name) name)");
+  Interpreter::Procedure square = interp.lookup("square");
+  assert(square.valid());
+  for (int i = 0; i < 1000; ++i) {
+    assert(square(i).num() == i * i);
+  }
+  assert(interp.lookup("greet")("world").str() == "world");
+  assert(interp.lookup("car").valid());
+  assert(!interp.lookup("no-such-procedure").valid());
+  // The handle keeps calling the procedure bound at lookup time.
+  interp.evalString("(define (square x) x)");
+  assert(square(3).num() == 9);
+}
+
+void testFlushing() {
+  SyncCounter outBuf;
+  std::ostream out(&outBuf);
+  std::ostringstream err;
+  int syncs;
+  {
+    Interpreter interp;
+    interp.setOutput(out);
+    interp.setErrors(err);
+    interp.evalString("(display 1)");
+    syncs = outBuf.syncs();
+    // Output is flushed before an error is reported.
+    interp.evalString("(display 2) no-such-variable");
+    assert(outBuf.syncs() > syncs);
+    assert(err.str().find("undefined variable") != string::npos);
+    interp.evalString("(display 3)");
+    syncs = outBuf.syncs();
+  }
+  // And when the interpreter goes away.
+  assert(outBuf.syncs() > syncs);
+  assert(outBuf.str() == "123");
+}
+
+// An error is reported and abandons its form, which is then ERR; the host
+// and later forms carry on.
+void testErrors(bool useVM) {
+  std::ostringstream out;
+  std::ostringstream err;
+  Interpreter interp(useVM);
+  interp.setOutput(out);
+  interp.setErrors(err);
+  const char* forms[] = {
+    "(foo 1)", "(5 1)", "(+ 'a 1)", "(car 5)", "(touch 5)", "(apply + 5)",
+    "(f64vector-sum 1)", "(hash-table-count 1)", "(quote)", "(lambda (1) 1)",
+  };
+  size_t errors = 0;
+  for (const char* form : forms) {
+    assert(interp.evalString(form).sexpType() == SchemeType::SexpType::ERR);
+    assert(interp.errors() > errors);
+    errors = interp.errors();
+  }
+  assert(err.str().find("not a procedure: 5") != string::npos);
+  assert(interp.evalString("(if (car 5) 'yes 'no)").sexpType() ==
+         SchemeType::SexpType::ERR);
+  interp.evalString("(define (g) (display \"before\") (car 5) "
+                    "(display \"after\") 'finished)");
+  assert(interp.evalString("(g)").sexpType() == SchemeType::SexpType::ERR);
+  assert(out.str() == "before");
+  assert(interp.lookup("g")().sexpType() == SchemeType::SexpType::ERR);
+  errors = interp.errors();
+  assert(interp.evalString("(+ 1 2)").num() == 3);
+  assert(interp.errors() == errors);
+}
+
+// Images round-trip, and a corrupted one is refused rather than loaded.
+void testImages() {
+  const char* filename = "/tmp/embed_test.img";
+  {
+    Interpreter interp(true);
+    interp.evalString("(define (adder n) (lambda (x) (+ x n)))");
+    interp.evalString("(define add5 (adder 5))");
+    assert(interp.saveImage(filename));
+  }
+  {
+    Interpreter interp(true);
+    assert(interp.loadImage(filename));
+    assert(interp.evalString("(add5 1)").num() == 6);
+  }
+  std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+  file.seekg(-1, std::ios::end);
+  char last = file.get();
+  file.seekp(-1, std::ios::end);
+  file.put(last ^ 1);
+  file.close();
+  {
+    std::ostringstream err;
+    Interpreter interp(true);
+    interp.setErrors(err);
+    assert(!interp.loadImage(filename));
+    assert(interp.evalString("add5").sexpType() == SchemeType::SexpType::ERR);
+  }
+  remove(filename);
+}
+
+// Importing again re-runs an importer whose import changed, expanding it
+// again if the change was to a macro.
+void testImports(bool useVM) {
+  const char* a = "/tmp/embed_test_a.scm";
+  const char* b = "/tmp/embed_test_b.scm";
+  std::ofstream(a) << "(define-macro m (lambda () 1))";
+  std::ofstream(b) << "(import \"" << a << "\") (define result (m))";
+  Interpreter interp(useVM);
+  string import = string("(import \"") + b + "\")";
+  interp.evalString(import);
+  assert(interp.evalString("result").num() == 1);
+  std::ofstream(a) << "(define-macro m (lambda () 2))";
+  // Another mtime, however coarse the file system's clock.
+  struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+  utimensat(AT_FDCWD, a, times, 0);
+  interp.evalString(import);
+  assert(interp.evalString("result").num() == 2);
+  remove(a);
+  remove(b);
+}
+
+void testIsolates() {
+  Interpreter a;
+  Interpreter b(true);
+  a.evalString("(define x 1)");
+  b.evalString("(define x 2)");
+  assert(a.evalString("x").num() == 1);
+  assert(b.evalString("x").num() == 2);
+}
+
+// Workers write to the Interpreter's current streams, one display at a
+// time.
+void testWorkerOutput() {
+  std::ostringstream out1;
+  std::ostringstream out2;
+  Interpreter interp;
+  interp.setThreads(4);
+  interp.setOutput(out1);
+  interp.evalString("(pmap (lambda (x) (display \"ab\") x)"
+                    " '(1 2 3 4 5 6 7 8))");
+  interp.setOutput(out2);
+  interp.evalString("(pmap (lambda (x) (display \"cd\") x)"
+                    " '(1 2 3 4 5 6 7 8))");
+  assert(out1.str() == "abababababababab");
+  assert(out2.str() == "cdcdcdcdcdcdcdcd");
+}
+
+}  // namespace
+
+int main() {
+  testEval(false);
+  testEval(true);
+  testProcedures(false);
+  testProcedures(true);
+  testFlushing();
+  testErrors(false);
+  testErrors(true);
+  testImages();
+  testImports(false);
+  testImports(true);
+  testIsolates();
+  testWorkerOutput();
+  return 0;
+}
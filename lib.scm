@@ -6,8 +6,15 @@
 ;;  lambda (with varargs support)
 ;;  and
 ;;  or
+;;  if
+;;  begin
+;;  let
+;;  cond
 ;;  define
-;;  define-macro (most basic scheme macro support)
+;;  define-macro (most basic scheme macro support).  Expansions are
+;;    cached until a macro or global is redefined, so a macro should
+;;    depend only on its arguments and the definitions it uses, not on
+;;    side effects or data it mutates.
 ;;
 ;; Builtin functions:
 ;;  apply
@@ -18,22 +25,9 @@
 ;;  null?
 ;;  pair?
 ;;
-(define-macro begin
-  (lambda (stm . rest)
-    (cons (cons 'lambda
-                (cons '()
-                      (cons stm
-                            rest)))
-          '())))
-
 (define (list first . rest)
   (cons first rest))
 
-;; TODO: this should support _f as a body
-(define-macro if
-  (lambda (_test _t _f)
-    (list 'or (list 'and _test _t) _f)))
-
 (define (not x) (if x #f #t))
 
 (define map
@@ -71,22 +65,8 @@
   (lambda (p)
     (car (cdr p))))
 
-;; parallel-binding "let"
-(define-macro let
-  (lambda (forms . body)
-    (cons (append (cons 'lambda (list (map car forms)))
-                  body)
-          (map cadr forms))))
-
-;; "cond" macro
-(define-macro cond
-  (lambda (f . rest)
-    (define (inner clauses)
-      (if (null? clauses)
-          '()
-          (let ((clause (car clauses))) ;; clause is like ((eq? a b) a)
-            (if (eq? (car clause) 'else)
-                (cadr clause)
-                (append (append (list 'if (car clause)) (cdr clause))
-                        (list (inner (cdr clauses))))))))
-    (inner (cons f rest))))
+;; (future expr) evaluates expr, possibly on another thread; touch the
+;; result for its value.
+(define-macro future
+  (lambda (expr)
+    (list 'make-future (list 'lambda '() expr))))
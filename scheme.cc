@@ -1,70 +1,128 @@
-#include <algorithm>
-#include <cassert>
-#include <cctype>
+#include "scheme.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
-#include <iostream>
-#include <memory>
-#include <numeric>
-#include <stack>
+#include <sstream>
 #include <tuple>
-#include <vector>
-#include <unordered_map>
-
-#include <string.h>
-
-using std::cin;
-using std::cout;
-using std::cerr;
-using std::endl;
-using std::fstream;
-using std::function;
-using std::istream;
-using std::ostream;
-using std::pair;
-using std::make_shared;
-using std::shared_ptr;
-using std::string;
-using std::unordered_map;
-using std::vector;
-
-using Number = double;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// cout and cerr, for threads not running any Interpreter.
+static SchemeStreams standardStreams;
+thread_local SchemeStreams* schemeStreams = &standardStreams;
+
+StreamWriter schemeOutput() {
+  return StreamWriter(*schemeStreams, false);
+}
+
+// Where errors are reported.  Output is flushed first, so that an error
+// follows what was printed before it and nothing is lost if the error
+// turns out to be fatal.
+StreamWriter schemeError() {
+  StreamWriter writer(*schemeStreams, true);
+  schemeStreams->out_->flush();
+  schemeStreams->errors_++;
+  return writer;
+}
 
 // TODO:
 //  - lexer support for quasiquotation
-//  - tail recursion elimination (use trampoline or exceptions)
-//  - refactor analyzer to allow for compiler plug-in
 
 
 //-----------------------------------------------------------------------------
 // Lexer
 //-----------------------------------------------------------------------------
+
+// The contents of a source file, memory-mapped when possible and read in
+// bulk otherwise.
+class SourceFile {
+ public:
+  SourceFile() = default;
+  SourceFile(const SourceFile&) = delete;
+  SourceFile& operator=(const SourceFile&) = delete;
+  ~SourceFile() {
+    if (mapped_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  bool open(const char* filename) {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = static_cast<const char*>(p);
+        size_ = st.st_size;
+        mapped_ = true;
+        close(fd);
+        return true;
+      }
+    }
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      contents_.append(buf, n);
+    }
+    close(fd);
+    data_ = contents_.data();
+    size_ = contents_.size();
+    return n == 0;
+  }
+
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  string contents_;
+};
+
 enum class TokenType : char {
   ID, STR, NUM, BOOL, ERR, EOF_, OP='(', CP=')', DOT='.', QUOTE='\''
 };
 
+// Identifiers are views into the tokenizer's buffer, valid until the next
+// token is read; only strings, which may contain escapes, are copied.
 class SchemeToken {
  public:
   SchemeToken(const TokenType ty) : ty_(ty) {}
   SchemeToken(Number num) : ty_(TokenType::NUM), num_(num) {}
-  SchemeToken(string id) : ty_(TokenType::ID), id_(id) {}
+  SchemeToken(StringView id) : ty_(TokenType::ID), id_(id) {}
   SchemeToken(bool b) : ty_(TokenType::BOOL), boolVal_(b) { }
 
   static SchemeToken userString(string str) {
     SchemeToken ret(TokenType::STR);
-    ret.id_ = str;
+    ret.str_ = std::move(str);
     return ret;
   }
 
   TokenType type() { return ty_; }
   Number num() { return num_; }
-  const string& id() { return id_; }
-  string& take_id() { return id_; }
+  StringView id() { return id_; }
+  const string& str() { return str_; }
   bool boolVal() { return boolVal_; }
 
   TokenType ty_;
-  Number num_;
-  string id_;
-  bool boolVal_;
+  Number num_ = 0;
+  StringView id_ = StringView(nullptr, 0);
+  string str_;
+  bool boolVal_ = false;
 };
 
 bool isSchemeId(char p) {
@@ -77,202 +135,361 @@ bool isSchemeId(char p) {
           (p == '^'));
 }
 
+// Scans a buffer with a pointer.  Over a stream, the buffer holds one line
+// at a time, so interactive input is read as it is typed.
 class Tokenizer {
  public:
-  Tokenizer(istream& is) : is_(is) {}
+  Tokenizer(const char* begin, const char* end) :
+      is_(nullptr), cur_(begin), end_(end), lineStart_(begin) { }
+  Tokenizer(istream& is) :
+      is_(&is), cur_(nullptr), end_(nullptr), lineStart_(nullptr) { }
   SchemeToken next();
 
-  void unget(SchemeToken tok) {
-    ungets_.push(std::move(tok));
-  }
+  // Position of the token last returned by next(), counting from 1.
+  int line() const { return tokLine_; }
+  int column() const { return tokColumn_; }
+  // What was wrong with the token, if next() returned ERR.
+  const char* error() const { return error_; }
 
  private:
-  // assumes first quote has been consumed
-  string readQuotedString_();
+  // Refills the buffer from the stream; false at the end of input.
+  bool fill_();
+
+  // assumes first quote has been consumed; false if the input ends first
+  bool readQuotedString_(string* str);
+
+  void newline_() {
+    line_++;
+    lineStart_ = cur_;
+  }
 
-  istream& is_;
-  std::stack<SchemeToken> ungets_;
+  istream* is_;
+  string buf_;
+  const char* cur_;
+  const char* end_;
+  int line_ = 1;
+  const char* lineStart_;
+  int tokLine_ = 1;
+  int tokColumn_ = 1;
+  const char* error_ = "bad token";
 };
 
-SchemeToken Tokenizer::next() {
-  if (!ungets_.empty()) {
-    SchemeToken tmp = std::move(ungets_.top());
-    ungets_.pop();
-    return std::move(tmp);
+bool Tokenizer::fill_() {
+  if (!is_ || !std::getline(*is_, buf_)) {
+    return false;
   }
+  buf_ += '\n';
+  cur_ = lineStart_ = buf_.data();
+  end_ = cur_ + buf_.size();
+  return true;
+}
 
+SchemeToken Tokenizer::next() {
+  error_ = "bad token";
   for (;;) {
-    char p = is_.get();
-    if (isspace(p)) {
+    if (cur_ == end_ && !fill_()) {
+      return SchemeToken(TokenType::EOF_);
+    }
+    tokLine_ = line_;
+    tokColumn_ = cur_ - lineStart_ + 1;
+    char p = *cur_++;
+    if (p == '\n') {
+      newline_();
+      continue;
+    }
+    else if (isspace(p)) {
       continue;
     }
     else if (p == '#') {
-      char bc = is_.get();
+      char bc = cur_ != end_ ? *cur_++ : 0;
       if (bc == 't' || bc == 'f')
         return SchemeToken(bc == 't');
       else
         return SchemeToken(TokenType::ERR);
     }
     else if (p == ';') {
-      string tmp;
-      std::getline(is_, tmp);
+      const char* eol = (const char*)memchr(cur_, '\n', end_ - cur_);
+      if (eol) {
+        cur_ = eol + 1;
+        newline_();
+      }
+      else {
+        cur_ = end_;
+      }
       continue;
     }
     else if (p == '"') {
-      return SchemeToken::userString(readQuotedString_());
+      string str;
+      if (!readQuotedString_(&str)) {
+        error_ = "unterminated string";
+        return SchemeToken(TokenType::ERR);
+      }
+      return SchemeToken::userString(str);
     }
     else if (isSchemeId(p)) {
-      string id;
-      do {
-        id += p;
-        p = is_.get();
-      } while (is_.good() && (isalnum(p) || isSchemeId(p)));
-      is_.unget();
-      return SchemeToken(std::move(id));
-    }
-    else if (isdigit(p)) {
-      // TODO handle .42 for inputting a number
-      Number num;
-      is_.unget();
-      is_ >> num;
+      const char* start = cur_ - 1;
+      while (cur_ != end_ && (isalnum(*cur_) || isSchemeId(*cur_))) {
+        ++cur_;
+      }
+      return SchemeToken(StringView(start, cur_ - start));
+    }
+    else if (isdigit(p) || (p == '.' && cur_ != end_ && isdigit(*cur_))) {
+      // The buffer need not be NUL-terminated, so copy the digits out.
+      const char* start = cur_ - 1;
+      while (cur_ != end_ &&
+             (isdigit(*cur_) || *cur_ == '.' || *cur_ == 'e' ||
+              *cur_ == 'E' ||
+              ((*cur_ == '-' || *cur_ == '+') &&
+               (cur_[-1] == 'e' || cur_[-1] == 'E')))) {
+        ++cur_;
+      }
+      // Numerals are short, but any length parses whole.
+      char buffer[64];
+      string longDigits;
+      size_t len = cur_ - start;
+      char* digits = buffer;
+      if (len >= sizeof(buffer)) {
+        longDigits.assign(start, len);
+        digits = &longDigits[0];
+      }
+      else {
+        memcpy(buffer, start, len);
+        buffer[len] = 0;
+      }
+      char* parsed;
+      Number num = strtod(digits, &parsed);
+      // Give back anything strtod didn't want, e.g. the "e" in "1e".
+      cur_ = start + (parsed - digits);
       return SchemeToken(num);
     }
     else if (p == '(' || p == ')' || p == '.' || p == '\'') {
       return SchemeToken((TokenType)p);
     }
-    if (is_.eof()) {
-      return SchemeToken(TokenType::EOF_);
-    }
     else {
-      cerr << "Lexer error: " << p << endl;
+      schemeError() << "Lexer error: " << p << endl;
       return SchemeToken(TokenType::ERR);
     }
   }
 }
 
-string Tokenizer::readQuotedString_() {
-  string sofar = "";
-  while (is_.good()) {
-    char p = is_.get();
+bool Tokenizer::readQuotedString_(string* str) {
+  string& sofar = *str;
+  for (;;) {
+    if (cur_ == end_ && !fill_()) {
+      return false;
+    }
+    char p = *cur_++;
+    if (p == '\n')
+      newline_();
     if (p == '"')
-      return sofar;
+      return true;
     if (p == '\\') {
-      p = is_.get();
+      if (cur_ == end_ && !fill_()) {
+        return false;
+      }
+      p = *cur_++;
       if (p == 'n')
         p = '\n';
       // TODO: add more escapes here
     }
     sofar += p;
   }
-  return "";
 }
 
 //-----------------------------------------------------------------------------
-// Type System
+// Atoms
 //-----------------------------------------------------------------------------
-class SchemeType;
-class SchemeClosure;
 
-// TODO: this is a shared_ptr due to a c++ compiler bug not present in clang;
-//  seems like something to do with using SchemeType before definition.
-//  Bummer that these have to be heap-allocated but oh well...
-using BuiltinFunc = function<shared_ptr<SchemeType>(vector<SchemeType>&)>;
+ostream& operator<<(ostream& os, Atom a) {
+  return os << a.name();
+}
 
-class SchemeType {
- public:
-  // Alternatively, should we use inheritance and polymorphism?
-  enum class SexpType {
-    ID, NUM, BOOL, STR, EOF_, ERR, CONS, BUILTIN, CLOSURE, NIL
-  };
-
-  SchemeType(Number num) : ty_(SexpType::NUM), num_(num) { }
-  SchemeType(string id) : ty_(SexpType::ID), id_(id) { }
-  SchemeType() : ty_(SexpType::ERR) { }
-  SchemeType(SexpType ty) : ty_(ty) { }
-  SchemeType(SchemeType car, SchemeType cdr) :
-      ty_(SexpType::CONS),
-      cons_(make_shared<pair<SchemeType, SchemeType>>(
-          std::move(car), std::move(cdr))) { }
-  SchemeType(BuiltinFunc&& builtin) :
-      ty_(SexpType::BUILTIN), builtin_(builtin) { }
-  SchemeType(shared_ptr<SchemeClosure> closure) :
-    ty_(SexpType::CLOSURE), closure_(closure) { }
-
-  static SchemeType fromBool(bool b) {
-    SchemeType ret(SexpType::BOOL);
-    ret.boolVal_ = b;
-    return ret;
+// Atoms the reader and analyzer look for by identity.
+const Atom atomQuote = Atom::intern("quote");
+const Atom atomLambda = Atom::intern("lambda");
+const Atom atomDefine = Atom::intern("define");
+const Atom atomDefineMacro = Atom::intern("define-macro");
+const Atom atomAnd = Atom::intern("and");
+const Atom atomOr = Atom::intern("or");
+const Atom atomMe = Atom::intern("me");
+const Atom atomImport = Atom::intern("import");
+const Atom atomIf = Atom::intern("if");
+const Atom atomBegin = Atom::intern("begin");
+const Atom atomLet = Atom::intern("let");
+const Atom atomCond = Atom::intern("cond");
+const Atom atomElse = Atom::intern("else");
+
+//-----------------------------------------------------------------------------
+// Heap
+//-----------------------------------------------------------------------------
+
+thread_local Heap::ThreadState* Heap::current_ = nullptr;
+
+thread_local Heap* heap = nullptr;
+
+void Heap::enter() {
+  std::unique_lock<std::mutex> lock(worldMutex_);
+  worldChanged_.wait(lock, [this] { return !stopRequested_; });
+  std::thread::id id = std::this_thread::get_id();
+  auto i = std::find_if(threads_.begin(), threads_.end(),
+                        [id](std::unique_ptr<ThreadState>& ts) {
+                          return ts->id_ == id;
+                        });
+  if (i == threads_.end()) {
+    threads_.emplace_back(new ThreadState(id));
+    i = threads_.end() - 1;
   }
+  running_++;
+  current_ = i->get();
+}
 
-  static SchemeType userString(const string& str) {
-    SchemeType ret(SexpType::STR);
-    ret.id_ = str;
-    return ret;
+void Heap::leave() {
+  std::lock_guard<std::mutex> lock(worldMutex_);
+  running_--;
+  current_ = nullptr;
+  worldChanged_.notify_all();
+}
+
+void Heap::stopWorld() {
+  std::unique_lock<std::mutex> lock(worldMutex_);
+  while (stopRequested_) {
+    park_(lock);
   }
+  stopRequested_ = true;
+  worldChanged_.wait(lock, [this] { return running_ == 1; });
+}
 
-  SexpType sexpType() { return ty_; }
-  const string& id() const { return id_; }
-  const string& str() const { return id_; }
-  Number num() { return num_; }
-  bool boolVal() { return boolVal_; }
-  SchemeType& car() { return cons_->first;  }
-  SchemeType& cdr() { return cons_->second; }
-  BuiltinFunc& builtin() { return builtin_; }
-  shared_ptr<SchemeClosure> closure() { return closure_; }
+void Heap::resumeWorld() {
+  std::lock_guard<std::mutex> lock(worldMutex_);
+  stopRequested_ = false;
+  worldChanged_.notify_all();
+}
 
-  bool isNil()  { return ty_ == SexpType::NIL;  }
-  bool isCons() { return ty_ == SexpType::CONS; }
-  bool isId()   { return ty_ == SexpType::ID;   }
-  bool isNum()  { return ty_ == SexpType::NUM;  }
-  bool isEof()  { return ty_ == SexpType::EOF_; }
+// Waits, not counted as running, for the current stop to end.
+void Heap::park_(std::unique_lock<std::mutex>& lock) {
+  running_--;
+  worldChanged_.notify_all();
+  worldChanged_.wait(lock, [this] { return !stopRequested_; });
+  running_++;
+}
 
-  bool toBool() {
-    return (ty_ == SexpType::BOOL && boolVal_) ||
-      (ty_ != SexpType::BOOL);
+void Heap::safePointSlow_(ThreadState& ts) {
+  if (stopRequested_) {
+    std::unique_lock<std::mutex> lock(worldMutex_);
+    if (stopRequested_) {
+      park_(lock);
+    }
+  }
+  if (ts.bytesSinceGC_ >= threshold_ && ts.inhibit_ == 0) {
+    collect();
   }
+}
 
-  bool eq(SchemeType& other);
+void Heap::collect() {
+  stopWorld();
+  if (inhibit_ == 0) {
+    collect_();
+  }
+  else {
+    // Another thread is in a NoGC section; try again later.
+    thread().bytesSinceGC_ = 0;
+  }
+  resumeWorld();
+}
 
-  void print(ostream& os);
+template <class V>
+bool equalNumVectors(V* a, V* b) {
+  return a->size() == b->size() &&
+    !memcmp(a->data(), b->data(), a->size() * sizeof(typename V::Element));
+}
 
- private:
-  SexpType ty_;
-  Number num_;
-  string id_;
-  bool boolVal_;
+bool SchemeType::equal(SchemeType& other) {
+  SchemeType* a = this;
+  SchemeType* b = &other;
+  // Iterates down the cdrs and recurses into the cars.
+  while (a->ty_ == SexpType::CONS && b->ty_ == SexpType::CONS) {
+    if (a->obj_ == b->obj_) {
+      return true;
+    }
+    if (!a->car().equal(b->car())) {
+      return false;
+    }
+    a = &a->cdr();
+    b = &b->cdr();
+  }
+  if (a->ty_ != b->ty_) {
+    return false;
+  }
+  switch (a->ty_) {
+  case SexpType::F64VECTOR:
+    return equalNumVectors(a->numVector<F64Vector>(),
+                           b->numVector<F64Vector>());
+  case SexpType::S64VECTOR:
+    return equalNumVectors(a->numVector<S64Vector>(),
+                           b->numVector<S64Vector>());
+  default:
+    return a->eq(*b);
+  }
+}
 
-  shared_ptr<pair<SchemeType, SchemeType> > cons_;
-  BuiltinFunc builtin_;
-  shared_ptr<SchemeClosure> closure_;
-};
+// Spreads the bits of a word over the whole hash (MurmurHash3's fmix64).
+size_t mixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
 
-bool SchemeType::eq(SchemeType& other) {
-  if (ty_ != other.ty_) return false;
-  switch (ty_) {
-  case SexpType::STR:
+// A hash consistent with eq?, or with equal? if equal is set.  Strings
+// hash by content either way, because eq? compares them by content.
+size_t hashValue(SchemeType& x, bool equal) {
+  using SexpType = SchemeType::SexpType;
+  switch (x.sexpType()) {
+  case SexpType::NUM: {
+    // 0.0 and -0.0 are eq?.
+    Number num = x.num() == 0 ? 0 : x.num();
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    return mixHash(bits);
+  }
   case SexpType::ID:
-    // TODO use ATOMs
-    return id_ == other.id_;
-  case SexpType::NUM:
-    return num_ == other.num_;
+    return mixHash(reinterpret_cast<uintptr_t>(&x.id()));
+  case SexpType::STR:
+    return StringView::Hash()(x.str());
   case SexpType::BOOL:
-    return boolVal_ == other.boolVal_;
+    return mixHash(x.boolVal() ? 1 : 2);
   case SexpType::CONS:
-    return cons_ == other.cons_;
-  case SexpType::BUILTIN:
-    return true;  // TODO: this is a bug
-    // OOPS NOT SUPPORTED! return builtin_ == other.builtin_;
-  case SexpType::CLOSURE:
-    return closure_ == other.closure_;
-  case SexpType::NIL:
-  case SexpType::ERR:
-  case SexpType::EOF_:
-    return true;
+    if (equal) {
+      // Hashes at most the first few elements, so that long lists stay
+      // cheap to hash.
+      size_t h = 3;
+      SchemeType* i = &x;
+      for (int n = 0; i->isCons() && n < 8; ++n, i = &i->cdr()) {
+        h = mixHash(h ^ hashValue(i->car(), true));
+      }
+      return i->isCons() ? h : mixHash(h ^ hashValue(*i, true));
+    }
+    break;
+  case SexpType::F64VECTOR:
+  case SexpType::S64VECTOR:
+    if (equal) {
+      // Both element types are eight bytes.
+      F64Vector* v = x.numVector<F64Vector>();
+      return StringView::Hash()(
+        StringView(reinterpret_cast<const char*>(v->data()), v->size() * 8));
+    }
+    break;
+  default:
+    break;
   }
+  if (x.heapObject()) {
+    return mixHash(reinterpret_cast<uintptr_t>(x.heapObject()));
+  }
+  return mixHash(static_cast<uint64_t>(x.sexpType()));
 }
 
-SchemeType schemeNil = SchemeType::SexpType::NIL;
-
 struct scheme_iterator {
   scheme_iterator(SchemeType& sexp) : cur_(&sexp) { }
 
@@ -297,23 +514,32 @@ scheme_iterator begin(SchemeType& sexp) {
 }
 
 scheme_iterator end(SchemeType& sexp) {
-  return schemeNil;
+  // The iterator only reads it.
+  return scheme_iterator(const_cast<SchemeType&>(schemeNil));
 }
 
 void printAll(SchemeType& sexp) {
   for (auto s : sexp) {
-    s.print(cout);
-    cout << endl;
+    schemeOutput() << s << endl;
   }
 }
 
+template <class V>
+void SchemeType::printNumVector_(ostream& os, const char* prefix, V* v) {
+  os << prefix;
+  for (size_t i = 0; i < v->size(); ++i) {
+    os << (i ? " " : "") << (*v)[i];
+  }
+  os << ')';
+}
+
 void SchemeType::print(ostream& os) {
   switch (ty_) {
     case SexpType::ID:
-      os << id_;
+      os << atom_;
       break;
     case SexpType::STR:
-      os << '\"' << id_ << '\"';
+      os << '\"' << str() << '\"';
       break;
     case SexpType::NUM:
       os << num_;
@@ -324,12 +550,12 @@ void SchemeType::print(ostream& os) {
     case SexpType::CONS: {
       // TODO!
       os << '(';
-      cons_->first.print(os);
-      SchemeType *rest = &(cons_->second);
+      car().print(os);
+      SchemeType *rest = &cdr();
       while (rest->ty_ == SexpType::CONS) {
         os << " ";
-        rest->cons_->first.print(os);
-        rest = &(rest->cons_->second);
+        rest->car().print(os);
+        rest = &rest->cdr();
       }
       if (rest->ty_ != SexpType::NIL) {
         os << " . ";
@@ -347,6 +573,18 @@ void SchemeType::print(ostream& os) {
     case SexpType::CLOSURE:
       os << "*CLOSURE*";
       break;
+    case SexpType::F64VECTOR:
+      printNumVector_(os, "#f64(", numVector<F64Vector>());
+      break;
+    case SexpType::S64VECTOR:
+      printNumVector_(os, "#s64(", numVector<S64Vector>());
+      break;
+    case SexpType::HASHTABLE:
+      os << "*HASH-TABLE*";
+      break;
+    case SexpType::FUTURE:
+      os << "*FUTURE*";
+      break;
     case SexpType::EOF_:
       os << "*EOF*";
       break;
@@ -361,6 +599,16 @@ ostream& operator<<(ostream& os, SchemeType& st) {
   return os;
 }
 
+SchemeType badArgument(const char* expected, SchemeType& x) {
+  schemeError() << "not " << expected << ": " << x << endl;
+  throw SchemeError();
+}
+
+void outOfMemory() {
+  schemeError() << "out of memory" << endl;
+  throw SchemeError();
+}
+
 // TODO: this implementation assumes the last element is nil
 vector<SchemeType> schemeListToVector(SchemeType& sexp) {
   vector<SchemeType> vec;
@@ -377,6 +625,15 @@ SchemeType mapCar(function<SchemeType(SchemeType&)> fn,
       });
 }
 
+bool carIsId(SchemeType& sexp, Atom id) {
+  if (sexp.sexpType() == SchemeType::SexpType::CONS) {
+    SchemeType& car = sexp.car();
+    return (car.sexpType() == SchemeType::SexpType::ID
+            && car.atom() == id);
+  }
+  return false;
+}
+
 //-----------------------------------------------------------------------------
 // Parser
 //-----------------------------------------------------------------------------
@@ -384,68 +641,137 @@ class SchemeParser {
  public:
   SchemeParser(Tokenizer& tok) : tok_(tok) { }
 
+  // Returns the next datum, EOF_ at the end of input, or ERR after
+  // reporting a syntax error.
   SchemeType readSexp();
 
+  // Line the last datum started on.
+  int line() const { return line_; }
+  // Where each lambda and define form in the last datum started, by the
+  // pair after its keyword.
+  vector<pair<SchemeType, int>>& lambdaLines() { return lambdaLines_; }
+
  private:
-  SchemeType readSexpList(bool allowDot);
+  // A list or quote that is still being read.  Lists are built front to
+  // back: tail_ points at the cdr of the last pair, or is null while the
+  // list is empty.  Nothing collects during reading, so the partial lists
+  // need no rooting.
+  struct Open {
+    bool quote_;
+    SchemeType head_;
+    SchemeType* tail_;
+    // 0: reading elements, 1: after '.', 2: after the dotted tail.
+    int dot_;
+    int line_;
+  };
+
+  SchemeType syntaxError_(const char* msg);
+
   Tokenizer& tok_;
+  vector<Open> open_;
+  int line_ = 0;
+  vector<pair<SchemeType, int>> lambdaLines_;
 };
 
+SchemeType SchemeParser::syntaxError_(const char* msg) {
+  schemeError() << tok_.line() << ":" << tok_.column() << ": syntax error: "
+       << msg << endl;
+  open_.clear();
+  return SchemeType();
+}
+
 SchemeType SchemeParser::readSexp() {
-  SchemeToken tok = tok_.next();
-  switch (tok.type()) {
-  case TokenType::DOT:
-  case TokenType::CP:
-  case TokenType::ERR:
-    return SchemeType();
-  case TokenType::NUM:
-    return SchemeType(tok.num());
-  case TokenType::ID:
-    return SchemeType(tok.id());
-  case TokenType::STR:
-    return SchemeType::userString(tok.id());
-  case TokenType::BOOL:
-    return SchemeType::fromBool(tok.boolVal());
-  case TokenType::OP:
-    return readSexpList(false);
-  case TokenType::QUOTE:
-    return SchemeType(SchemeType("quote"),
-                      SchemeType(readSexp(), schemeNil));
-  case TokenType::EOF_:
-    return SchemeType(SchemeType::SexpType::EOF_);
-  }
-}
-
-SchemeType SchemeParser::readSexpList(bool allowDot) {
-  SchemeToken tok = tok_.next();
-  if (tok.type() == TokenType::DOT) {
-    assert(allowDot);
-    SchemeType ret = readSexp();
-    // consume the CP token, which must appear next
-    SchemeToken cp = tok_.next();
-    assert(cp.type() == TokenType::CP);
-    return ret;
-  }
-  else if (tok.type() == TokenType::CP) {
-    return schemeNil;
-  }
-  else if (tok.type() == TokenType::OP) {
-    SchemeType sCar(readSexpList(false));
-    SchemeType sCdr(readSexpList(true));
-    return SchemeType(std::move(sCar), std::move(sCdr));
-  }
-  else if (tok.type() == TokenType::NUM ||
-           tok.type() == TokenType::BOOL ||
-           tok.type() == TokenType::ID ||
-           tok.type() == TokenType::STR ||
-           tok.type() == TokenType::QUOTE) {
-    tok_.unget(std::move(tok));
-    SchemeType sexpForTok(readSexp());
-    return SchemeType(std::move(sexpForTok), readSexpList(true));
-  }
-  else {
-    cerr << "syntax error in nested sexp" << endl;
-    return SchemeType();
+  open_.clear();
+  lambdaLines_.clear();
+  for (;;) {
+    SchemeToken tok = tok_.next();
+    if (open_.empty()) {
+      line_ = tok_.line();
+    }
+    if (!open_.empty() && open_.back().dot_ == 2 &&
+        tok.type() != TokenType::CP) {
+      return syntaxError_("expected ')' after dotted tail");
+    }
+
+    SchemeType datum;
+    switch (tok.type()) {
+    case TokenType::NUM:
+      datum = SchemeType(tok.num());
+      break;
+    case TokenType::ID:
+      datum = SchemeType(Atom::intern(tok.id()));
+      break;
+    case TokenType::STR:
+      datum = SchemeType::userString(tok.str());
+      break;
+    case TokenType::BOOL:
+      datum = SchemeType::fromBool(tok.boolVal());
+      break;
+    case TokenType::OP:
+      open_.push_back(Open{false, schemeNil, nullptr, 0, tok_.line()});
+      continue;
+    case TokenType::QUOTE:
+      open_.push_back(Open{true, schemeNil, nullptr, 0, tok_.line()});
+      continue;
+    case TokenType::DOT:
+      if (open_.empty() || open_.back().quote_ ||
+          !open_.back().tail_ || open_.back().dot_) {
+        return syntaxError_("unexpected '.'");
+      }
+      open_.back().dot_ = 1;
+      continue;
+    case TokenType::CP:
+      if (open_.empty() || open_.back().quote_) {
+        return syntaxError_("unexpected ')'");
+      }
+      if (open_.back().dot_ == 1) {
+        return syntaxError_("expected a datum after '.'");
+      }
+      datum = open_.back().head_;
+      if ((carIsId(datum, atomLambda) || carIsId(datum, atomDefine)) &&
+          datum.cdr().isCons()) {
+        lambdaLines_.push_back(std::make_pair(datum.cdr(),
+                                              open_.back().line_));
+      }
+      open_.pop_back();
+      break;
+    case TokenType::EOF_:
+      if (!open_.empty()) {
+        return syntaxError_("unexpected end of input");
+      }
+      return SchemeType(SchemeType::SexpType::EOF_);
+    case TokenType::ERR:
+      return syntaxError_(tok_.error());
+    }
+
+    // Hand the finished datum to whatever encloses it.
+    for (;;) {
+      if (open_.empty()) {
+        return datum;
+      }
+      Open& open = open_.back();
+      if (open.quote_) {
+        datum = SchemeType(SchemeType(atomQuote),
+                           SchemeType(datum, schemeNil));
+        open_.pop_back();
+        continue;
+      }
+      if (open.dot_ == 1) {
+        *open.tail_ = datum;
+        open.dot_ = 2;
+      }
+      else {
+        SchemeType pair(datum, schemeNil);
+        if (open.tail_) {
+          *open.tail_ = pair;
+        }
+        else {
+          open.head_ = pair;
+        }
+        open.tail_ = &pair.cdr();
+      }
+      break;
+    }
   }
 }
 
@@ -453,520 +779,5600 @@ SchemeType SchemeParser::readSexpList(bool allowDot) {
 // Symbol Table
 //-----------------------------------------------------------------------------
 
-// TODO: should use interned atoms
-using Symtab = unordered_map<string, SchemeType>;
-
-class Frame : public Symtab,
-              public std::enable_shared_from_this<Frame> {
+// Compile-time counterpart of a Frame: the names bound by one lambda and
+// the slots they occupy.  let forms add names for the extent of their body
+// only, but their slots stay allocated, so a frame is sized to hold every
+// binding in the lambda at once.  Scopes only exist while the analyzer is
+// running.
+//
+// Closures are flat.  A lambda's scope collects the variables its body
+// uses from enclosing lambdas, and a closure copies their values into a
+// frame of its own when it is made, so it keeps alive only what it uses.
+// At run time depth 0 is a call's frame and depth 1 its closure's captures.
+// Copying is only right for a variable that is stored before the closure
+// is made and never again: arguments and let variables, and internal
+// defines analyzed before the lambda, unless the name is defined more
+// than once.  A lambda that uses any other variable chains its captures
+// to the frame it was made in, where depth 2 starts.
+//
+// That chain is the only way a frame can outlive its call, so a lambda
+// none of whose closures chain to its frame doesn't need a heap frame.
+class Scope {
  public:
-  Frame(shared_ptr<Frame> next) : next_(next) { }
-  shared_ptr<Frame> next() { return next_; }
+  // body is what runs in the scope's frame: a lambda body, or a top-level
+  // form.  A top-level scope holds let bindings of a top-level form;
+  // defines there still go to the global table.
+  Scope(Scope* next, SchemeType& body, bool topLevel = false) :
+      next_(next), topLevel_(topLevel), size_(0) {
+    countDefines_(body);
+  }
 
-  shared_ptr<Frame> findFrame(const string& sym) {
-    shared_ptr<Frame> cur = shared_from_this();
-    do {
-      if (cur->find(sym) != cur->end()) {
-        break;
-      }
-      else {
-        cur = cur->next();
-      }
-    } while (cur);
-    return cur;
+  int size() const { return size_; }
+  bool topLevel() const { return topLevel_; }
+
+  // For the lambda of a define: slot is where the define stores it in the
+  // enclosing scope, so uses of the name capture the closure itself.
+  void setSelf(int slot) { self_ = slot; }
+
+  // The Lambda whose body runs in the scope, which keeps the constants and
+  // inner lambdas of the body; see SchemeAnalyzer.
+  Lambda* lambda() const { return lambda_; }
+  void setLambda(Lambda* lambda) { lambda_ = lambda; }
+
+  // Returns the slot for sym in this scope, adding one if necessary.
+  // define is true for the name of a define.
+  int bind(Atom sym, bool define = false) {
+    int slot = find(sym);
+    return slot < 0 ? declare(sym, define) : slot;
   }
 
-  SchemeType* lookup(const string& sym) {
-    shared_ptr<Frame> frame = findFrame(sym);
-    if (frame) {
-      return &(*frame)[sym];
+  // Adds a fresh slot for sym, shadowing any visible binding.
+  int declare(Atom sym, bool define = false) {
+    names_.push_back(std::make_pair(sym, size_));
+    auto i = defines_.find(sym);
+    int count = i == defines_.end() ? 0 : i->second;
+    if (define) {
+      states_.push_back(count == 1 ? UNDEFINED : MUTABLE);
     }
     else {
-      return nullptr;
+      states_.push_back(count == 0 ? BOUND : MUTABLE);
     }
+    return size_++;
   }
- private:
-  shared_ptr<Frame> next_;
-};
 
-//-----------------------------------------------------------------------------
-// Closures
-//-----------------------------------------------------------------------------
-struct SchemeClosure {
-  shared_ptr<Frame> env_;
-  vector<string> argNames_;
-  string restArgName_;
-  function<SchemeType(shared_ptr<Frame>)> expr_;
+  // Called once the define storing into slot has been analyzed: closures
+  // made after it runs may copy the value.
+  void defined(int slot) {
+    if (states_[slot] == UNDEFINED) {
+      states_[slot] = BOUND;
+    }
+  }
 
-  SchemeType apply(vector<SchemeType>& eArgs);
-};
+  // mark/release bracket a block: names declared in between stop being
+  // visible on release.
+  size_t mark() const { return names_.size(); }
+  void release(size_t mark) { names_.resize(mark); }
 
-SchemeType SchemeClosure::apply(vector<SchemeType>& eArgs) {
-  // Create new environment frame.
-  auto newEnv = make_shared<Frame>(env_);
+  int find(Atom sym) const {
+    for (int i = names_.size() - 1; i >= 0; --i) {
+      if (names_[i].first == sym) {
+        return names_[i].second;
+      }
+    }
+    return -1;
+  }
 
-  int i = 0;
-  // Bind arguments to values in the new frame
-  for (const string& argName : argNames_) {
-    if (i >= eArgs.size()) {
-      (*newEnv)[argName] = schemeNil;
+  // Resolves sym to a (depth, slot) pair, capturing it if it belongs to an
+  // enclosing lambda.  Returns false if sym is not lexically bound, i.e.
+  // it refers to a global.
+  bool resolve(Atom sym, int* depth, int* slot) {
+    int s = find(sym);
+    if (s >= 0) {
+      *depth = 0;
+      *slot = s;
+      return true;
+    }
+    for (const Free& free : free_) {
+      if (free.name_ == sym) {
+        *depth = free.depth_;
+        *slot = free.slot_;
+        return true;
+      }
+    }
+    if (!next_ || !next_->resolve(sym, depth, slot)) {
+      return false;
+    }
+    State state = *depth == 0 ? next_->states_[*slot] : BOUND;
+    if (*depth == 0 && *slot == self_ && state == UNDEFINED) {
+      captures_.push_back(Capture{-1, 0});
+    }
+    else if (*depth <= 1 && state == BOUND) {
+      captures_.push_back(Capture{*depth, *slot});
     }
     else {
-      (*newEnv)[argName] = eArgs[i];
+      chain_ = true;
+      next_->escapes_ = true;
+      *depth += 2;
+      free_.push_back(Free{sym, *depth, *slot});
+      return true;
     }
-    i++;
+    *depth = 1;
+    *slot = captures_.size() - 1;
+    free_.push_back(Free{sym, *depth, *slot});
+    return true;
   }
 
-  // arguments left over?
-  if (!restArgName_.empty()) {
-    if (i < eArgs.size()) {
-      (*newEnv)[restArgName_] =
-          std::accumulate(
-              eArgs.rbegin(),
-              eArgs.rbegin() + (eArgs.size() - i),
-              schemeNil,
-              [](SchemeType& sofar, SchemeType& i) {
-                return SchemeType(i, sofar);
-              });
+  // What closures over this scope's lambda capture, and whether they also
+  // keep the frame they are made in.  Complete once its body is analyzed.
+  const vector<Capture>& captures() const { return captures_; }
+  bool chain() const { return chain_; }
+  // Whether a closure may keep this scope's frame after the call returns.
+  bool escapes() const { return escapes_; }
+
+ private:
+  // BOUND slots are stored once, before any closure that can see them is
+  // made.  UNDEFINED ones become BOUND once their define is analyzed.
+  enum State : char { BOUND, UNDEFINED, MUTABLE };
+
+  // A variable of an enclosing lambda this one uses.
+  struct Free {
+    Atom name_;
+    int depth_;
+    int slot_;
+  };
+
+  // Counts the defines in body that store into this scope's frame, i.e.
+  // those outside nested lambdas.
+  void countDefines_(SchemeType& body) {
+    if (!body.isCons() || carIsId(body, atomQuote) ||
+        carIsId(body, atomLambda)) {
+      return;
     }
-    else {
-      (*newEnv)[restArgName_] = schemeNil;
+    if (carIsId(body, atomDefine) && body.cdr().isCons()) {
+      SchemeType& target = body.cdr().car();
+      if (target.isCons()) {
+        // (define (name arg ...) body ...) defines a lambda.
+        if (target.car().isId()) {
+          defines_[target.car().atom()]++;
+        }
+        return;
+      }
+      if (target.isId()) {
+        defines_[target.atom()]++;
+      }
+    }
+    for (SchemeType* i = &body; i->isCons(); i = &i->cdr()) {
+      countDefines_(i->car());
     }
   }
 
-  return expr_(newEnv);
-}
-
+  Scope* next_;
+  bool topLevel_;
+  int size_;
+  int self_ = -1;
+  Lambda* lambda_ = nullptr;
+  vector<pair<Atom, int>> names_;
+  vector<State> states_;
+  unordered_map<Atom, int, Atom::Hash> defines_;
+  vector<Free> free_;
+  vector<Capture> captures_;
+  bool chain_ = false;
+  bool escapes_ = false;
+};
 
 //-----------------------------------------------------------------------------
-// Semantic Analyzer
+// Profiler
 //-----------------------------------------------------------------------------
-SchemeType callFunc(
-    SchemeType& func,
-    vector<SchemeType>& args) {
-  if (func.sexpType() == SchemeType::SexpType::BUILTIN) {
-    // workaround for gnu compiler bug
-    shared_ptr<SchemeType> unwrap_me = (func.builtin())(args);
-    SchemeType cpy = *unwrap_me;
-    return cpy;
+
+// A procedure as the profiler sees it: a lambda or a builtin.
+struct ProcInfo {
+  string name_;
+  string location_;
+
+  size_t calls_ = 0;
+  uint64_t inclusiveNs_ = 0;
+  uint64_t exclusiveNs_ = 0;
+  // Heap allocations made by the procedure itself, not its callees.
+  size_t allocations_ = 0;
+  // Activations currently on the profiler's stack, so that recursive calls
+  // count towards inclusive time only once.
+  int active_ = 0;
+};
+
+// Opt-in (--profile) call profiler.  Each closure and builtin call is
+// bracketed by enter() and exit(), which charge its time and allocations
+// to the procedure and to its place in a tree of call stacks.  Calls the
+// analyzer inlines are not seen.
+class Profiler {
+ public:
+  bool enabled() const { return enabled_; }
+  void enable() { enabled_ = true; }
+
+  // File and line of the top-level form about to be analyzed.  Lambdas
+  // with no line of their own (see setLine) are given its line.
+  void setLocation(const string& file, int line) {
+    file_ = file;
+    line_ = line;
+    lines_.clear();
   }
-  else {
-    assert(func.sexpType() == SchemeType::SexpType::CLOSURE);
-    auto closure = func.closure();
-    return closure->apply(args);
+
+  // Lines of the lambda and define forms within the top-level form, keyed
+  // by the pair after the keyword, which is what the analyzer is given.
+  // Anything that copies such a pair carries its line over.
+  void setLine(SchemeType& form, int line) {
+    lines_[form.heapObject()] = line;
+  }
+  void copyLine(SchemeType& from, SchemeType& to) {
+    auto i = lines_.find(from.heapObject());
+    if (i != lines_.end()) {
+      lines_[to.heapObject()] = i->second;
+    }
   }
-}
 
-bool carIsId(SchemeType& sexp, const string& id) {
-  if (sexp.sexpType() == SchemeType::SexpType::CONS) {
-    SchemeType& car = sexp.car();
-    return (car.sexpType() == SchemeType::SexpType::ID
-            && car.id() == id);
+  // Where the lambda whose pair after the keyword is form was read.
+  string location(SchemeType& form) {
+    auto i = lines_.find(form.heapObject());
+    int line = i == lines_.end() ? line_ : i->second;
+    return file_ + ":" + std::to_string(line);
   }
-  return false;
-}
 
-class SchemeAnalyzer {
- public:
-  using Expr = function<SchemeType(shared_ptr<Frame>)>;
-  Expr analyze(SchemeType& sexp) {
-    switch (sexp.sexpType()) {
-    case SchemeType::SexpType::NUM:
-    case SchemeType::SexpType::BOOL:
-    case SchemeType::SexpType::STR:
-    case SchemeType::SexpType::NIL:
-      return [sexp](shared_ptr<Frame> env) { return sexp; };
-    case SchemeType::SexpType::ID:
-      return [sexp](shared_ptr<Frame> env) {
-        auto frame = env->findFrame(sexp.id());
-        if (frame) {
-          return (*frame)[sexp.id()];
-        } else {
-          cerr << "undefined variable: " << sexp.id() << endl;
-          return SchemeType(SchemeType::SexpType::ERR);
-        }
-      };
-    case SchemeType::SexpType::CONS:
-      if (carIsId(sexp, "lambda"))
-        return analyzeLambda(sexp.cdr());
-      else if (carIsId(sexp, "define"))
-        return analyzeDefine(sexp.cdr());
-      else if (carIsId(sexp, "define-macro"))
-        return analyzeDefineMacro(sexp.cdr());
-      else if (carIsId(sexp, "quote"))
-        return analyzeQuote(sexp.cdr());
-      else if (carIsId(sexp, "and"))
-        return analyzeAnd(sexp.cdr());
-      else if (carIsId(sexp, "or"))
-        return analyzeOr(sexp.cdr());
-      else if (carIsId(sexp, "me")) {
-        SchemeType s = sexp.cdr();
-        return [this, s](shared_ptr<Frame> env) {
-          SchemeType s2 = s;
-          return expandMacros(s2);
-        };
-      }
-      else
-        return analyzeApplication(sexp);
-      break;
-    default:
-      return [sexp](shared_ptr<Frame> env) {
-        return SchemeType(SchemeType::SexpType::ERR);
-      };
-    }
+  // A lambda, named after the define that binds it if there is one.
+  ProcInfo* newLambda(Atom name, SchemeType& form) {
+    return newProc(name.isNull() ? "lambda" : name.name(), location(form));
   }
 
-  // TODO: support macros that map to any scheme type, not just closures
-  unordered_map<string, shared_ptr<SchemeClosure> > macro_table_;
+  ProcInfo* newBuiltin(const string& name) {
+    return newProc(name, "builtin");
+  }
 
-  SchemeType expandMacros_(SchemeType& sexp, bool* did_stuff) {
-    if (sexp.sexpType() == SchemeType::SexpType::CONS) {
-      if (carIsId(sexp, "quote")) {
-        return sexp;
-      }
-      else if (sexp.car().sexpType() == SchemeType::SexpType::ID) {
-        auto i = macro_table_.find(sexp.car().id());
-        if (i != macro_table_.end()) {
-          *did_stuff = true;
-          auto sc = i->second;
-          vector<SchemeType> args;
-          std::copy(begin(sexp.cdr()), end(sexp.cdr()),
-                    back_inserter(args));
-          return sc->apply(args);
-        }
-      }
-      return SchemeType(expandMacros_(sexp.car(), did_stuff),
-                        expandMacros_(sexp.cdr(), did_stuff));
-    }
-    else {
-      return sexp;
+  // Procedures with the same name and location share one ProcInfo, so
+  // that analyzing a form again, e.g. on every evalString, adds nothing.
+  ProcInfo* newProc(const string& name, const string& location) {
+    ProcInfo*& proc = procIndex_[name + '\n' + location];
+    if (!proc) {
+      procs_.emplace_back();
+      procs_.back().name_ = name;
+      procs_.back().location_ = location;
+      proc = &procs_.back();
     }
+    return proc;
   }
 
-  SchemeType expandMacros(SchemeType& sexp) {
-    SchemeType s = sexp;
-    bool did_stuff;
-    do {
-      did_stuff = false;
-      s = expandMacros_(s, &did_stuff);
-      if (did_stuff) {
-        cout << "-->> expanded to: " << s << endl;
-      }
+  void enter(ProcInfo* proc) {
+    Node* parent = stack_.empty() ? &root_ : stack_.back().node_;
+    std::unique_ptr<Node>& node = parent->children_[proc];
+    if (!node) {
+      node.reset(new Node(proc));
     }
-    while(did_stuff);
-
-    return s;
+    proc->calls_++;
+    proc->active_++;
+    stack_.push_back(Activation{node.get(), now_(), 0,
+                                heap->totalAllocations(), 0});
   }
 
-  Expr analyzeDefineMacro(SchemeType& sexp) {
-    // sexp is (macro-name <value>)
-    string macro_name = sexp.car().id();
-    Expr analyzedValue = analyze(sexp.cdr().car());
-    return [this, macro_name, analyzedValue](shared_ptr<Frame> env) {
-      // todo: support non-closure values
-      macro_table_[macro_name] = analyzedValue(env).closure();
-      return SchemeType::fromBool(true);
-    };
+  void exit() {
+    if (stack_.empty()) {
+      return;
+    }
+    Activation act = stack_.back();
+    stack_.pop_back();
+    uint64_t elapsed = now_() - act.start_;
+    size_t allocations = heap->totalAllocations() - act.allocations_;
+    ProcInfo* proc = act.node_->proc_;
+    proc->exclusiveNs_ += elapsed - act.childNs_;
+    proc->allocations_ += allocations - act.childAllocations_;
+    act.node_->exclusiveNs_ += elapsed - act.childNs_;
+    if (--proc->active_ == 0) {
+      proc->inclusiveNs_ += elapsed;
+    }
+    if (!stack_.empty()) {
+      stack_.back().childNs_ += elapsed;
+      stack_.back().childAllocations_ += allocations;
+    }
   }
 
-  Expr analyzeAnd(SchemeType& sexp) {
-    vector<Expr> exprs;
-    std::transform(begin(sexp), end(sexp),
-                   back_inserter(exprs),
-                   [this](SchemeType& i) { return analyze(i); });
-    return [exprs](shared_ptr<Frame> env) {
-      SchemeType last;
-      for (auto i : exprs) {
-        last = i(env);
-        if (!last.toBool()) {
-          return SchemeType(SchemeType::fromBool(false));
-        }
+  // Calls entered and not yet exited.  An error unwinds past the exits, so
+  // whoever catches it exits the calls down to the depth it started at.
+  size_t depth() const { return stack_.size(); }
+  void unwind(size_t depth) {
+    while (stack_.size() > depth) {
+      exit();
+    }
+  }
+
+  // One line per procedure that was called, by decreasing exclusive time.
+  void report(ostream& os) {
+    vector<ProcInfo*> called;
+    for (ProcInfo& proc : procs_) {
+      if (proc.calls_) {
+        called.push_back(&proc);
       }
-      return last;
-    };
+    }
+    std::sort(called.begin(), called.end(), [](ProcInfo* a, ProcInfo* b) {
+      return a->exclusiveNs_ > b->exclusiveNs_;
+    });
+    os << "calls\tincl-ms\texcl-ms\tallocs\tprocedure\tlocation\n";
+    for (ProcInfo* proc : called) {
+      os << proc->calls_ << '\t' << proc->inclusiveNs_ / 1e6 << '\t'
+         << proc->exclusiveNs_ / 1e6 << '\t' << proc->allocations_ << '\t'
+         << proc->name_ << '\t' << proc->location_ << '\n';
+    }
   }
 
-  Expr analyzeOr(SchemeType& sexp) {
-    vector<Expr> exprs;
-    std::transform(begin(sexp), end(sexp),
-                   back_inserter(exprs),
-                   [this](SchemeType& i) { return analyze(i); });
-    return [exprs](shared_ptr<Frame> env) {
-      SchemeType last;
-      for (auto i : exprs) {
-        last = i(env);
-        if (last.toBool()) {
-          return last;
-        }
+  // Folded stacks ("outer;inner microseconds" per line), the input format
+  // of flamegraph.pl and similar tools.
+  void writeFolded(ostream& os) {
+    string path;
+    writeFolded_(os, root_, path);
+  }
+
+ private:
+  struct Node {
+    explicit Node(ProcInfo* proc) : proc_(proc) { }
+    ProcInfo* proc_;
+    uint64_t exclusiveNs_ = 0;
+    unordered_map<ProcInfo*, std::unique_ptr<Node>> children_;
+  };
+
+  struct Activation {
+    Node* node_;
+    uint64_t start_;
+    uint64_t childNs_;
+    size_t allocations_;
+    size_t childAllocations_;
+  };
+
+  static uint64_t now_() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void writeFolded_(ostream& os, Node& node, string& path) {
+    for (auto& i : node.children_) {
+      Node& child = *i.second;
+      size_t length = path.size();
+      if (length) {
+        path += ';';
       }
-      return SchemeType::fromBool(false);
-    };
+      path += child.proc_->name_;
+      if (child.proc_->location_ != "builtin") {
+        path += '@' + child.proc_->location_;
+      }
+      if (child.exclusiveNs_ >= 1000) {
+        os << path << ' ' << child.exclusiveNs_ / 1000 << '\n';
+      }
+      writeFolded_(os, child, path);
+      path.resize(length);
+    }
   }
 
-  Expr analyzeQuote(SchemeType& sexp) {
-    SchemeType thing = sexp.car();
-    return [thing](shared_ptr<Frame> env) {
-      return thing;
-    };
+  bool enabled_ = false;
+  string file_ = "?";
+  int line_ = 0;
+  unordered_map<HeapObject*, int> lines_;
+  std::deque<ProcInfo> procs_;
+  // procs_ by name and location.
+  unordered_map<string, ProcInfo*> procIndex_;
+  Node root_{nullptr};
+  vector<Activation> stack_;
+};
+
+// The profiler of the Interpreter the calling thread is running.
+thread_local Profiler* profiler = nullptr;
+
+// A call in tail position doesn't call its target directly.  It leaves the
+// target and arguments here and returns a TAIL_CALL marker; the enclosing
+// SchemeClosure::apply then makes the call in place of its own activation,
+// so tail-recursive loops run in constant C++ stack.  Nothing allocates
+// between the two, so these values need no rooting.  Like the other
+// evaluator state below, there is one per thread.
+struct PendingTailCall {
+  SchemeType func_;
+  vector<SchemeType> args_;
+};
+
+thread_local PendingTailCall pendingTailCall;
+
+// Closure and builtin calls made by either backend, for --stats.  Calls
+// the analyzer inlined are not counted.  Worker threads add theirs to
+// WorkerPool::calls().
+thread_local size_t callCount = 0;
+
+SchemeType callBuiltin_(SchemeBuiltin* builtin, Args args);
+// Reports a call of a builtin with a number of arguments it doesn't take,
+// and throws SchemeError.
+[[noreturn]] SchemeType wrongArgCount(Args args);
+
+SchemeType callBuiltin(SchemeType& func, Args args) {
+  callCount++;
+  SchemeBuiltin* builtin = func.builtin();
+  if (profiler->enabled()) {
+    profiler->enter(builtin->info_);
+    SchemeType result = callBuiltin_(builtin, args);
+    profiler->exit();
+    return result;
   }
+  return callBuiltin_(builtin, args);
+}
 
-  Expr analyzeDefine(SchemeType& sexp) {
-    string id;
-    Expr val;
-    if (sexp.car().isCons()) {
-      // sexp is like ((funcname arg1 arg2) body)
-      SchemeType lambdaSexp(sexp.car().cdr(), sexp.cdr());
-      id = sexp.car().car().id();
-      val = analyzeLambda(lambdaSexp);
+SchemeType callBuiltin_(SchemeBuiltin* builtin, Args args) {
+  switch (args.size()) {
+  case 0:
+    if (builtin->fixed0_) return builtin->fixed0_();
+    break;
+  case 1:
+    if (builtin->fixed1_) return builtin->fixed1_(args[0]);
+    break;
+  case 2:
+    if (builtin->fixed2_) return builtin->fixed2_(args[0], args[1]);
+    break;
+  case 3:
+    if (builtin->fixed3_) return builtin->fixed3_(args[0], args[1], args[2]);
+    break;
+  }
+  if (!builtin->func_) {
+    return wrongArgCount(args);
+  }
+  return builtin->func_(args);
+}
+
+SchemeType wrongArgCount(Args args) {
+  schemeError() << "wrong number of arguments to builtin: " << args.size()
+                << endl;
+  throw SchemeError();
+}
+
+Frame* SchemeClosure::bind(SchemeType* args, size_t nargs) {
+  callCount++;
+
+  // Create new environment frame.  Arguments occupy the first slots, then
+  // the rest argument, then any internal defines.
+  Frame* newEnv = lambda_->heapFrame_ ?
+    Frame::make(env_, lambda_->frameSize_) :
+    Frame::makeOnStack(env_, lambda_->frameSize_);
+
+  int i = 0;
+  int argCount = lambda_->argCount_;
+  // Bind arguments to values in the new frame
+  for (; i < argCount; ++i) {
+    if (i >= nargs) {
+      (*newEnv)[i] = schemeNil;
     }
     else {
-      id = sexp.car().id();
-      val = analyze(sexp.cdr().car());
+      (*newEnv)[i] = args[i];
     }
-    return [id, val](shared_ptr<Frame> env) {
-      (*env)[id] = val(env);
-      return schemeNil;
-    };
   }
 
-  //
-  // Assumes that sexp is of the form: ((arg1 arg2) body)
-  //
-  Expr analyzeLambda(SchemeType& sexp) {
-    // Extract the argument names -- those are in the car.
-    vector<string> argNames;
-    string restArgName;
-    SchemeType *i = &(sexp.car());
-    while (i->isCons()) {
-      argNames.push_back(i->car().id());
-      i = &(i->cdr());
+  // arguments left over?
+  if (lambda_->hasRestArg_) {
+    SchemeType rest = schemeNil;
+    for (size_t j = nargs; j > i; --j) {
+      rest = SchemeType(args[j - 1], rest);
     }
+    (*newEnv)[i] = rest;
+  }
 
-    if (!i->isNil()) {
-      assert(i->isId());
-      restArgName = i->id();
-    }
+  return newEnv;
+}
 
-    // Extract the argument body from the cdr.
-    Expr body = analyzeBody(sexp.cdr());
-    return [argNames, restArgName, body](shared_ptr<Frame> env) {
-      auto closure = make_shared<SchemeClosure>();
-      closure->env_ = env;
-      closure->argNames_ = std::move(argNames);
-      closure->restArgName_ = std::move(restArgName);
-      closure->expr_ = body;
-      return SchemeType(closure);
-    };
+SchemeType SchemeClosure::apply(Args eArgs) {
+  if (lambda_->code_) {
+    return vmApply(this, eArgs);
   }
 
-  Expr analyzeBody(SchemeType& sexpBody) {
-    vector<Expr> exprs;
-    std::transform(begin(sexpBody), end(sexpBody),
-                   back_inserter(exprs),
-                   [this](SchemeType& i) { return analyze(i); });
-    return [exprs](shared_ptr<Frame> env) {
-      SchemeType res;
-      for (auto expr : exprs) {
-        res = expr(env);
-      }
-      return res;
-    };
-  }
+  SchemeClosure* closure = this;
+  Args args = eArgs;
 
-  Expr analyzeApplication(SchemeType& sexp) {
-    Expr analyzedFunc = analyze(sexp.car());
-    vector<Expr> analyzedArgs;
-    std::transform(
-      begin(sexp.cdr()), end(sexp.cdr()),
-      back_inserter(analyzedArgs),
-      [this](SchemeType& i) { return analyze(i); });
-    return [this, analyzedFunc, analyzedArgs](shared_ptr<Frame> env) {
-      auto eFunc = analyzedFunc(env);
-      vector<SchemeType> eArgs;
-      std::transform(
-        begin(analyzedArgs), end(analyzedArgs),
-        back_inserter(eArgs),
-        [&env](Expr expr) { return expr(env); });
-      return callFunc(eFunc, eArgs);
-    };
+  // Target and arguments of the tail call currently being made.
+  SchemeType func;
+  vector<SchemeType> tailArgs;
+  ValueRoot funcRoot(func);
+  VectorRoot argsRoot(tailArgs);
+
+  for (;;) {
+    // The closure and its arguments are reachable from the caller or from
+    // the roots above, so the frame is the only thing left to protect.
+    heap->safePoint();
+    Frame* newEnv = closure->bind(args.begin(), args.size());
+    FrameRoot root(newEnv);
+
+    Lambda* lambda = closure->lambda_.get();
+    SchemeType result;
+    if (profiler->enabled()) {
+      profiler->enter(lambda->info_);
+      result = lambda->expr_(newEnv);
+      profiler->exit();
+    }
+    else {
+      result = lambda->expr_(newEnv);
+    }
+    if (result.sexpType() != SchemeType::SexpType::TAIL_CALL) {
+      return result;
+    }
+
+    func = pendingTailCall.func_;
+    tailArgs.swap(pendingTailCall.args_);
+    args = Args(tailArgs);
+    if (func.sexpType() == SchemeType::SexpType::BUILTIN) {
+      return callBuiltin(func, tailArgs);
+    }
+    if (func.sexpType() != SchemeType::SexpType::CLOSURE) {
+      return badArgument("a procedure", func);
+    }
+    closure = func.closure();
+    if (closure->lambda_->code_) {
+      return vmApply(closure, tailArgs);
+    }
   }
-};
+}
 
 //-----------------------------------------------------------------------------
-// Environment & Builtin Functions
+// Garbage Collector
 //-----------------------------------------------------------------------------
+void Heap::trace_(HeapObject* obj) {
+  switch (obj->kind_) {
+  case HeapKind::PAIR: {
+    SchemePair* pair = static_cast<SchemePair*>(obj);
+    mark_(pair->car_);
+    mark_(pair->cdr_);
+    break;
+  }
+  case HeapKind::CLOSURE:
+    markObject_(static_cast<SchemeClosure*>(obj)->env_);
+    traceLambda_(static_cast<SchemeClosure*>(obj)->lambda_.get());
+    break;
+  case HeapKind::FRAME:
+  case HeapKind::STACK_FRAME: {
+    Frame* frame = static_cast<Frame*>(obj);
+    markFrame_(frame->next());
+    for (int i = 0; i < frame->size(); ++i) {
+      mark_((*frame)[i]);
+    }
+    break;
+  }
+  case HeapKind::HASHTABLE:
+    for (auto& slot : static_cast<SchemeHashTable*>(obj)->slots()) {
+      mark_(slot.key_);
+      mark_(slot.value_);
+    }
+    break;
+  case HeapKind::FUTURE:
+    mark_(static_cast<SchemeFuture*>(obj)->thunk_);
+    mark_(static_cast<SchemeFuture*>(obj)->result_);
+    break;
+  default:
+    break;
+  }
+}
 
-// Helper to make math environment expressions.
-void envMath(shared_ptr<Frame> env, const string& op,
-             function<Number(Number, Number)> impl) {
-  (*env)[op] = SchemeType(
-    [=](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(
-          std::accumulate(args.begin() + 1, args.end(),
-                          args[0].num(),
-                          [=](Number a, SchemeType& b) {
-                            assert(b.isNum());
-                            return impl(a, b.num());
-                          }));
-      });
+// Every closure over a lambda shares its constants, so they are only
+// traced once per collection.
+void Heap::traceLambda_(Lambda* lambda) {
+  if (!lambda || lambda->traced_ == collections_ + 1) {
+    return;
+  }
+  lambda->traced_ = collections_ + 1;
+  for (SchemeType& value : lambda->constants_) {
+    mark_(value);
+  }
+  for (auto& inner : lambda->lambdas_) {
+    traceLambda_(inner.get());
+  }
 }
 
-void envMathCmp(shared_ptr<Frame> env, const string& op,
-                function<bool(Number, Number)> impl) {
-  (*env)[op] = SchemeType(
-    [=](vector<SchemeType>& args) {
-      for (int i = 0; i < args.size() - 1;) {
-        Number a = args[i].num();
-        Number b = args[++i].num();
-        if (!impl(a, b)) {
-          return make_shared<SchemeType>(SchemeType::fromBool(false));
-        }
-      }
-      return make_shared<SchemeType>(SchemeType::fromBool(true));
-    });
+void Heap::finalize_(HeapObject* obj) {
+  switch (obj->kind_) {
+  case HeapKind::STRING:
+    static_cast<SchemeString*>(obj)->~SchemeString();
+    break;
+  case HeapKind::CLOSURE:
+    static_cast<SchemeClosure*>(obj)->~SchemeClosure();
+    break;
+  case HeapKind::HASHTABLE:
+    static_cast<SchemeHashTable*>(obj)->~SchemeHashTable();
+    break;
+  default:
+    // Pairs, builtins, frames and numeric vectors hold nothing that needs
+    // destroying.
+    break;
+  }
 }
 
-void setupEnv(shared_ptr<Frame> env) {
-  envMath(env, "+", [](Number a, Number b) { return a + b; });
-  envMath(env, "*", [](Number a, Number b) { return a * b; });
-  envMath(env, "-", [](Number a, Number b) { return a - b; });
-  envMath(env, "/", [](Number a, Number b) { return a / b; });
-
-  envMathCmp(env, "=", [](Number a, Number b) { return a == b; });
-  envMathCmp(env, "<", [](Number a, Number b) { return a < b; });
-  envMathCmp(env, ">", [](Number a, Number b) { return a > b; });
-
-  (*env)["eq?"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(
-          SchemeType::fromBool(
-            std::all_of((args.begin())++, args.end(),
-                        [&args](SchemeType& i) {
-                          return args[0].eq(i);
-                        })));
-      });
-  (*env)["cons"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(args[0], args[1]);
-      });
-  (*env)["car"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(args[0].car());
-      });
-  (*env)["cdr"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(args[0].cdr());
-      });
-  (*env)["pair?"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(
-          SchemeType::fromBool(
-            args[0].sexpType() == SchemeType::SexpType::CONS));
-      });
-  (*env)["null?"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        return make_shared<SchemeType>(
-            SchemeType::fromBool(
-                args[0].sexpType() == SchemeType::SexpType::NIL));
-      });
-  (*env)["display"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        for (auto a : args) {
-          if (a.sexpType() == SchemeType::SexpType::STR) {
-            cout << a.str(); // no quotes
-          }
-          else {
-            cout << a;
-          }
+// Runs with the world stopped.
+void Heap::collect_() {
+  for (Symtab* table : tables_) {
+    for (auto& i : *table) {
+      mark_(i.second);
+    }
+  }
+  for (Lambda* lambda : lambdas_) {
+    traceLambda_(lambda);
+  }
+  for (vector<SchemeType>* values : stacks_) {
+    for (SchemeType& value : *values) {
+      mark_(value);
+    }
+  }
+  for (vector<Frame*>* frames : frameStacks_) {
+    for (Frame* frame : *frames) {
+      markFrame_(frame);
+    }
+  }
+  for (auto& ts : threads_) {
+    for (SchemeType& value : ts->evalStack_) {
+      mark_(value);
+    }
+    for (SchemeType* value : ts->values_) {
+      mark_(*value);
+    }
+    for (vector<SchemeType>* values : ts->vectors_) {
+      for (SchemeType& value : *values) {
+        mark_(value);
+      }
+    }
+    for (Frame* frame : ts->frames_) {
+      markFrame_(frame);
+    }
+  }
+
+  while (!markStack_.empty()) {
+    HeapObject* obj = markStack_.back();
+    markStack_.pop_back();
+    trace_(obj);
+  }
+
+  size_t liveBytes = 0;
+  for (auto& ts : threads_) {
+    for (auto& pool : ts->pools_) {
+      pool->forEach([&](HeapObject* obj) {
+        if (obj->kind_ == HeapKind::FREE) {
+          return;
+        }
+        if (obj->marked_) {
+          obj->marked_ = false;
+          liveBytes += pool->objSize();
+        }
+        else {
+          finalize_(obj);
+          pool->release(obj);
         }
-        return make_shared<SchemeType>(schemeNil);
-      });
-  (*env)["newline"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        cout << endl;
-        return make_shared<SchemeType>(schemeNil);
       });
-  (*env)["apply"] = SchemeType(
-      [](vector<SchemeType>& args) {
-        SchemeType& func = args[0];
-        vector<SchemeType> nargs;
-        std::copy(begin(args) + 1, end(args) - 1, back_inserter(nargs));
+    }
+    auto& large = ts->large_;
+    auto live = std::partition(large.begin(), large.end(),
+                               [](HeapObject* obj) { return obj->marked_; });
+    for (auto i = live; i != large.end(); ++i) {
+      finalize_(*i);
+      free(*i);
+    }
+    large.erase(live, large.end());
+    for (HeapObject* obj : large) {
+      obj->marked_ = false;
+      liveBytes += kMaxPooled;
+    }
+    ts->bytesSinceGC_ = 0;
+  }
 
-        SchemeType& lst = *(end(args) - 1);
-        assert(lst.isCons());
+  collections_++;
+  threshold_ = liveBytes > kMinThreshold ? liveBytes : kMinThreshold;
+}
 
-        std::copy(begin(lst), end(lst), back_inserter(nargs));
-        return make_shared<SchemeType>(callFunc(func, nargs));
-      });
+Heap::~Heap() {
+  for (auto& ts : threads_) {
+    for (auto& pool : ts->pools_) {
+      pool->forEach([](HeapObject* obj) { finalize_(obj); });
+    }
+    for (HeapObject* obj : ts->large_) {
+      finalize_(obj);
+      free(obj);
+    }
+  }
 }
 
 //-----------------------------------------------------------------------------
-bool interpret(const char* filename,
-               SchemeAnalyzer& analyzer,
-               shared_ptr<Frame> env) {
-  istream* in = &cin;
-  fstream fin;
+// Semantic Analyzer
+//-----------------------------------------------------------------------------
+SchemeType callFunc(SchemeType func, Args args) {
+  if (func.sexpType() == SchemeType::SexpType::BUILTIN) {
+    return callBuiltin(func, args);
+  }
+  else if (func.sexpType() == SchemeType::SexpType::CLOSURE) {
+    auto closure = func.closure();
+    return closure->apply(args);
+  }
+  return badArgument("a procedure", func);
+}
 
-  if (filename) {
-    fin.open(filename, std::ios::in);
-    if (!fin.is_open()) {
-      cerr << "Couldn't open " << filename << "." << endl;
-      return false;
+// Where a SchemeError may be caught: remembers what of the calling
+// thread's state an error unwinds past, so that the catcher can restore
+// it.  Frames and roots are released by their own destructors, and the VM
+// cleans up its stacks, but the evaluation stack and profiled calls are
+// left as they were.
+class UnwindPoint {
+ public:
+  UnwindPoint() :
+      evalStack_(Heap::thread().evalStack_.size()),
+      calls_(profiler->depth()) { }
+
+  void restore() const {
+    Heap::thread().evalStack_.resize(evalStack_);
+    profiler->unwind(calls_);
+  }
+
+ private:
+  size_t evalStack_;
+  size_t calls_;
+};
+
+class SchemeAnalyzer {
+ public:
+  using Expr = function<SchemeType(Frame*)>;
+
+  SchemeAnalyzer(Symtab& globals) : globals_(globals) {
+    heap->addRoots(&globals_);
+    heap->addRoots(&macro_table_);
+    heap->addRoots(&expansionCache_);
+
+    addPrimitive("+", &inline2<NumOp<std::plus<Number>>>);
+    addPrimitive("-", &inline2<NumOp<std::minus<Number>>>);
+    addPrimitive("*", &inline2<NumOp<std::multiplies<Number>>>);
+    addPrimitive("/", &inline2<NumOp<std::divides<Number>>>);
+    addPrimitive("=", &inline2<CmpOp<std::equal_to<Number>>>);
+    addPrimitive("<", &inline2<CmpOp<std::less<Number>>>);
+    addPrimitive(">", &inline2<CmpOp<std::greater<Number>>>);
+    addPrimitive("cons", &inline2<ConsOp>);
+    addPrimitive("eq?", &inline2<EqOp>);
+    addPrimitive("car", &inline1<CarOp>);
+    addPrimitive("cdr", &inline1<CdrOp>);
+    addPrimitive("null?", &inline1<NullOp>);
+    addPrimitive("pair?", &inline1<PairOp>);
+  }
+
+  ~SchemeAnalyzer() {
+    heap->removeRoots(&globals_);
+    heap->removeRoots(&macro_table_);
+    heap->removeRoots(&expansionCache_);
+  }
+
+  // Analyzes a top-level form into a Lambda whose expr_ runs it and which
+  // holds its constants.  Top-level forms run with a null frame, unless
+  // they bind let variables, in which case they get a frame of their own
+  // to hold them.
+  shared_ptr<Lambda> analyze(SchemeType& sexp) {
+    auto lambda = make_shared<Lambda>();
+    Scope scope(nullptr, sexp, true);
+    scope.setLambda(lambda.get());
+    Expr expr = analyze(sexp, &scope);
+    int frameSize = scope.size();
+    lambda->frameSize_ = frameSize;
+    if (frameSize == 0) {
+      lambda->expr_ = expr;
     }
     else {
-      in = &fin;
+      lambda->expr_ = [expr, frameSize](Frame* env) {
+        Frame* frame = Frame::make(nullptr, frameSize);
+        FrameRoot root(frame);
+        return expr(frame);
+      };
     }
+    return lambda;
   }
 
-  Tokenizer t(*in);
-  SchemeParser p(t);
+  Symtab& globals() { return globals_; }
 
-  while (in->good()) {
-    SchemeType sexp(p.readSexp());
+  // The builtin that calls to the global name are inlined as, or null if
+  // there is none.
+  SchemeBuiltin* primitive(Atom name) {
+    auto p = primitives_.find(name);
+    return p == primitives_.end() ? nullptr : p->second.builtin_;
+  }
 
-    if (sexp.isEof()) {
+  // scope is the innermost enclosing lambda's scope, or the top-level scope.
+  // tail is true if sexp's value is the value of the enclosing lambda body.
+  Expr analyze(SchemeType& sexp, Scope* scope, bool tail = false) {
+    SchemeType let;
+    switch (sexp.sexpType()) {
+    case SchemeType::SexpType::NUM:
+    case SchemeType::SexpType::BOOL:
+    case SchemeType::SexpType::STR:
+    case SchemeType::SexpType::NIL:
+      keep(sexp, scope);
+      return [sexp](Frame* env) { return sexp; };
+    case SchemeType::SexpType::ID:
+      return analyzeVariable(sexp.atom(), scope);
+    case SchemeType::SexpType::CONS:
+      if (carIsId(sexp, atomLambda))
+        return analyzeLambda(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomDefine))
+        return analyzeDefine(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomDefineMacro))
+        return analyzeDefineMacro(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomQuote))
+        return analyzeQuote(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomAnd))
+        return analyzeAnd(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomOr))
+        return analyzeOr(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomIf))
+        return analyzeIf(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomBegin))
+        return analyzeBegin(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomLet))
+        return analyzeLet(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomCond))
+        return analyzeCond(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomMe)) {
+        SchemeType s = sexp.cdr();
+        keep(s, scope);
+        return [this, s](Frame* env) {
+          SchemeType s2 = s;
+          return expandMacros(s2);
+        };
+      }
+      else if (scope && letForm(sexp, &let))
+        return analyzeLet(let, scope, tail);
+      else
+        return analyzeApplication(sexp, scope, tail);
       break;
+    default:
+      return [sexp](Frame* env) {
+        return SchemeType(SchemeType::SexpType::ERR);
+      };
     }
+  }
 
-    if (carIsId(sexp, "import")) {
-      if (!interpret(sexp.cdr().car().str().c_str(),
-                     analyzer, env)) {
-        return false;
+  // TODO: support macros that map to any scheme type, not just closures
+  Symtab macro_table_;
+
+  void defineMacro(Atom name, SchemeType macro) {
+    std::unique_lock<std::recursive_mutex> lock(expanderMutex_,
+                                                std::defer_lock);
+    lockBlocking(lock);
+    macro_table_[name] = macro;
+    macroVersion_++;
+    // Cached expansions may have been expanded further with the old table.
+    forgetExpansions();
+  }
+
+  // Macro definitions so far.  Code expanded when it was different may
+  // not be what expanding it now would give.
+  size_t macroVersion() const { return macroVersion_; }
+
+  // Empties the expansion cache.  Macros are taken to depend only on the
+  // form they expand, the macro table and the globals, so this is needed
+  // when a macro or a global is redefined.
+  void forgetExpansions() {
+    std::unique_lock<std::recursive_mutex> lock(expanderMutex_,
+                                                std::defer_lock);
+    lockBlocking(lock);
+    expansionCache_.clear();
+    expansionIndex_.clear();
+    expansionHashes_.clear();
+    nextExpansion_ = 0;
+  }
+
+  SchemeType expandMacros(SchemeType& sexp) {
+    // The table and expansion cache are shared by every thread.
+    std::unique_lock<std::recursive_mutex> lock(expanderMutex_,
+                                                std::defer_lock);
+    lockBlocking(lock);
+    // Partially expanded trees live in C++ locals the collector can't see.
+    NoGC noGC;
+    return expandMacros_(sexp);
+  }
+
+  // Number of macro uses expanded by calling the macro, i.e. cache misses.
+  size_t expansions() const { return expansions_; }
+  // Number of expansions dropped from the full cache to make room.
+  size_t evictions() const { return evictions_; }
+
+ private:
+  // Expands sexp in a single walk.  Subtrees with no macro uses are shared
+  // with the input rather than copied.
+  SchemeType expandMacros_(SchemeType& sexp) {
+    if (!sexp.isCons() || carIsId(sexp, atomQuote)) {
+      return sexp;
+    }
+    if (sexp.car().isId()) {
+      auto i = macro_table_.find(sexp.car().atom());
+      if (i != macro_table_.end()) {
+        return expandMacroUse_(i->second, sexp);
       }
     }
-    else {
-      cout << "-->> " << sexp << endl;
-      auto e_sexp(analyzer.expandMacros(sexp));
-      auto expr = analyzer.analyze(e_sexp);
-      auto r_sexp = expr(env);
-      cout << r_sexp << endl;
-      cout << "------- " << endl;
+    return expandElements_(sexp);
+  }
+
+  SchemeType expandElements_(SchemeType& list) {
+    if (!list.isCons()) {
+      return list;
     }
+    SchemeType car = expandMacros_(list.car());
+    SchemeType cdr = expandElements_(list.cdr());
+    if (car.eq(list.car()) && cdr.eq(list.cdr())) {
+      return list;
+    }
+    SchemeType copy(car, cdr);
+    profiler->copyLine(list, copy);
+    return copy;
   }
 
-  return true;
-}
+  // Fully expands a use of macro.  Results are memoized on the macro and
+  // the structure of the use, so repeated identical forms expand once.  A
+  // failed expansion isn't: it may work once what it needs is defined.
+  SchemeType expandMacroUse_(SchemeType& macro, SchemeType& use) {
+    size_t hash = formHash(use) * 31 + std::hash<void*>()(macro.closure());
+    auto range = expansionIndex_.equal_range(hash);
+    for (auto i = range.first; i != range.second; ++i) {
+      SchemeType* entry = &expansionCache_[i->second];
+      if (entry[0].eq(macro) && formEqual(entry[1], use)) {
+        return entry[2];
+      }
+    }
 
+    expansions_++;
+    size_t errors = schemeStreams->errors_;
+    vector<SchemeType> args;
+    std::copy(begin(use.cdr()), end(use.cdr()), back_inserter(args));
+    SchemeType expanded = callFunc(macro, Args(args));
+    expanded = expandMacros_(expanded);
 
-//-----------------------------------------------------------------------------
-int main(int argc, const char* argv[]) {
-  SchemeAnalyzer a;
-  shared_ptr<Frame> env = make_shared<Frame>(nullptr);
-  setupEnv(env);
+    if (expanded.sexpType() != SchemeType::SexpType::ERR &&
+        schemeStreams->errors_ == errors) {
+      cacheExpansion_(hash, macro, use, expanded);
+    }
+    return expanded;
+  }
 
-  if (argc == 1) {
-    argc = 2;
-    const char* bogus[] = { "--", "--" };
-    argv = bogus;
+  // Adds a triple to the cache.  Once it holds kExpansionCacheSize of them
+  // each new one replaces the oldest, so long-running programs that keep
+  // generating distinct forms don't grow it without bound.
+  void cacheExpansion_(size_t hash, SchemeType& macro, SchemeType& use,
+                       SchemeType& expanded) {
+    size_t slot = nextExpansion_;
+    nextExpansion_ = (nextExpansion_ + 1) % kExpansionCacheSize;
+    if (slot == expansionHashes_.size()) {
+      expansionHashes_.push_back(hash);
+      expansionCache_.push_back(macro);
+      expansionCache_.push_back(use);
+      expansionCache_.push_back(expanded);
+    } else {
+      auto range = expansionIndex_.equal_range(expansionHashes_[slot]);
+      for (auto i = range.first; i != range.second; ++i) {
+        if (i->second == slot * 3) {
+          expansionIndex_.erase(i);
+          break;
+        }
+      }
+      evictions_++;
+      expansionHashes_[slot] = hash;
+      expansionCache_[slot * 3] = macro;
+      expansionCache_[slot * 3 + 1] = use;
+      expansionCache_[slot * 3 + 2] = expanded;
+    }
+    expansionIndex_.emplace(hash, slot * 3);
   }
-  for (int i = 1; i < argc; ++i) {
-    const char* filename = nullptr;
-    if (strcmp(argv[i], "--")) {
-      filename = argv[i];
+
+  static size_t formHash(SchemeType& sexp) {
+    switch (sexp.sexpType()) {
+    case SchemeType::SexpType::CONS:
+      return formHash(sexp.car()) * 31 + formHash(sexp.cdr());
+    case SchemeType::SexpType::ID:
+      return Atom::Hash()(sexp.atom());
+    case SchemeType::SexpType::NUM:
+      return std::hash<Number>()(sexp.num());
+    case SchemeType::SexpType::STR:
+      return std::hash<string>()(sexp.str());
+    case SchemeType::SexpType::BOOL:
+      return sexp.boolVal();
+    default:
+      return std::hash<void*>()(sexp.heapObject());
+    }
+  }
+
+  static bool formEqual(SchemeType& a, SchemeType& b) {
+    if (a.isCons() && b.isCons()) {
+      return formEqual(a.car(), b.car()) && formEqual(a.cdr(), b.cdr());
+    }
+    return a.eq(b);
+  }
+
+  static const size_t kExpansionCacheSize = 4096;
+
+  // (macro, use, expansion) triples, indexed by hash; a root for the heap.
+  // Triple i sits at 3 * i and has hash expansionHashes_[i]; the next one
+  // cached goes in nextExpansion_.
+  vector<SchemeType> expansionCache_;
+  unordered_multimap<size_t, size_t> expansionIndex_;
+  vector<size_t> expansionHashes_;
+  size_t nextExpansion_ = 0;
+  size_t expansions_ = 0;
+  size_t evictions_ = 0;
+  size_t macroVersion_ = 0;
+  std::recursive_mutex expanderMutex_;
+
+ public:
+  Expr analyzeVariable(Atom sym, Scope* scope) {
+    int depth, slot;
+    if (scope && scope->resolve(sym, &depth, &slot)) {
+      return [depth, slot](Frame* env) {
+        return env->lookup(depth, slot);
+      };
+    }
+    auto global = std::make_shared<GlobalRef>(sym);
+    return [global](Frame* env) {
+      return global->get();
+    };
+  }
+
+  Expr analyzeDefineMacro(SchemeType& sexp, Scope* scope) {
+    // sexp is (macro-name <value>)
+    checkForm(atomDefineMacro, sexp);
+    Atom macro_name = sexp.car().atom();
+    Expr analyzedValue = analyze(sexp.cdr().car(), scope);
+    return [this, macro_name, analyzedValue](Frame* env) {
+      // todo: support non-closure values
+      defineMacro(macro_name, analyzedValue(env));
+      return SchemeType::fromBool(true);
+    };
+  }
+
+  Expr analyzeAnd(SchemeType& sexp, Scope* scope, bool tail) {
+    vector<Expr> exprs = analyzeSequence(sexp, scope, tail);
+    return [exprs](Frame* env) {
+      SchemeType last;
+      for (auto& i : exprs) {
+        last = i(env);
+        if (!last.toBool()) {
+          return SchemeType(SchemeType::fromBool(false));
+        }
+      }
+      return last;
+    };
+  }
+
+  Expr analyzeOr(SchemeType& sexp, Scope* scope, bool tail) {
+    vector<Expr> exprs = analyzeSequence(sexp, scope, tail);
+    return [exprs](Frame* env) {
+      SchemeType last;
+      for (auto& i : exprs) {
+        last = i(env);
+        if (last.toBool()) {
+          return last;
+        }
+      }
+      return SchemeType::fromBool(false);
+    };
+  }
+
+  Expr analyzeIf(SchemeType& sexp, Scope* scope, bool tail) {
+    // sexp is (test then [else])
+    checkForm(atomIf, sexp);
+    Expr test = analyze(sexp.car(), scope);
+    Expr then = analyze(sexp.cdr().car(), scope, tail);
+    SchemeType& rest = sexp.cdr().cdr();
+    Expr otherwise = rest.isCons() ?
+      analyze(rest.car(), scope, tail) :
+      [](Frame* env) { return schemeNil; };
+    return [test, then, otherwise](Frame* env) {
+      return test(env).toBool() ? then(env) : otherwise(env);
+    };
+  }
+
+  Expr analyzeBegin(SchemeType& sexp, Scope* scope, bool tail) {
+    return sequence(analyzeSequence(sexp, scope, tail));
+  }
+
+  // Binds each variable to a fresh slot in the current frame rather than
+  // applying a new lambda.  The inits are analyzed before the variables are
+  // declared, so they can't see them and storing each value as soon as it
+  // is computed is as good as binding them in parallel.
+  Expr analyzeLet(SchemeType& sexp, Scope* scope, bool tail) {
+    // sexp is (((var init) ...) body)
+    checkForm(atomLet, sexp);
+    vector<Expr> inits;
+    for (SchemeType& binding : sexp.car()) {
+      inits.push_back(analyze(binding.cdr().car(), scope));
+    }
+
+    size_t mark = scope->mark();
+    vector<int> slots;
+    for (SchemeType& binding : sexp.car()) {
+      slots.push_back(scope->declare(binding.car().atom()));
+    }
+    for (SchemeType& form : sexp.cdr()) {
+      if (carIsId(form, atomDefine)) {
+        scope->declare(defineName(form.cdr()), true);
+      }
+    }
+    Expr body = sequence(analyzeSequence(sexp.cdr(), scope, tail));
+    scope->release(mark);
+
+    return [inits, slots, body](Frame* env) {
+      for (size_t i = 0; i < inits.size(); ++i) {
+        (*env)[slots[i]] = inits[i](env);
+      }
+      return body(env);
+    };
+  }
+
+  Expr analyzeCond(SchemeType& sexp, Scope* scope, bool tail) {
+    // sexp is ((test expr ...) ... [(else expr ...)])
+    checkForm(atomCond, sexp);
+    struct Clause {
+      Expr test;  // empty for else
+      Expr body;  // empty if the value of the test is the result
+    };
+    vector<Clause> clauses;
+    for (SchemeType& clause : sexp) {
+      Clause c;
+      if (!carIsId(clause, atomElse)) {
+        c.test = analyze(clause.car(), scope);
+      }
+      if (!clause.cdr().isNil()) {
+        c.body = sequence(analyzeSequence(clause.cdr(), scope, tail));
+      }
+      clauses.push_back(c);
+    }
+    return [clauses](Frame* env) {
+      for (const Clause& c : clauses) {
+        if (!c.test) {
+          return c.body(env);
+        }
+        SchemeType val = c.test(env);
+        if (val.toBool()) {
+          return c.body ? c.body(env) : val;
+        }
+      }
+      return schemeNil;
+    };
+  }
+
+  Expr analyzeQuote(SchemeType& sexp, Scope* scope) {
+    checkForm(atomQuote, sexp);
+    SchemeType thing = sexp.car();
+    keep(thing, scope);
+    return [thing](Frame* env) {
+      return thing;
+    };
+  }
+
+  // Keeps a constant of the code being analyzed in scope alive for as long
+  // as the code.  The Exprs that return it hold copies the collector can't
+  // see.
+  static void keep(const SchemeType& value, Scope* scope) {
+    if (value.heapObject()) {
+      scope->lambda()->constants_.push_back(value);
+    }
+  }
+
+  // Returns the name bound by a define form, given its cdr, or a null
+  // Atom if the form is malformed.
+  static Atom defineName(SchemeType& sexp) {
+    SchemeType* name = sexp.isCons() ? &sexp.car() : nullptr;
+    if (name && name->isCons()) {
+      name = &name->car();
+    }
+    return name && name->isId() ? name->atom() : Atom();
+  }
+
+  // Number of elements in a proper list, or -1 if sexp isn't one.
+  static int listLength(SchemeType& sexp) {
+    int n = 0;
+    SchemeType* i = &sexp;
+    for (; i->isCons(); i = &i->cdr()) {
+      n++;
+    }
+    return i->isNil() ? n : -1;
+  }
+
+  // Checks the shape of an if, let, cond, lambda, define, define-macro or
+  // quote form, given its cdr.  If it is malformed, reports it and throws
+  // SchemeError, so that every backend fails the whole top-level form.
+  static void checkForm(Atom keyword, SchemeType& sexp) {
+    bool ok = true;
+    if (keyword == atomIf) {
+      int n = listLength(sexp);
+      ok = n == 2 || n == 3;
+    }
+    else if (keyword == atomLambda) {
+      // ((var ... [. rest]) body ...)
+      ok = listLength(sexp) >= 1;
+      SchemeType* var = ok ? &sexp.car() : nullptr;
+      for (; ok && var->isCons(); var = &var->cdr()) {
+        ok = var->car().isId();
+      }
+      ok = ok && (var->isNil() || var->isId());
+    }
+    else if (keyword == atomDefine) {
+      // (name value), or ((name var ... [. rest]) body ...), whose
+      // variables are checked as the lambda's.
+      int n = listLength(sexp);
+      ok = n >= 1 && (sexp.car().isCons() ? sexp.car().car().isId() :
+                      sexp.car().isId() && n == 2);
+    }
+    else if (keyword == atomDefineMacro) {
+      // (name value)
+      ok = listLength(sexp) == 2 && sexp.car().isId();
+    }
+    else if (keyword == atomQuote) {
+      ok = listLength(sexp) == 1;
+    }
+    else if (keyword == atomLet) {
+      // (((var init) ...) body ...)
+      ok = listLength(sexp) >= 1 && listLength(sexp.car()) >= 0;
+      if (ok) {
+        for (SchemeType& binding : sexp.car()) {
+          ok = ok && listLength(binding) == 2 && binding.car().isId();
+        }
+      }
+    }
+    else {
+      // ((test expr ...) ... [(else expr ...)])
+      ok = listLength(sexp) >= 0;
+      for (SchemeType* i = &sexp; ok && i->isCons(); i = &i->cdr()) {
+        SchemeType& clause = i->car();
+        int n = listLength(clause);
+        ok = n >= (carIsId(clause, atomElse) ? 2 : 1);
+      }
+    }
+    if (!ok) {
+      SchemeType form(SchemeType(keyword), sexp);
+      schemeError() << "syntax error: " << form << endl;
+      throw SchemeError();
+    }
+  }
+
+  // Checks that an application is a proper list, as checkForm does.
+  static void checkCall(SchemeType& sexp) {
+    if (listLength(sexp) < 0) {
+      schemeError() << "syntax error: " << sexp << endl;
+      throw SchemeError();
+    }
+  }
+
+  // Rewrites ((lambda (var ...) body ...) init ...), a lambda applied where
+  // it is made, as the cdr of a let form, (((var init) ...) body ...), so
+  // that it runs in the current frame with no closure or call.  Returns
+  // false if sexp isn't one, or the lambda has a rest argument, doesn't
+  // take as many arguments as it is given, or defines one of them.
+  static bool letForm(SchemeType& sexp, SchemeType* let) {
+    if (!carIsId(sexp.car(), atomLambda) || !sexp.car().cdr().isCons() ||
+        !sexp.car().cdr().cdr().isCons()) {
+      return false;
+    }
+    SchemeType& vars = sexp.car().cdr().car();
+    SchemeType& body = sexp.car().cdr().cdr();
+    vector<SchemeType> bindings;
+    SchemeType* var = &vars;
+    SchemeType* init = &sexp.cdr();
+    for (; var->isCons() && init->isCons();
+         var = &var->cdr(), init = &init->cdr()) {
+      if (!var->car().isId()) {
+        return false;
+      }
+      for (SchemeType& form : body) {
+        if (carIsId(form, atomDefine) && form.cdr().isCons() &&
+            defineName(form.cdr()) == var->car().atom()) {
+          return false;
+        }
+      }
+      bindings.push_back(
+        SchemeType(var->car(), SchemeType(init->car(), schemeNil)));
+    }
+    if (!var->isNil() || !init->isNil()) {
+      return false;
+    }
+    SchemeType list = schemeNil;
+    for (size_t i = bindings.size(); i > 0; --i) {
+      list = SchemeType(bindings[i - 1], list);
+    }
+    *let = SchemeType(list, body);
+    return true;
+  }
+
+  // Slot for a define of id in scope, or -1 if it defines a global.
+  static int defineSlot(Atom id, Scope* scope) {
+    if (scope->topLevel()) {
+      // Only defines in let bodies, which were declared up front, are local.
+      return scope->find(id);
+    }
+    return scope->bind(id, true);
+  }
+
+  Expr analyzeDefine(SchemeType& sexp, Scope* scope) {
+    checkForm(atomDefine, sexp);
+    Atom id = defineName(sexp);
+    // Bind before analyzing the value so that recursive references
+    // resolve to the new slot.
+    int slot = defineSlot(id, scope);
+    Expr val;
+    if (sexp.car().isCons()) {
+      // sexp is like ((funcname arg1 arg2) body)
+      SchemeType lambdaSexp(sexp.car().cdr(), sexp.cdr());
+      profiler->copyLine(sexp, lambdaSexp);
+      val = analyzeLambda(lambdaSexp, scope, id, slot);
+    }
+    else if (carIsId(sexp.cdr().car(), atomLambda)) {
+      // Located at the define, like (define (name arg ...) body ...).
+      profiler->copyLine(sexp, sexp.cdr().car().cdr());
+      val = analyzeLambda(sexp.cdr().car().cdr(), scope, id, slot);
+    }
+    else {
+      val = analyze(sexp.cdr().car(), scope);
+    }
+    if (slot >= 0) {
+      scope->defined(slot);
+      return [slot, val](Frame* env) {
+        (*env)[slot] = val(env);
+        return schemeNil;
+      };
+    }
+    Symtab* globals = &globals_;
+    return [globals, id, val](Frame* env) {
+      defineGlobal(*globals, id, val(env));
+      return schemeNil;
+    };
+  }
+
+  //
+  // Assumes that sexp is of the form: ((arg1 arg2) body)
+  //
+  // self is the slot a define stores the closure in, if any.
+  Expr analyzeLambda(SchemeType& sexp, Scope* scope, Atom name = Atom(),
+                     int self = -1) {
+    checkForm(atomLambda, sexp);
+    Scope lambdaScope(scope, sexp.cdr());
+    lambdaScope.setSelf(self);
+    auto lambda = make_shared<Lambda>();
+    lambdaScope.setLambda(lambda.get());
+    scope->lambda()->lambdas_.push_back(lambda);
+
+    // Extract the argument names -- those are in the car.
+    SchemeType *i = &(sexp.car());
+    while (i->isCons()) {
+      lambdaScope.bind(i->car().atom());
+      lambda->argCount_++;
+      i = &(i->cdr());
+    }
+
+    if (!i->isNil()) {
+      lambdaScope.bind(i->atom());
+      lambda->hasRestArg_ = true;
+    }
+
+    // Extract the argument body from the cdr.
+    lambda->expr_ = analyzeBody(sexp.cdr(), &lambdaScope);
+    lambda->frameSize_ = lambdaScope.size();
+    lambda->info_ = profiler->newLambda(name, sexp);
+    lambda->captures_ = lambdaScope.captures();
+    lambda->chain_ = lambdaScope.chain();
+    lambda->heapFrame_ = lambdaScope.escapes();
+    return [lambda](Frame* env) {
+      return makeClosure(lambda, env);
+    };
+  }
+
+  // Analyzes each element of a list.  If tail is set, the last element is
+  // in tail position.
+  vector<Expr> analyzeSequence(SchemeType& sexps, Scope* scope, bool tail) {
+    vector<Expr> exprs;
+    for (SchemeType* i = &sexps; i->isCons(); i = &i->cdr()) {
+      exprs.push_back(analyze(i->car(), scope, tail && i->cdr().isNil()));
+    }
+    return exprs;
+  }
+
+  Expr analyzeBody(SchemeType& sexpBody, Scope* scope) {
+    // Internal defines get their slots up front so that forward references
+    // (e.g. mutually recursive helpers) resolve lexically.
+    for (SchemeType& i : sexpBody) {
+      if (carIsId(i, atomDefine)) {
+        scope->bind(defineName(i.cdr()), true);
+      }
+    }
+
+    return sequence(analyzeSequence(sexpBody, scope, true));
+  }
+
+  // Evaluates exprs in order, returning the value of the last.
+  static Expr sequence(vector<Expr> exprs) {
+    return [exprs](Frame* env) {
+      SchemeType res;
+      for (auto& expr : exprs) {
+        res = expr(env);
+      }
+      return res;
+    };
+  }
+
+  Expr analyzeApplication(SchemeType& sexp, Scope* scope, bool tail) {
+    checkCall(sexp);
+    Expr analyzedFunc = analyze(sexp.car(), scope);
+    vector<Expr> analyzedArgs;
+    std::transform(
+      begin(sexp.cdr()), end(sexp.cdr()),
+      back_inserter(analyzedArgs),
+      [this, scope](SchemeType& i) { return analyze(i, scope); });
+    Expr call = analyzeCall(analyzedFunc, analyzedArgs, tail);
+
+    // Calls to a primitive that is still bound to its global get a
+    // dedicated node, which falls back to call if the global changes.
+    int depth, slot;
+    if (!sexp.car().isId() ||
+        scope->resolve(sexp.car().atom(), &depth, &slot)) {
+      return call;
+    }
+    auto p = primitives_.find(sexp.car().atom());
+    if (p == primitives_.end()) {
+      return call;
+    }
+    auto global = globals_.find(sexp.car().atom());
+    if (global == globals_.end() ||
+        !stillBound(&global->second, p->second.builtin_)) {
+      return call;
+    }
+    SchemeType* cell = &global->second;
+    return p->second.inline_(cell, p->second.builtin_, call, analyzedArgs);
+  }
+
+  Expr analyzeCall(Expr analyzedFunc, vector<Expr>& analyzedArgs,
+                   bool tail) {
+    if (tail) {
+      return [analyzedFunc, analyzedArgs](Frame* env) {
+        vector<SchemeType>& evalStack = Heap::thread().evalStack_;
+        size_t base = evalStack.size();
+        evalStack.push_back(analyzedFunc(env));
+        for (auto& arg : analyzedArgs) {
+          evalStack.push_back(arg(env));
+        }
+        pendingTailCall.func_ = evalStack[base];
+        pendingTailCall.args_.assign(evalStack.begin() + base + 1,
+                                     evalStack.end());
+        evalStack.resize(base);
+        return SchemeType(SchemeType::SexpType::TAIL_CALL);
+      };
+    }
+    return [analyzedFunc, analyzedArgs](Frame* env) {
+      vector<SchemeType>& evalStack = Heap::thread().evalStack_;
+      size_t base = evalStack.size();
+      evalStack.push_back(analyzedFunc(env));
+      for (auto& arg : analyzedArgs) {
+        evalStack.push_back(arg(env));
+      }
+      Args args(evalStack.data() + base + 1, analyzedArgs.size());
+      SchemeType result = callFunc(evalStack[base], args);
+      evalStack.resize(base);
+      return result;
+    };
+  }
+
+ private:
+  // Makes the node for an inlined call to builtin, bound to *cell, or
+  // returns call if the arguments don't fit.
+  using Inliner = Expr (*)(SchemeType* cell, SchemeBuiltin* builtin,
+                           Expr call, vector<Expr>& args);
+
+  struct Primitive {
+    SchemeBuiltin* builtin_;
+    Inliner inline_;
+  };
+
+  void addPrimitive(const string& name, Inliner inliner) {
+    auto i = globals_.find(Atom::intern(name));
+    if (i != globals_.end() &&
+        i->second.sexpType() == SchemeType::SexpType::BUILTIN) {
+      primitives_[i->first] = Primitive{i->second.builtin(), inliner};
+    }
+  }
+
+  static bool stillBound(SchemeType* cell, SchemeBuiltin* builtin) {
+    return cell->sexpType() == SchemeType::SexpType::BUILTIN &&
+      cell->builtin() == builtin;
+  }
+
+  template <class Op>
+  static Expr inline1(SchemeType* cell, SchemeBuiltin* builtin,
+                      Expr call, vector<Expr>& args) {
+    if (args.size() != 1) {
+      return call;
+    }
+    Expr a = args[0];
+    return [cell, builtin, call, a](Frame* env) {
+      if (!stillBound(cell, builtin)) {
+        return call(env);
+      }
+      SchemeType x = a(env);
+      return Op()(x);
+    };
+  }
+
+  template <class Op>
+  static Expr inline2(SchemeType* cell, SchemeBuiltin* builtin,
+                      Expr call, vector<Expr>& args) {
+    if (args.size() != 2) {
+      return call;
+    }
+    Expr a = args[0];
+    Expr b = args[1];
+    return [cell, builtin, call, a, b](Frame* env) {
+      if (!stillBound(cell, builtin)) {
+        return call(env);
+      }
+      SchemeType x = a(env);
+      ValueRoot root(x);
+      SchemeType y = b(env);
+      return Op()(x, y);
+    };
+  }
+
+  Symtab& globals_;
+  unordered_map<Atom, Primitive, Atom::Hash> primitives_;
+};
+
+//-----------------------------------------------------------------------------
+// Bytecode Compiler
+//-----------------------------------------------------------------------------
+
+// The VM is a stack machine.  Calls leave the callee in its stack slot
+// until they return, which keeps the running closure reachable.
+enum class Op : char {
+  CONST,          // push constants_[a]
+  LOCAL,          // push the variable at depth a, slot b
+  GLOBAL,         // push the global named atoms_[a]
+  SET_LOCAL,      // pop into slot a of the current frame
+  DEFINE_LOCAL,   // pop into slot a of the current frame, push ()
+  DEFINE_GLOBAL,  // pop into global atoms_[a], push ()
+  DEFINE_MACRO,   // pop into the macro table as atoms_[a], push #t
+  CLOSURE,        // push a closure over lambdas_[a], made in the current frame
+  POP,
+  JUMP,           // jump to a
+  JUMP_UNLESS,    // pop, and jump to a if the value was false
+  AND_JUMP,       // if the top is false jump to a, else pop
+  OR_JUMP,        // if the top is true jump to a, else pop
+  CALL,           // call the function below the top a values
+  TAIL_CALL,      // like CALL, but replaces the current activation
+  RETURN,
+  MACROEXPAND     // replace the top with its macro expansion
+};
+
+struct Instr {
+  Op op;
+  int a;
+  int b;
+};
+
+// Compiled code for one lambda body or one top-level form.
+struct Code : Lambda {
+  Code() { code_ = this; }
+
+  // Operands of CONST and CLOSURE are indexes into constants_ and
+  // lambdas_.
+  vector<Instr> instrs_;
+  vector<Atom> atoms_;
+  // Inline caches for GLOBAL, one per atom.
+  vector<std::unique_ptr<GlobalRef>> globals_;
+
+  int emit(Op op, int a = 0, int b = 0) {
+    instrs_.push_back(Instr{op, a, b});
+    return instrs_.size() - 1;
+  }
+
+  int constant(const SchemeType& value) {
+    constants_.push_back(value);
+    return constants_.size() - 1;
+  }
+
+  int atom(Atom sym) {
+    auto i = std::find(atoms_.begin(), atoms_.end(), sym);
+    if (i != atoms_.end()) {
+      return i - atoms_.begin();
+    }
+    atoms_.push_back(sym);
+    globals_.emplace_back(new GlobalRef(sym));
+    return atoms_.size() - 1;
+  }
+};
+
+// Compiles macro-expanded forms to bytecode.  Variables are resolved with
+// the same Scope machinery the analyzer uses, so frames look the same to
+// both backends and their closures can call each other freely.
+class BytecodeCompiler {
+ public:
+  shared_ptr<Code> compileTopLevel(SchemeType& sexp) {
+    auto code = make_shared<Code>();
+    Scope scope(nullptr, sexp, true);
+    compile(sexp, *code, &scope, false);
+    code->emit(Op::RETURN);
+    code->frameSize_ = scope.size();
+    return code;
+  }
+
+ private:
+  void compile(SchemeType& sexp, Code& code, Scope* scope, bool tail) {
+    SchemeType let;
+    switch (sexp.sexpType()) {
+    case SchemeType::SexpType::NUM:
+    case SchemeType::SexpType::BOOL:
+    case SchemeType::SexpType::STR:
+    case SchemeType::SexpType::NIL:
+      code.emit(Op::CONST, code.constant(sexp));
+      break;
+    case SchemeType::SexpType::ID: {
+      int depth, slot;
+      if (scope->resolve(sexp.atom(), &depth, &slot)) {
+        code.emit(Op::LOCAL, depth, slot);
+      }
+      else {
+        code.emit(Op::GLOBAL, code.atom(sexp.atom()));
+      }
+      break;
+    }
+    case SchemeType::SexpType::CONS:
+      if (carIsId(sexp, atomLambda))
+        compileLambda(sexp.cdr(), code, scope);
+      else if (carIsId(sexp, atomDefine))
+        compileDefine(sexp.cdr(), code, scope);
+      else if (carIsId(sexp, atomDefineMacro)) {
+        SchemeAnalyzer::checkForm(atomDefineMacro, sexp.cdr());
+        compile(sexp.cdr().cdr().car(), code, scope, false);
+        code.emit(Op::DEFINE_MACRO, code.atom(sexp.cdr().car().atom()));
+      }
+      else if (carIsId(sexp, atomQuote)) {
+        SchemeAnalyzer::checkForm(atomQuote, sexp.cdr());
+        code.emit(Op::CONST, code.constant(sexp.cdr().car()));
+      }
+      else if (carIsId(sexp, atomAnd))
+        compileJunction(sexp.cdr(), code, scope, tail, Op::AND_JUMP);
+      else if (carIsId(sexp, atomOr))
+        compileJunction(sexp.cdr(), code, scope, tail, Op::OR_JUMP);
+      else if (carIsId(sexp, atomIf))
+        compileIf(sexp.cdr(), code, scope, tail);
+      else if (carIsId(sexp, atomBegin))
+        compileSequence(sexp.cdr(), code, scope, tail);
+      else if (carIsId(sexp, atomLet))
+        compileLet(sexp.cdr(), code, scope, tail);
+      else if (carIsId(sexp, atomCond))
+        compileCond(sexp.cdr(), code, scope, tail);
+      else if (carIsId(sexp, atomMe)) {
+        code.emit(Op::CONST, code.constant(sexp.cdr()));
+        code.emit(Op::MACROEXPAND);
+      }
+      else if (SchemeAnalyzer::letForm(sexp, &let))
+        compileLet(let, code, scope, tail);
+      else
+        compileApplication(sexp, code, scope, tail);
+      break;
+    default:
+      code.emit(Op::CONST, code.constant(SchemeType()));
+      break;
+    }
+  }
+
+  // and/or: each operand but the last either short-circuits or is popped.
+  void compileJunction(SchemeType& sexp, Code& code, Scope* scope,
+                       bool tail, Op jump) {
+    if (sexp.isNil()) {
+      code.emit(Op::CONST, code.constant(
+          jump == Op::OR_JUMP ? SchemeType::fromBool(false) : SchemeType()));
+      return;
+    }
+    vector<int> jumps;
+    for (SchemeType* i = &sexp; i->isCons(); i = &i->cdr()) {
+      bool last = i->cdr().isNil();
+      compile(i->car(), code, scope, tail && last);
+      if (!last) {
+        jumps.push_back(code.emit(jump));
+      }
+    }
+    for (int j : jumps) {
+      code.instrs_[j].a = code.instrs_.size();
+    }
+  }
+
+  void compileIf(SchemeType& sexp, Code& code, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkForm(atomIf, sexp);
+    compile(sexp.car(), code, scope, false);
+    int toElse = code.emit(Op::JUMP_UNLESS);
+    compile(sexp.cdr().car(), code, scope, tail);
+    int toEnd = code.emit(Op::JUMP);
+    code.instrs_[toElse].a = code.instrs_.size();
+    SchemeType& rest = sexp.cdr().cdr();
+    if (rest.isCons()) {
+      compile(rest.car(), code, scope, tail);
+    }
+    else {
+      code.emit(Op::CONST, code.constant(schemeNil));
+    }
+    code.instrs_[toEnd].a = code.instrs_.size();
+  }
+
+  // Compiles a body or begin: every value but the last is popped.
+  void compileSequence(SchemeType& sexp, Code& code, Scope* scope,
+                       bool tail) {
+    if (sexp.isNil()) {
+      code.emit(Op::CONST, code.constant(SchemeType()));
+    }
+    for (SchemeType* form = &sexp; form->isCons(); form = &form->cdr()) {
+      bool last = form->cdr().isNil();
+      compile(form->car(), code, scope, tail && last);
+      if (!last) {
+        code.emit(Op::POP);
+      }
+    }
+  }
+
+  // See SchemeAnalyzer::analyzeLet.
+  void compileLet(SchemeType& sexp, Code& code, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkForm(atomLet, sexp);
+    // Inits are left on the stack and stored once all are computed.
+    int count = 0;
+    for (SchemeType& binding : sexp.car()) {
+      compile(binding.cdr().car(), code, scope, false);
+      count++;
+    }
+
+    size_t mark = scope->mark();
+    vector<int> slots;
+    for (SchemeType& binding : sexp.car()) {
+      slots.push_back(scope->declare(binding.car().atom()));
+    }
+    for (int i = count - 1; i >= 0; --i) {
+      code.emit(Op::SET_LOCAL, slots[i]);
+    }
+    for (SchemeType& form : sexp.cdr()) {
+      if (carIsId(form, atomDefine)) {
+        scope->declare(SchemeAnalyzer::defineName(form.cdr()), true);
+      }
+    }
+    compileSequence(sexp.cdr(), code, scope, tail);
+    scope->release(mark);
+  }
+
+  void compileCond(SchemeType& sexp, Code& code, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkForm(atomCond, sexp);
+    vector<int> toEnd;
+    bool sawElse = false;
+    for (SchemeType& clause : sexp) {
+      if (carIsId(clause, atomElse)) {
+        compileSequence(clause.cdr(), code, scope, tail);
+        sawElse = true;
+        break;
+      }
+      compile(clause.car(), code, scope, false);
+      if (clause.cdr().isNil()) {
+        // (test): the value of the test is the result.
+        toEnd.push_back(code.emit(Op::OR_JUMP));
+        continue;
+      }
+      int toNext = code.emit(Op::JUMP_UNLESS);
+      compileSequence(clause.cdr(), code, scope, tail);
+      toEnd.push_back(code.emit(Op::JUMP));
+      code.instrs_[toNext].a = code.instrs_.size();
+    }
+    if (!sawElse) {
+      code.emit(Op::CONST, code.constant(schemeNil));
+    }
+    for (int j : toEnd) {
+      code.instrs_[j].a = code.instrs_.size();
+    }
+  }
+
+  void compileDefine(SchemeType& sexp, Code& code, Scope* scope) {
+    SchemeAnalyzer::checkForm(atomDefine, sexp);
+    Atom id = SchemeAnalyzer::defineName(sexp);
+    int slot = SchemeAnalyzer::defineSlot(id, scope);
+    if (sexp.car().isCons()) {
+      // sexp is like ((funcname arg1 arg2) body)
+      SchemeType lambdaSexp(sexp.car().cdr(), sexp.cdr());
+      profiler->copyLine(sexp, lambdaSexp);
+      compileLambda(lambdaSexp, code, scope, id, slot);
+    }
+    else if (carIsId(sexp.cdr().car(), atomLambda)) {
+      // Located at the define, like (define (name arg ...) body ...).
+      profiler->copyLine(sexp, sexp.cdr().car().cdr());
+      compileLambda(sexp.cdr().car().cdr(), code, scope, id, slot);
+    }
+    else {
+      compile(sexp.cdr().car(), code, scope, false);
+    }
+    if (slot >= 0) {
+      scope->defined(slot);
+      code.emit(Op::DEFINE_LOCAL, slot);
+    }
+    else {
+      code.emit(Op::DEFINE_GLOBAL, code.atom(id));
+    }
+  }
+
+  // Assumes that sexp is of the form: ((arg1 arg2) body)
+  void compileLambda(SchemeType& sexp, Code& code, Scope* scope,
+                     Atom name = Atom(), int self = -1) {
+    SchemeAnalyzer::checkForm(atomLambda, sexp);
+    Scope lambdaScope(scope, sexp.cdr());
+    lambdaScope.setSelf(self);
+    auto lambda = make_shared<Code>();
+    lambda->info_ = profiler->newLambda(name, sexp);
+
+    SchemeType *i = &(sexp.car());
+    while (i->isCons()) {
+      lambdaScope.bind(i->car().atom());
+      lambda->argCount_++;
+      i = &(i->cdr());
+    }
+    if (!i->isNil()) {
+      lambdaScope.bind(i->atom());
+      lambda->hasRestArg_ = true;
+    }
+
+    SchemeType& body = sexp.cdr();
+    for (SchemeType& form : body) {
+      if (carIsId(form, atomDefine)) {
+        lambdaScope.bind(SchemeAnalyzer::defineName(form.cdr()), true);
+      }
+    }
+    compileSequence(body, *lambda, &lambdaScope, true);
+    lambda->emit(Op::RETURN);
+    lambda->frameSize_ = lambdaScope.size();
+    lambda->captures_ = lambdaScope.captures();
+    lambda->chain_ = lambdaScope.chain();
+    lambda->heapFrame_ = lambdaScope.escapes();
+
+    code.lambdas_.push_back(lambda);
+    code.emit(Op::CLOSURE, code.lambdas_.size() - 1);
+  }
+
+  void compileApplication(SchemeType& sexp, Code& code, Scope* scope,
+                          bool tail) {
+    SchemeAnalyzer::checkCall(sexp);
+    compile(sexp.car(), code, scope, false);
+    int nargs = 0;
+    for (SchemeType& arg : sexp.cdr()) {
+      compile(arg, code, scope, false);
+      nargs++;
+    }
+    code.emit(tail ? Op::TAIL_CALL : Op::CALL, nargs);
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Virtual Machine
+//-----------------------------------------------------------------------------
+class VM {
+ public:
+  VM(SchemeAnalyzer& analyzer) :
+      analyzer_(analyzer), globals_(analyzer.globals()) {
+    heap->addRoots(&stack_);
+    heap->addRoots(&frames_);
+  }
+
+  ~VM() {
+    heap->removeRoots(&stack_);
+    heap->removeRoots(&frames_);
+  }
+
+  // Runs top-level code, with a frame only if it binds let variables.
+  SchemeType run(shared_ptr<Code> code) {
+    size_t entry = calls_.size();
+    calls_.push_back(Activation{code.get(), 0, stack_.size()});
+    frames_.push_back(code->frameSize_ ?
+                      Frame::make(nullptr, code->frameSize_) : nullptr);
+    return execute_(entry);
+  }
+
+  // Calls a compiled closure from C++.
+  SchemeType apply(SchemeClosure* closure, Args args) {
+    heap->safePoint();
+    size_t entry = calls_.size();
+    size_t base = stack_.size();
+    // Bind first: args may point into stack_.
+    Frame* env = closure->bind(args.begin(), args.size());
+    stack_.push_back(SchemeType(closure));
+    calls_.push_back(Activation{closure->lambda_->code_, 0, base});
+    frames_.push_back(env);
+    if (profiler->enabled()) {
+      profiler->enter(closure->lambda_->info_);
+    }
+    return execute_(entry);
+  }
+
+ private:
+  struct Activation {
+    Code* code_;
+    size_t pc_;
+    // Stack index of the callee, or of the first value for top-level code.
+    size_t base_;
+  };
+
+  SchemeType pop_() {
+    SchemeType top = stack_.back();
+    stack_.pop_back();
+    return top;
+  }
+
+  // Runs until the activation at entry returns.  If an error is thrown,
+  // pops that activation and everything above it before passing it on.
+  SchemeType execute_(size_t entry) {
+    try {
+      return dispatch_(entry);
+    }
+    catch (const SchemeError&) {
+      stack_.resize(calls_[entry].base_);
+      while (calls_.size() > entry) {
+        calls_.pop_back();
+        Frame::release(frames_.back());
+        frames_.pop_back();
+      }
+      throw;
+    }
+  }
+
+  SchemeType dispatch_(size_t entry);
+
+  SchemeAnalyzer& analyzer_;
+  Symtab& globals_;
+  vector<SchemeType> stack_;
+  vector<Activation> calls_;
+  // Frame of each activation, parallel to calls_ so the heap can see them.
+  vector<Frame*> frames_;
+};
+
+SchemeType VM::dispatch_(size_t entry) {
+  for (;;) {
+    Activation& act = calls_.back();
+    Frame* env = frames_.back();
+    const Instr& in = act.code_->instrs_[act.pc_++];
+    switch (in.op) {
+    case Op::CONST:
+      stack_.push_back(act.code_->constants_[in.a]);
+      break;
+    case Op::LOCAL:
+      stack_.push_back(env->lookup(in.a, in.b));
+      break;
+    case Op::GLOBAL: {
+      GlobalRef& global = *act.code_->globals_[in.a];
+      if (SchemeType* cell = global.cell()) {
+        stack_.push_back(*cell);
+      } else {
+        stack_.push_back(global.get());
+      }
+      break;
+    }
+    case Op::SET_LOCAL:
+      (*env)[in.a] = pop_();
+      break;
+    case Op::DEFINE_LOCAL:
+      (*env)[in.a] = pop_();
+      stack_.push_back(schemeNil);
+      break;
+    case Op::DEFINE_GLOBAL:
+      defineGlobal(globals_, act.code_->atoms_[in.a], pop_());
+      stack_.push_back(schemeNil);
+      break;
+    case Op::DEFINE_MACRO:
+      // todo: support non-closure values
+      analyzer_.defineMacro(act.code_->atoms_[in.a], pop_());
+      stack_.push_back(SchemeType::fromBool(true));
+      break;
+    case Op::CLOSURE:
+      stack_.push_back(makeClosure(act.code_->lambdas_[in.a], env));
+      break;
+    case Op::POP:
+      stack_.pop_back();
+      break;
+    case Op::JUMP:
+      act.pc_ = in.a;
+      break;
+    case Op::JUMP_UNLESS:
+      if (!pop_().toBool()) {
+        act.pc_ = in.a;
+      }
+      break;
+    case Op::AND_JUMP:
+      if (!stack_.back().toBool()) {
+        act.pc_ = in.a;
+      }
+      else {
+        stack_.pop_back();
+      }
+      break;
+    case Op::OR_JUMP:
+      if (stack_.back().toBool()) {
+        act.pc_ = in.a;
+      }
+      else {
+        stack_.pop_back();
+      }
+      break;
+    case Op::MACROEXPAND:
+      stack_.back() = analyzer_.expandMacros(stack_.back());
+      break;
+    case Op::CALL:
+    case Op::TAIL_CALL: {
+      bool tail = in.op == Op::TAIL_CALL;
+      size_t funcIdx = stack_.size() - in.a - 1;
+      SchemeType func = stack_[funcIdx];
+      SchemeClosure* closure =
+        func.sexpType() == SchemeType::SexpType::CLOSURE
+        ? func.closure() : nullptr;
+
+      Code* callee = closure ? closure->lambda_->code_ : nullptr;
+      if (callee) {
+        heap->safePoint();
+        if (tail) {
+          // The arguments are on stack_, so the caller's frame is done with.
+          Frame::release(env);
+        }
+        Frame* newEnv = closure->bind(stack_.data() + funcIdx + 1, in.a);
+        if (profiler->enabled()) {
+          if (tail) {
+            profiler->exit();
+          }
+          profiler->enter(callee->info_);
+        }
+        if (tail) {
+          stack_[act.base_] = func;
+          stack_.resize(act.base_ + 1);
+          act.code_ = callee;
+          act.pc_ = 0;
+          frames_.back() = newEnv;
+        }
+        else {
+          stack_.resize(funcIdx + 1);
+          calls_.push_back(Activation{callee, 0, funcIdx});
+          frames_.push_back(newEnv);
+        }
+        break;
+      }
+
+      // Builtins and tree-walker closures take their arguments straight off
+      // the stack, where they stay rooted.
+      Args args(stack_.data() + funcIdx + 1, in.a);
+      SchemeType result = callFunc(func, args);
+      stack_.resize(funcIdx);
+      stack_.push_back(result);
+      if (!tail) {
+        break;
+      }
+    }
+    // A tail call to a non-VM function falls through to return its result.
+    case Op::RETURN: {
+      // Not act: a call that fell through may have reallocated calls_.
+      Activation& done = calls_.back();
+      if (profiler->enabled() && done.code_->info_) {
+        profiler->exit();
+      }
+      SchemeType result = pop_();
+      size_t base = done.base_;
+      calls_.pop_back();
+      Frame::release(frames_.back());
+      frames_.pop_back();
+      stack_.resize(base);
+      if (calls_.size() == entry) {
+        return result;
+      }
+      stack_.push_back(result);
+      break;
+    }
+    }
+  }
+}
+
+// The calling thread's VM and the analyzer it uses.  Worker threads make
+// their VMs on first use.
+thread_local VM* vm = nullptr;
+thread_local SchemeAnalyzer* vmAnalyzer = nullptr;
+
+void defineGlobal(Symtab& globals, Atom name, const SchemeType& value) {
+  heap->stopWorld();
+  auto inserted = globals.emplace(name, value);
+  if (!inserted.second) {
+    inserted.first->second = value;
+  }
+  heap->resumeWorld();
+  // Macros may have expanded using the old value.
+  if (!inserted.second && vmAnalyzer && &vmAnalyzer->globals() == &globals) {
+    vmAnalyzer->forgetExpansions();
+  }
+}
+
+SchemeType* GlobalRef::find_() {
+  Symtab& globals = vmAnalyzer->globals();
+  auto i = globals.find(name_);
+  if (i == globals.end()) {
+    return nullptr;
+  }
+  builtin_.store(vmAnalyzer->primitive(name_), std::memory_order_relaxed);
+  cell_.store(&i->second, std::memory_order_release);
+  return &i->second;
+}
+
+SchemeType GlobalRef::unbound_() {
+  schemeError() << "undefined variable: " << name_ << endl;
+  throw SchemeError();
+}
+
+SchemeType vmApply(SchemeClosure* closure, Args args) {
+  if (!vm) {
+    vm = new VM(*vmAnalyzer);
+  }
+  return vm->apply(closure, args);
+}
+
+//-----------------------------------------------------------------------------
+// Backends
+//-----------------------------------------------------------------------------
+
+// Keeps a top-level form's code, and so the constants it and its lambdas
+// use, alive for as long as the form may run.
+class CodeRoot {
+ public:
+  explicit CodeRoot(Lambda* lambda) : heap_(heap), lambda_(lambda) {
+    heap_->addRoots(lambda_);
+  }
+  CodeRoot(const CodeRoot&) = delete;
+  CodeRoot& operator=(const CodeRoot&) = delete;
+  ~CodeRoot() { heap_->removeRoots(lambda_); }
+
+ private:
+  Heap* heap_;
+  Lambda* lambda_;
+};
+
+// Runs macro-expanded top-level forms.  A form is compiled into a thunk
+// that can be run any number of times.
+class Backend {
+ public:
+  using Thunk = function<SchemeType()>;
+
+  virtual ~Backend() { }
+  virtual Thunk compile(SchemeType& sexp) = 0;
+  // The VM that runs compiled code, if the backend has one.
+  virtual VM* vm() { return nullptr; }
+
+  SchemeType eval(SchemeType& sexp) { return compile(sexp)(); }
+};
+
+// Evaluates forms by analyzing them into a tree of C++ closures.
+class ClosureBackend : public Backend {
+ public:
+  ClosureBackend(SchemeAnalyzer& analyzer) : analyzer_(analyzer) { }
+
+  Thunk compile(SchemeType& sexp) override {
+    auto lambda = analyzer_.analyze(sexp);
+    auto root = make_shared<CodeRoot>(lambda.get());
+    return [lambda, root]() { return lambda->expr_(nullptr); };
+  }
+
+ private:
+  SchemeAnalyzer& analyzer_;
+};
+
+// Evaluates forms by compiling them to bytecode for the VM.
+class VMBackend : public Backend {
+ public:
+  VMBackend(SchemeAnalyzer& analyzer) : vm_(analyzer) { }
+
+  VM* vm() override { return &vm_; }
+
+  Thunk compile(SchemeType& sexp) override {
+    auto code = compiler_.compileTopLevel(sexp);
+    auto root = make_shared<CodeRoot>(code.get());
+    return [this, code, root]() { return vm_.run(code); };
+  }
+
+ private:
+  BytecodeCompiler compiler_;
+  VM vm_;
+};
+
+//-----------------------------------------------------------------------------
+// Worker Pool
+//-----------------------------------------------------------------------------
+class WorkerPool;
+
+// The pool of the Interpreter the calling thread is running.
+thread_local WorkerPool* workers = nullptr;
+
+// Threads that run futures and pmap chunks.  Each worker has a deque of
+// tasks: it pushes and pops its own at the back and steals from the front
+// of the others'.  Threads that aren't workers push to a shared deque.
+// A thread waiting for tasks to finish runs queued tasks meanwhile.
+//
+// Tasks get no rooting of their own: whoever queues one keeps what it
+// uses alive until it has run.
+class WorkerPool {
+ public:
+  using Task = function<void()>;
+
+  explicit WorkerPool(Heap& heap) : heap_(heap) { heap_.addRoots(&futures_); }
+  ~WorkerPool() { heap_.removeRoots(&futures_); }
+
+  // Threads evaluating at once, counting the one that calls in: the
+  // hardware's by default.  Profiling isn't thread-safe, so it runs
+  // everything on the calling thread.
+  size_t threads() const {
+    if (profiler->enabled()) {
+      return 1;
+    }
+    return threads_ ? threads_
+                    : std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  void setThreads(size_t threads) { threads_ = threads; }
+
+  // Whether push hands tasks to other threads.
+  bool parallel() const { return threads() > 1; }
+
+  void push(Task task) {
+    start_();
+    Queue& queue = *queues_[self_ < 0 ? shared_ : self_];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex_);
+      queue.tasks_.push_back(std::move(task));
+    }
+    queued_++;
+    notify_();
+  }
+
+  // Runs queued tasks until done() holds.  done must be safe to call
+  // while blocked.
+  template <class Done>
+  void helpUntil(Done done) {
+    while (!done()) {
+      Task task;
+      if (take_(task)) {
+        run_(task);
+        continue;
+      }
+      Blocking blocking;
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [&] { return done() || queued_ > 0; });
+    }
+  }
+
+  // Queues a future, which stays rooted until its task is taken.
+  void pushFuture(SchemeFuture* future) {
+    {
+      std::lock_guard<std::mutex> lock(futuresMutex_);
+      future->queued_ = futures_.size();
+      futures_.push_back(SchemeType::fromObject(
+          SchemeType::SexpType::FUTURE, future));
+    }
+    push([future]() {
+      SchemeType value = unqueueFuture_(future);
+      ValueRoot valueRoot(value);
+      runFuture(future);
+    });
+  }
+
+  // Runs future's thunk if nobody else has claimed it.
+  static void runFuture(SchemeFuture* future);
+
+  // Calls made by worker threads, for --stats.
+  size_t calls() const { return calls_; }
+
+  // Finishes the queued tasks and stops the workers.
+  void shutdown() {
+    if (workers_.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      changed_.notify_all();
+    }
+    {
+      Blocking blocking;
+      for (auto& worker : workers_) {
+        worker.join();
+      }
+    }
+    workers_.clear();
+    queues_.clear();
+    stopping_ = false;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex_;
+    std::deque<Task> tasks_;
+  };
+
+  void start_() {
+    if (!queues_.empty()) {
+      return;
+    }
+    size_t count = threads() - 1;
+    for (size_t i = 0; i <= count; ++i) {
+      queues_.emplace_back(new Queue());
+    }
+    shared_ = count;
+    // Workers run in the isolate of the thread that starts them, and
+    // write to whatever streams it has when they do.
+    Profiler* prof = profiler;
+    SchemeStreams* streams = schemeStreams;
+    SchemeAnalyzer* analyzer = vmAnalyzer;
+    for (size_t i = 0; i < count; ++i) {
+      workers_.emplace_back([=]() {
+        heap = &heap_;
+        profiler = prof;
+        workers = this;
+        schemeStreams = streams;
+        vmAnalyzer = analyzer;
+        work_(i);
+      });
+    }
+  }
+
+  void work_(int self) {
+    self_ = self;
+    heap_.enter();
+    for (;;) {
+      Task task;
+      if (take_(task)) {
+        run_(task);
+        calls_ += callCount;
+        callCount = 0;
+        continue;
+      }
+      Blocking blocking;
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+      if (stopping_ && queued_ == 0) {
+        break;
+      }
+    }
+    delete vm;
+    vm = nullptr;
+    heap_.leave();
+  }
+
+  // Tells threads waiting in helpUntil that a task has finished.
+  void notify_() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    changed_.notify_all();
+  }
+
+  void run_(Task& task) {
+    task();
+    notify_();
+  }
+
+  bool take_(Task& task) {
+    if (queued_ == 0 || queues_.empty()) {
+      return false;
+    }
+    if (self_ >= 0 && takeFrom_(*queues_[self_], task, false)) {
+      return true;
+    }
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      size_t victim = (self_ + 1 + i) % queues_.size();
+      if (takeFrom_(*queues_[victim], task, true)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool takeFrom_(Queue& queue, Task& task, bool front) {
+    std::lock_guard<std::mutex> lock(queue.mutex_);
+    if (queue.tasks_.empty()) {
+      return false;
+    }
+    if (front) {
+      task = std::move(queue.tasks_.front());
+      queue.tasks_.pop_front();
+    }
+    else {
+      task = std::move(queue.tasks_.back());
+      queue.tasks_.pop_back();
+    }
+    queued_--;
+    return true;
+  }
+
+  static SchemeType unqueueFuture_(SchemeFuture* future);
+
+  Heap& heap_;
+  size_t threads_ = 0;
+  vector<std::unique_ptr<Queue>> queues_;
+  size_t shared_ = 0;
+  vector<std::thread> workers_;
+  static thread_local int self_;
+
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> calls_{0};
+  // Guards stopping_ and orders changes to queued_ and futures' state
+  // with changed_.
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool stopping_ = false;
+
+  std::mutex futuresMutex_;
+  vector<SchemeType> futures_;
+};
+
+thread_local int WorkerPool::self_ = -1;
+
+SchemeType WorkerPool::unqueueFuture_(SchemeFuture* future) {
+  std::lock_guard<std::mutex> lock(workers->futuresMutex_);
+  auto& futures = workers->futures_;
+  SchemeType value = futures[future->queued_];
+  futures[future->queued_] = futures.back();
+  futures[future->queued_].future()->queued_ = future->queued_;
+  futures.pop_back();
+  return value;
+}
+
+void WorkerPool::runFuture(SchemeFuture* future) {
+  if (!future->claim()) {
+    return;
+  }
+  SchemeType thunk = future->thunk_;
+  UnwindPoint unwind;
+  try {
+    future->result_ = callFunc(thunk, Args(nullptr, 0));
+  }
+  catch (const SchemeError&) {
+    unwind.restore();
+    future->failed_ = true;
+  }
+  future->thunk_ = SchemeType();
+  future->state_ = SchemeFuture::DONE;
+  workers->notify_();
+}
+
+//-----------------------------------------------------------------------------
+// Environment & Builtin Functions
+//-----------------------------------------------------------------------------
+
+SchemeBuiltin* defineBuiltin(Symtab& env, const string& name) {
+  auto builtin = heap->make<SchemeBuiltin>();
+  builtin->info_ = profiler->newBuiltin(name);
+  env[Atom::intern(name)] = SchemeType(builtin);
+  return builtin;
+}
+
+// Helper to make math environment expressions.  Op is a functor such as
+// std::plus<Number>; two-argument calls skip the fold.
+template <class Op>
+void envMath(Symtab& env, const string& op) {
+  SchemeBuiltin* builtin = defineBuiltin(env, op);
+  builtin->fixed2_ = [](SchemeType& a, SchemeType& b) {
+    return NumOp<Op>()(a, b);
+  };
+  builtin->func_ = [](Args args) {
+    if (args.size() == 0) {
+      return wrongArgCount(args);
+    }
+    for (SchemeType& x : args) {
+      if (!x.isNum()) {
+        return badArgument("a number", x);
+      }
+    }
+    return SchemeType(
+      std::accumulate(args.begin() + 1, args.end(),
+                      args[0].num(),
+                      [](Number a, SchemeType& b) {
+                        return Op()(a, b.num());
+                      }));
+  };
+}
+
+template <class Op>
+void envMathCmp(Symtab& env, const string& op) {
+  SchemeBuiltin* builtin = defineBuiltin(env, op);
+  builtin->fixed2_ = [](SchemeType& a, SchemeType& b) {
+    return CmpOp<Op>()(a, b);
+  };
+  builtin->func_ = [](Args args) {
+    for (SchemeType& x : args) {
+      if (!x.isNum()) {
+        return badArgument("a number", x);
+      }
+    }
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (!Op()(args[i - 1].num(), args[i].num())) {
+        return SchemeType::fromBool(false);
+      }
+    }
+    return SchemeType::fromBool(true);
+  };
+}
+
+// Kernels behind the numeric vector builtins.  On x86-64 the f64vector
+// kernels work on two doubles per SSE2 instruction; everything else is a
+// plain loop.  s64vector addition, subtraction and multiplication wrap
+// around modulo 2^64 instead of overflowing.
+inline int64_t wrapInt64(uint64_t x) {
+  return x <= INT64_MAX ? int64_t(x) : -int64_t(~x) - 1;
+}
+
+struct AddKernel {
+  static const char* suffix() { return "-add"; }
+
+  template <typename T>
+  T operator()(T a, T b) const { return a + b; }
+  int64_t operator()(int64_t a, int64_t b) const {
+    return wrapInt64(uint64_t(a) + uint64_t(b));
+  }
+#ifdef __SSE2__
+  __m128d operator()(__m128d a, __m128d b) const { return _mm_add_pd(a, b); }
+#endif
+};
+
+struct SubKernel {
+  static const char* suffix() { return "-sub"; }
+
+  template <typename T>
+  T operator()(T a, T b) const { return a - b; }
+  int64_t operator()(int64_t a, int64_t b) const {
+    return wrapInt64(uint64_t(a) - uint64_t(b));
+  }
+#ifdef __SSE2__
+  __m128d operator()(__m128d a, __m128d b) const { return _mm_sub_pd(a, b); }
+#endif
+};
+
+struct MulKernel {
+  static const char* suffix() { return "-mul"; }
+
+  template <typename T>
+  T operator()(T a, T b) const { return a * b; }
+  int64_t operator()(int64_t a, int64_t b) const {
+    return wrapInt64(uint64_t(a) * uint64_t(b));
+  }
+#ifdef __SSE2__
+  __m128d operator()(__m128d a, __m128d b) const { return _mm_mul_pd(a, b); }
+#endif
+};
+
+struct DivKernel {
+  static const char* suffix() { return "-div"; }
+
+  template <typename T>
+  T operator()(T a, T b) const { return a / b; }
+#ifdef __SSE2__
+  __m128d operator()(__m128d a, __m128d b) const { return _mm_div_pd(a, b); }
+#endif
+};
+
+struct MinKernel {
+  template <typename T>
+  T operator()(T a, T b) const { return b < a ? b : a; }
+#ifdef __SSE2__
+  __m128d operator()(__m128d a, __m128d b) const { return _mm_min_pd(a, b); }
+#endif
+};
+
+struct MaxKernel {
+  template <typename T>
+  T operator()(T a, T b) const { return a < b ? b : a; }
+#ifdef __SSE2__
+  __m128d operator()(__m128d a, __m128d b) const { return _mm_max_pd(a, b); }
+#endif
+};
+
+// out[i] = op(a[i], b[i]).  out may be a or b.
+template <class Op, typename T>
+void zipKernel(Op op, const T* a, const T* b, T* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = op(a[i], b[i]);
+  }
+}
+
+// Folds op over a, starting from init, which must be an identity of op
+// (e.g. 0 for addition) or already an element of a if op is min or max.
+template <class Op, typename T>
+T foldKernel(Op op, const T* a, size_t n, T init) {
+  T acc = init;
+  for (size_t i = 0; i < n; ++i) {
+    acc = op(acc, a[i]);
+  }
+  return acc;
+}
+
+template <typename T>
+T dotKernel(const T* a, const T* b, size_t n) {
+  T acc = 0;
+  for (size_t i = 0; i < n; ++i) {
+    acc = AddKernel()(acc, MulKernel()(a[i], b[i]));
+  }
+  return acc;
+}
+
+#ifdef __SSE2__
+template <class Op>
+void zipKernel(Op op, const double* a, const double* b, double* out,
+               size_t n) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(out + i, op(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = op(a[i], b[i]);
+  }
+}
+
+// Keeps four partial results in two registers, so sums are associated
+// differently from a left-to-right loop.
+template <class Op>
+double foldKernel(Op op, const double* a, size_t n, double init) {
+  __m128d acc0 = _mm_set1_pd(init);
+  __m128d acc1 = acc0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 = op(acc0, _mm_loadu_pd(a + i));
+    acc1 = op(acc1, _mm_loadu_pd(a + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, op(acc0, acc1));
+  double acc = op(lanes[0], lanes[1]);
+  for (; i < n; ++i) {
+    acc = op(acc, a[i]);
+  }
+  return acc;
+}
+
+inline double dotKernel(const double* a, const double* b, size_t n) {
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = acc0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i),
+                                       _mm_loadu_pd(b + i)));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+                                       _mm_loadu_pd(b + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  double acc = lanes[0] + lanes[1];
+  for (; i < n; ++i) {
+    acc += a[i] * b[i];
+  }
+  return acc;
+}
+#endif
+
+template <class V>
+const char* numVectorName();
+template <>
+const char* numVectorName<F64Vector>() { return "f64vector"; }
+template <>
+const char* numVectorName<S64Vector>() { return "s64vector"; }
+
+// Reports an error in a numeric vector builtin and throws SchemeError.
+template <class V>
+[[noreturn]] SchemeType numVectorError(const char* op, const char* msg) {
+  schemeError() << numVectorName<V>() << op << ": " << msg << endl;
+  throw SchemeError();
+}
+
+// The vector x; reported as a bad argument if x isn't one.
+template <class V>
+V* numVectorArg(SchemeType& x) {
+  if (x.sexpType() != V::kType) {
+    badArgument(("an " + string(numVectorName<V>())).c_str(), x);
+  }
+  return x.numVector<V>();
+}
+
+// Converts a number to an element, which for s64vectors must be an
+// integer in range.
+bool toElement(SchemeType& x, double* out) {
+  if (!x.isNum()) {
+    return false;
+  }
+  *out = x.num();
+  return true;
+}
+
+bool toElement(SchemeType& x, int64_t* out) {
+  if (!x.isNum()) {
+    return false;
+  }
+  Number num = x.num();
+  if (num != std::trunc(num) || num < -9223372036854775808.0 ||
+      num >= 9223372036854775808.0) {
+    return false;
+  }
+  *out = static_cast<int64_t>(num);
+  return true;
+}
+
+// Combines corresponding elements of a and b with Op into a new vector.
+// op names the builtin for error messages.
+template <class V, class Op>
+SchemeType zipNumVectors(const char* op, V* a, V* b) {
+  if (a->size() != b->size()) {
+    return numVectorError<V>(op, "lengths differ");
+  }
+  // Integer division traps on both of these rather than returning a value.
+  if (std::is_same<Op, DivKernel>::value &&
+      std::is_integral<typename V::Element>::value) {
+    for (size_t i = 0; i < a->size(); ++i) {
+      if ((*b)[i] == 0) {
+        return numVectorError<V>(op, "division by zero");
+      }
+      if ((*b)[i] == -1 && (*a)[i] == INT64_MIN) {
+        return numVectorError<V>(op, "division overflow");
+      }
+    }
+  }
+  V* out = V::make(a->size());
+  zipKernel(Op(), a->data(), b->data(), out->data(), a->size());
+  return out->value();
+}
+
+template <class V, class Op>
+void envNumVectorZip(Symtab& env) {
+  defineBuiltin(env, numVectorName<V>() + string(Op::suffix()))->fixed2_ =
+    [](SchemeType& x, SchemeType& y) {
+      V* a = numVectorArg<V>(x);
+      V* b = numVectorArg<V>(y);
+      return zipNumVectors<V, Op>(Op::suffix(), a, b);
+    };
+}
+
+// (f64vector-map f v) applies f to each element of v, and (f64vector-map f
+// v w) to each pair of corresponding elements.  When f is one of the
+// arithmetic builtins, v and w are combined by a vector kernel instead.
+template <class V>
+SchemeType mapNumVector(Args args) {
+  if (args.size() != 2 && args.size() != 3) {
+    return wrongArgCount(args);
+  }
+  // Copied out of args: f may run Scheme code.
+  SchemeType func = args[0];
+  SchemeType x = args[1];
+  SchemeType y = args.size() == 3 ? args[2] : x;
+  ValueRoot funcRoot(func), xRoot(x), yRoot(y);
+  V* a = numVectorArg<V>(x);
+  V* b = numVectorArg<V>(y);
+
+  if (args.size() == 3 && func.sexpType() == SchemeType::SexpType::BUILTIN) {
+    const string& name = func.builtin()->info_->name_;
+    if (name == "+") {
+      return zipNumVectors<V, AddKernel>("-map", a, b);
+    }
+    if (name == "-") {
+      return zipNumVectors<V, SubKernel>("-map", a, b);
+    }
+    if (name == "*") {
+      return zipNumVectors<V, MulKernel>("-map", a, b);
+    }
+    if (name == "/") {
+      return zipNumVectors<V, DivKernel>("-map", a, b);
+    }
+  }
+
+  if (a->size() != b->size()) {
+    return numVectorError<V>("-map", "lengths differ");
+  }
+  SchemeType result = V::make(a->size())->value();
+  ValueRoot resultRoot(result);
+  V* out = result.numVector<V>();
+  for (size_t i = 0; i < a->size(); ++i) {
+    SchemeType elems[2] = { SchemeType(Number((*a)[i])),
+                            SchemeType(Number((*b)[i])) };
+    SchemeType value = callFunc(func, Args(elems, args.size() - 1));
+    if (!value.isNum() || !toElement(value, &(*out)[i])) {
+      return numVectorError<V>("-map", "result is not an element");
+    }
+  }
+  return result;
+}
+
+// Defines the builtins for one kind of numeric vector, e.g. for V =
+// F64Vector: make-f64vector, f64vector, f64vector?, f64vector-length,
+// f64vector-ref, f64vector-set!, f64vector->list, list->f64vector,
+// f64vector-add, -sub, -mul, -div, -sum, -dot, -min, -max and -map.
+template <class V>
+void envNumVector(Symtab& env) {
+  using T = typename V::Element;
+  const string name = numVectorName<V>();
+
+  defineBuiltin(env, "make-" + name)->func_ = [](Args args) {
+    if (args.size() != 1 && args.size() != 2) {
+      return wrongArgCount(args);
+    }
+    T fill = 0;
+    // Checked against maxSize() before it is converted to a size_t.
+    if (!args[0].isNum() || args[0].num() < 0 ||
+        args[0].num() != std::trunc(args[0].num()) ||
+        !(args[0].num() < double(V::maxSize()))) {
+      return numVectorError<V>("", "bad length");
+    }
+    if (args.size() == 2 && !toElement(args[1], &fill)) {
+      return numVectorError<V>("", "fill is not an element");
+    }
+    V* v = V::make(size_t(args[0].num()));
+    std::fill(v->data(), v->data() + v->size(), fill);
+    return v->value();
+  };
+  defineBuiltin(env, name)->func_ = [](Args args) {
+    V* v = V::make(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (!toElement(args[i], &(*v)[i])) {
+        return numVectorError<V>("", "argument is not an element");
+      }
+    }
+    return v->value();
+  };
+  defineBuiltin(env, name + "?")->fixed1_ = [](SchemeType& x) {
+    return SchemeType::fromBool(x.sexpType() == V::kType);
+  };
+  defineBuiltin(env, name + "-length")->fixed1_ = [](SchemeType& x) {
+    V* v = numVectorArg<V>(x);
+    return SchemeType(Number(v->size()));
+  };
+  defineBuiltin(env, name + "-ref")->fixed2_ = [](SchemeType& x,
+                                                  SchemeType& k) {
+    V* v = numVectorArg<V>(x);
+    if (!k.isNum() || !(k.num() >= 0 && k.num() < v->size())) {
+      return numVectorError<V>("-ref", "index out of range");
+    }
+    return SchemeType(Number((*v)[size_t(k.num())]));
+  };
+  defineBuiltin(env, name + "-set!")->fixed3_ = [](SchemeType& x,
+                                                   SchemeType& k,
+                                                   SchemeType& value) {
+    V* v = numVectorArg<V>(x);
+    if (!k.isNum() || !(k.num() >= 0 && k.num() < v->size())) {
+      return numVectorError<V>("-set!", "index out of range");
+    }
+    if (!toElement(value, &(*v)[size_t(k.num())])) {
+      return numVectorError<V>("-set!", "value is not an element");
+    }
+    return schemeNil;
+  };
+  defineBuiltin(env, name + "->list")->fixed1_ = [](SchemeType& x) {
+    V* v = numVectorArg<V>(x);
+    SchemeType list = schemeNil;
+    for (size_t i = v->size(); i > 0; --i) {
+      list = SchemeType(SchemeType(Number((*v)[i - 1])), list);
+    }
+    return list;
+  };
+  defineBuiltin(env, "list->" + name)->fixed1_ = [](SchemeType& list) {
+    size_t size = 0;
+    for (SchemeType* i = &list; i->isCons(); i = &i->cdr()) {
+      size++;
+    }
+    V* v = V::make(size);
+    SchemeType* i = &list;
+    for (size_t k = 0; k < size; ++k, i = &i->cdr()) {
+      if (!toElement(i->car(), &(*v)[k])) {
+        return numVectorError<V>("", "list element is not an element");
+      }
+    }
+    return v->value();
+  };
+
+  envNumVectorZip<V, AddKernel>(env);
+  envNumVectorZip<V, SubKernel>(env);
+  envNumVectorZip<V, MulKernel>(env);
+  envNumVectorZip<V, DivKernel>(env);
+
+  defineBuiltin(env, name + "-sum")->fixed1_ = [](SchemeType& x) {
+    V* v = numVectorArg<V>(x);
+    return SchemeType(Number(foldKernel(AddKernel(), v->data(), v->size(),
+                                        T(0))));
+  };
+  defineBuiltin(env, name + "-dot")->fixed2_ = [](SchemeType& x,
+                                                  SchemeType& y) {
+    V* a = numVectorArg<V>(x);
+    V* b = numVectorArg<V>(y);
+    if (a->size() != b->size()) {
+      return numVectorError<V>("-dot", "lengths differ");
+    }
+    return SchemeType(Number(dotKernel(a->data(), b->data(), a->size())));
+  };
+  defineBuiltin(env, name + "-min")->fixed1_ = [](SchemeType& x) {
+    V* v = numVectorArg<V>(x);
+    if (v->size() == 0) {
+      return numVectorError<V>("-min", "empty vector");
+    }
+    return SchemeType(Number(foldKernel(MinKernel(), v->data(), v->size(),
+                                        (*v)[0])));
+  };
+  defineBuiltin(env, name + "-max")->fixed1_ = [](SchemeType& x) {
+    V* v = numVectorArg<V>(x);
+    if (v->size() == 0) {
+      return numVectorError<V>("-max", "empty vector");
+    }
+    return SchemeType(Number(foldKernel(MaxKernel(), v->data(), v->size(),
+                                        (*v)[0])));
+  };
+  defineBuiltin(env, name + "-map")->func_ = &mapNumVector<V>;
+}
+
+// The table x; reported as a bad argument if x isn't one.
+SchemeHashTable* hashTableArg(SchemeType& x) {
+  if (x.sexpType() != SchemeType::SexpType::HASHTABLE) {
+    badArgument("a hash table", x);
+  }
+  return x.hashTable();
+}
+
+// Lists f(key, value) for each entry of table, in no particular order.
+template <class F>
+SchemeType hashTableList(SchemeType& table, F f) {
+  SchemeHashTable* t = hashTableArg(table);
+  SchemeType list = schemeNil;
+  for (auto& slot : t->slots()) {
+    if (slot.state_ == SchemeHashTable::Slot::FULL) {
+      list = SchemeType(f(slot.key_, slot.value_), list);
+    }
+  }
+  return list;
+}
+
+// Hash tables after SRFI 69.  (make-hash-table) compares keys with equal?,
+// and (make-hash-table eq?) with eq?.
+void envHashTables(Symtab& env) {
+  defineBuiltin(env, "make-hash-table")->func_ = [](Args args) {
+    bool equal = true;
+    if (args.size() == 1) {
+      const string& name = args[0].sexpType() == SchemeType::SexpType::BUILTIN
+        ? args[0].builtin()->info_->name_ : string();
+      if (name != "eq?" && name != "equal?") {
+        schemeError()
+          << "make-hash-table: keys must be compared by eq? or equal?" << endl;
+        throw SchemeError();
+      }
+      equal = name == "equal?";
+    }
+    return SchemeType::fromObject(SchemeType::SexpType::HASHTABLE,
+                                  heap->make<SchemeHashTable>(equal));
+  };
+  defineBuiltin(env, "hash-table?")->fixed1_ = [](SchemeType& x) {
+    return SchemeType::fromBool(
+      x.sexpType() == SchemeType::SexpType::HASHTABLE);
+  };
+  // (hash-table-ref table key [default])
+  defineBuiltin(env, "hash-table-ref")->func_ = [](Args args) {
+    if (args.size() != 2 && args.size() != 3) {
+      return wrongArgCount(args);
+    }
+    SchemeHashTable* table = hashTableArg(args[0]);
+    SchemeType* value = table->find(args[1]);
+    if (value) {
+      return *value;
+    }
+    if (args.size() == 3) {
+      return args[2];
+    }
+    schemeError() << "hash-table-ref: no such key: " << args[1] << endl;
+    throw SchemeError();
+  };
+  defineBuiltin(env, "hash-table-set!")->fixed3_ = [](SchemeType& table,
+                                                      SchemeType& key,
+                                                      SchemeType& value) {
+    SchemeHashTable* t = hashTableArg(table);
+    t->set(key, value);
+    return schemeNil;
+  };
+  defineBuiltin(env, "hash-table-delete!")->fixed2_ = [](SchemeType& table,
+                                                         SchemeType& key) {
+    SchemeHashTable* t = hashTableArg(table);
+    t->remove(key);
+    return schemeNil;
+  };
+  defineBuiltin(env, "hash-table-contains?")->fixed2_ = [](SchemeType& table,
+                                                           SchemeType& key) {
+    SchemeHashTable* t = hashTableArg(table);
+    return SchemeType::fromBool(t->find(key) != nullptr);
+  };
+  defineBuiltin(env, "hash-table-count")->fixed1_ = [](SchemeType& table) {
+    SchemeHashTable* t = hashTableArg(table);
+    return SchemeType(Number(t->count()));
+  };
+  defineBuiltin(env, "hash-table-keys")->fixed1_ = [](SchemeType& table) {
+    return hashTableList(table, [](SchemeType& k, SchemeType& v) {
+      return k;
+    });
+  };
+  defineBuiltin(env, "hash-table-values")->fixed1_ = [](SchemeType& table) {
+    return hashTableList(table, [](SchemeType& k, SchemeType& v) {
+      return v;
+    });
+  };
+  defineBuiltin(env, "hash-table->alist")->fixed1_ = [](SchemeType& table) {
+    return hashTableList(table, [](SchemeType& k, SchemeType& v) {
+      return SchemeType(k, v);
+    });
+  };
+  // (hash-table-walk table proc) calls (proc key value) for each entry.
+  // Entries proc adds or deletes don't affect the walk.
+  defineBuiltin(env, "hash-table-walk")->fixed2_ = [](SchemeType& table,
+                                                      SchemeType& proc) {
+    SchemeHashTable* t = hashTableArg(table);
+    SchemeType func = proc;
+    ValueRoot funcRoot(func);
+    vector<SchemeType> entries;
+    VectorRoot entriesRoot(entries);
+    for (auto& slot : t->slots()) {
+      if (slot.state_ == SchemeHashTable::Slot::FULL) {
+        entries.push_back(slot.key_);
+        entries.push_back(slot.value_);
+      }
+    }
+    for (size_t i = 0; i < entries.size(); i += 2) {
+      callFunc(func, Args(&entries[i], 2));
+    }
+    return schemeNil;
+  };
+}
+
+// Calls func on each of inputs, in chunks spread over the worker pool, and
+// stores the results in outputs unless it is null.  The caller roots all
+// three.
+void parallelApply(SchemeType& func, vector<SchemeType>& inputs,
+                   vector<SchemeType>* outputs) {
+  size_t size = inputs.size();
+  if (!workers->parallel() || size < 2) {
+    for (size_t i = 0; i < size; ++i) {
+      SchemeType result = callFunc(func, Args(&inputs[i], 1));
+      if (outputs) {
+        (*outputs)[i] = result;
+      }
+    }
+    return;
+  }
+  // A few chunks per thread, so that stealing can even out uneven ones.
+  // An error stops its chunk, and fails the whole call once the other
+  // chunks, which still use inputs and outputs, are done.
+  size_t chunk = std::max(size / (4 * workers->threads()), size_t(1));
+  std::atomic<size_t> remaining((size + chunk - 1) / chunk);
+  std::atomic<bool> failed(false);
+  for (size_t begin = 0; begin < size; begin += chunk) {
+    size_t end = std::min(begin + chunk, size);
+    workers->push([&, begin, end]() {
+      UnwindPoint unwind;
+      try {
+        for (size_t i = begin; i < end; ++i) {
+          SchemeType result = callFunc(func, Args(&inputs[i], 1));
+          if (outputs) {
+            (*outputs)[i] = result;
+          }
+        }
+      }
+      catch (const SchemeError&) {
+        unwind.restore();
+        failed = true;
+      }
+      remaining--;
+    });
+  }
+  workers->helpUntil([&remaining] { return remaining == 0; });
+  if (failed) {
+    throw SchemeError();
+  }
+}
+
+// Futures and parallel maps, run by the worker pool.  Threads share every
+// mutable object, and nothing but globals and macros is synchronized: a
+// task that mutates shared pairs, vectors or hash tables must not race
+// with others.
+void envParallel(Symtab& env) {
+  // (make-future thunk) queues a call of thunk; lib.scm's (future expr)
+  // wraps expr in one.
+  defineBuiltin(env, "make-future")->fixed1_ = [](SchemeType& thunk) {
+    if (thunk.sexpType() != SchemeType::SexpType::CLOSURE &&
+        thunk.sexpType() != SchemeType::SexpType::BUILTIN) {
+      return badArgument("a procedure", thunk);
+    }
+    auto future = heap->make<SchemeFuture>(thunk);
+    if (workers->parallel()) {
+      workers->pushFuture(future);
+    }
+    return SchemeType::fromObject(SchemeType::SexpType::FUTURE, future);
+  };
+  defineBuiltin(env, "future?")->fixed1_ = [](SchemeType& x) {
+    return SchemeType::fromBool(
+      x.sexpType() == SchemeType::SexpType::FUTURE);
+  };
+  // (touch future) is the thunk's value, calling the thunk first if no
+  // thread has started it.  It fails if the thunk did.
+  defineBuiltin(env, "touch")->fixed1_ = [](SchemeType& x) {
+    if (x.sexpType() != SchemeType::SexpType::FUTURE) {
+      return badArgument("a future", x);
+    }
+    SchemeType value = x;
+    ValueRoot valueRoot(value);
+    SchemeFuture* future = value.future();
+    if (!future->done()) {
+      WorkerPool::runFuture(future);
+      workers->helpUntil([future] { return future->done(); });
+    }
+    if (future->failed_) {
+      // Reported by whichever thread ran the thunk.
+      throw SchemeError();
+    }
+    return future->result_;
+  };
+  // (pmap f list) is (map f list), with the calls made in parallel.
+  defineBuiltin(env, "pmap")->fixed2_ = [](SchemeType& proc,
+                                           SchemeType& list) {
+    SchemeType func = proc;
+    ValueRoot funcRoot(func);
+    vector<SchemeType> inputs;
+    VectorRoot inputsRoot(inputs);
+    for (SchemeType i = list; i.isCons(); i = i.cdr()) {
+      inputs.push_back(i.car());
+    }
+    vector<SchemeType> outputs(inputs.size());
+    VectorRoot outputsRoot(outputs);
+    parallelApply(func, inputs, &outputs);
+    SchemeType result = schemeNil;
+    for (size_t i = outputs.size(); i-- > 0;) {
+      result = SchemeType(outputs[i], result);
+    }
+    return result;
+  };
+  // (parallel-for-each f list) calls f on each element, in parallel.
+  defineBuiltin(env, "parallel-for-each")->fixed2_ = [](SchemeType& proc,
+                                                        SchemeType& list) {
+    SchemeType func = proc;
+    ValueRoot funcRoot(func);
+    vector<SchemeType> inputs;
+    VectorRoot inputsRoot(inputs);
+    for (SchemeType i = list; i.isCons(); i = i.cdr()) {
+      inputs.push_back(i.car());
+    }
+    parallelApply(func, inputs, nullptr);
+    return schemeNil;
+  };
+}
+
+void setupEnv(Symtab& env) {
+  envMath<std::plus<Number>>(env, "+");
+  envMath<std::multiplies<Number>>(env, "*");
+  envMath<std::minus<Number>>(env, "-");
+  envMath<std::divides<Number>>(env, "/");
+
+  envMathCmp<std::equal_to<Number>>(env, "=");
+  envMathCmp<std::less<Number>>(env, "<");
+  envMathCmp<std::greater<Number>>(env, ">");
+
+  envNumVector<F64Vector>(env);
+  envNumVector<S64Vector>(env);
+  envHashTables(env);
+  envParallel(env);
+
+  SchemeBuiltin* eq = defineBuiltin(env, "eq?");
+  eq->fixed2_ = [](SchemeType& a, SchemeType& b) { return EqOp()(a, b); };
+  eq->func_ = [](Args args) {
+    return SchemeType::fromBool(
+      std::all_of(args.begin(), args.end(),
+                  [&args](SchemeType& i) { return args[0].eq(i); }));
+  };
+  SchemeBuiltin* equal = defineBuiltin(env, "equal?");
+  equal->fixed2_ = [](SchemeType& a, SchemeType& b) {
+    return SchemeType::fromBool(a.equal(b));
+  };
+  equal->func_ = [](Args args) {
+    return SchemeType::fromBool(
+      std::all_of(args.begin(), args.end(),
+                  [&args](SchemeType& i) { return args[0].equal(i); }));
+  };
+  defineBuiltin(env, "cons")->fixed2_ = [](SchemeType& a, SchemeType& b) {
+    return ConsOp()(a, b);
+  };
+  defineBuiltin(env, "car")->fixed1_ = [](SchemeType& p) {
+    return CarOp()(p);
+  };
+  defineBuiltin(env, "cdr")->fixed1_ = [](SchemeType& p) {
+    return CdrOp()(p);
+  };
+  defineBuiltin(env, "pair?")->fixed1_ = [](SchemeType& x) {
+    return PairOp()(x);
+  };
+  defineBuiltin(env, "null?")->fixed1_ = [](SchemeType& x) {
+    return NullOp()(x);
+  };
+  defineBuiltin(env, "display")->func_ = [](Args args) {
+    // One write, so that displays from other threads don't interleave.
+    StreamWriter out = schemeOutput();
+    for (auto& a : args) {
+      if (a.sexpType() == SchemeType::SexpType::STR) {
+        out << a.str(); // no quotes
+      }
+      else {
+        out << a;
+      }
+    }
+    return schemeNil;
+  };
+  defineBuiltin(env, "newline")->fixed0_ = []() {
+    schemeOutput() << '\n';
+    return schemeNil;
+  };
+  defineBuiltin(env, "profile-report")->fixed0_ = []() {
+    if (!profiler->enabled()) {
+      schemeOutput() << "profiling is off; run with --profile\n";
+    }
+    else {
+      std::lock_guard<std::mutex> lock(schemeStreams->mutex_);
+      profiler->report(*schemeStreams->out_);
+    }
+    return schemeNil;
+  };
+  // (profile-folded "file") writes folded stacks for a flame graph.
+  defineBuiltin(env, "profile-folded")->fixed1_ = [](SchemeType& filename) {
+    if (filename.sexpType() != SchemeType::SexpType::STR) {
+      return badArgument("a string", filename);
+    }
+    std::ofstream out(filename.str());
+    profiler->writeFolded(out);
+    return SchemeType::fromBool(out.good());
+  };
+  defineBuiltin(env, "apply")->func_ = [](Args args) {
+    if (args.size() < 2) {
+      return wrongArgCount(args);
+    }
+    SchemeType& lst = *(args.end() - 1);
+    if (SchemeAnalyzer::listLength(lst) < 0) {
+      return badArgument("a list", lst);
+    }
+
+    // Copy everything out of args before calling back into Scheme.
+    SchemeType func = args[0];
+    vector<SchemeType> nargs;
+    std::copy(args.begin() + 1, args.end() - 1, back_inserter(nargs));
+
+    std::copy(begin(lst), end(lst), back_inserter(nargs));
+    return callFunc(func, Args(nargs));
+  };
+}
+
+//-----------------------------------------------------------------------------
+// Images
+//-----------------------------------------------------------------------------
+
+// An image is a snapshot of the global and macro tables and everything
+// reachable from them, so that a program can start without re-reading the
+// files that built them.  Closures are saved as their bytecode and
+// environment; tree closures can't be saved.  Builtins are saved by name
+// and rebound to the builtins of the interpreter that loads the image.
+//
+// The layout is native-endian, and images are only meant to be read by the
+// binary that wrote them:
+//
+//   magic, version, checksum of everything after it
+//   object count, then each object's kind and what it takes to allocate it
+//   code count, then each Code in full
+//   the references held by each pair, closure and frame
+//   globals, then macros, as (name, value) pairs
+//
+// Heap objects and Codes refer to each other by index into these lists.
+const char kImageMagic[8] = { 'S', 'C', 'M', 'I', 'M', 'A', 'G', 'E' };
+const uint32_t kImageVersion = 6;
+const uint32_t kNoObject = ~uint32_t(0);
+
+// 64-bit FNV-1a.
+uint64_t imageChecksum(const char* begin, const char* end) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char* p = begin; p != end; ++p) {
+    hash = (hash ^ uint8_t(*p)) * 1099511628211ull;
+  }
+  return hash;
+}
+
+class ImageWriter {
+ public:
+  // Fails if anything reachable is a closure without bytecode.
+  bool write(ostream& os, Symtab& globals, Symtab& macros) {
+    for (auto& i : globals) {
+      discover_(i.second);
+    }
+    for (auto& i : macros) {
+      discover_(i.second);
+    }
+    for (size_t o = 0, c = 0; o < objects_.size() || c < codes_.size();) {
+      if (o < objects_.size()) {
+        if (!discoverChildren_(objects_[o++])) {
+          return false;
+        }
+      }
+      else {
+        discoverChildren_(codes_[c++]);
+      }
+    }
+
+    buf_.append(kImageMagic, sizeof(kImageMagic));
+    put_(kImageVersion);
+    size_t checksumAt = buf_.size();
+    put_<uint64_t>(0);
+    put_<uint32_t>(objects_.size());
+    for (HeapObject* obj : objects_) {
+      writeHeader_(obj);
+    }
+    put_<uint32_t>(codes_.size());
+    for (Code* code : codes_) {
+      writeCode_(code);
+    }
+    for (HeapObject* obj : objects_) {
+      writeBody_(obj);
+    }
+    writeTable_(globals);
+    writeTable_(macros);
+
+    const char* payload = buf_.data() + checksumAt + sizeof(uint64_t);
+    uint64_t checksum = imageChecksum(payload, buf_.data() + buf_.size());
+    memcpy(&buf_[checksumAt], &checksum, sizeof(checksum));
+    os.write(buf_.data(), buf_.size());
+    return os.good();
+  }
+
+ private:
+  void discover_(const SchemeType& value) {
+    discoverObject_(value.heapObject());
+  }
+
+  void discoverObject_(HeapObject* obj) {
+    if (obj && objectIds_.emplace(obj, objects_.size()).second) {
+      objects_.push_back(obj);
+    }
+  }
+
+  void discoverCode_(Code* code) {
+    if (codeIds_.emplace(code, codes_.size()).second) {
+      codes_.push_back(code);
+    }
+  }
+
+  bool discoverChildren_(HeapObject* obj) {
+    switch (obj->kind_) {
+    case HeapKind::PAIR:
+      discover_(static_cast<SchemePair*>(obj)->car_);
+      discover_(static_cast<SchemePair*>(obj)->cdr_);
+      break;
+    case HeapKind::CLOSURE: {
+      auto closure = static_cast<SchemeClosure*>(obj);
+      Lambda* lambda = closure->lambda_.get();
+      if (!lambda->code_) {
+        schemeError() << "Can't save " << lambda->info_->name_ << " from "
+             << lambda->info_->location_ << ": images need --vm." << endl;
+        return false;
+      }
+      discoverObject_(closure->env_);
+      discoverCode_(lambda->code_);
+      break;
+    }
+    case HeapKind::FRAME: {
+      auto frame = static_cast<Frame*>(obj);
+      discoverObject_(frame->next());
+      for (int i = 0; i < frame->size(); ++i) {
+        discover_((*frame)[i]);
+      }
+      break;
+    }
+    case HeapKind::HASHTABLE:
+      for (auto& slot : static_cast<SchemeHashTable*>(obj)->slots()) {
+        discover_(slot.key_);
+        discover_(slot.value_);
+      }
+      break;
+    case HeapKind::FUTURE:
+      schemeError() << "Can't save a future in an image." << endl;
+      return false;
+    default:
+      break;
+    }
+    return true;
+  }
+
+  void discoverChildren_(Code* code) {
+    for (SchemeType& value : code->constants_) {
+      discover_(value);
+    }
+    for (auto& lambda : code->lambdas_) {
+      discoverCode_(lambda->code_);
+    }
+  }
+
+  template <typename T>
+  void put_(T value) {
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void putString_(const string& str) {
+    put_<uint32_t>(str.size());
+    buf_.append(str);
+  }
+
+  void putObject_(HeapObject* obj) {
+    put_(obj ? objectIds_[obj] : kNoObject);
+  }
+
+  void putValue_(SchemeType& value) {
+    put_(value.sexpType());
+    switch (value.sexpType()) {
+    case SchemeType::SexpType::NUM:
+      put_(value.num());
+      break;
+    case SchemeType::SexpType::BOOL:
+      put_(value.boolVal());
+      break;
+    case SchemeType::SexpType::ID:
+      putString_(value.id());
+      break;
+    default:
+      if (value.heapObject()) {
+        putObject_(value.heapObject());
+      }
+      break;
+    }
+  }
+
+  void writeHeader_(HeapObject* obj) {
+    put_(obj->kind_);
+    switch (obj->kind_) {
+    case HeapKind::STRING:
+      putString_(static_cast<SchemeString*>(obj)->str_);
+      break;
+    case HeapKind::BUILTIN:
+      putString_(static_cast<SchemeBuiltin*>(obj)->info_->name_);
+      break;
+    case HeapKind::FRAME:
+      put_<int32_t>(static_cast<Frame*>(obj)->size());
+      break;
+    case HeapKind::F64VECTOR:
+      putNumVector_(static_cast<F64Vector*>(obj));
+      break;
+    case HeapKind::S64VECTOR:
+      putNumVector_(static_cast<S64Vector*>(obj));
+      break;
+    case HeapKind::HASHTABLE:
+      put_(static_cast<SchemeHashTable*>(obj)->equal());
+      break;
+    default:
+      break;
+    }
+  }
+
+  template <class V>
+  void putNumVector_(V* v) {
+    put_<uint64_t>(v->size());
+    buf_.append(reinterpret_cast<const char*>(v->data()),
+                v->size() * sizeof(typename V::Element));
+  }
+
+  void writeCode_(Code* code) {
+    put_<int32_t>(code->argCount_);
+    put_(code->hasRestArg_);
+    put_<int32_t>(code->frameSize_);
+    put_(code->info_ != nullptr);
+    if (code->info_) {
+      putString_(code->info_->name_);
+      putString_(code->info_->location_);
+    }
+    put_<uint32_t>(code->captures_.size());
+    for (const Capture& c : code->captures_) {
+      put_<int32_t>(c.depth_);
+      put_<int32_t>(c.slot_);
+    }
+    put_(code->chain_);
+    put_(code->heapFrame_);
+    put_<uint32_t>(code->instrs_.size());
+    for (const Instr& in : code->instrs_) {
+      put_(in.op);
+      put_<int32_t>(in.a);
+      put_<int32_t>(in.b);
+    }
+    put_<uint32_t>(code->atoms_.size());
+    for (Atom sym : code->atoms_) {
+      putString_(sym.name());
+    }
+    put_<uint32_t>(code->constants_.size());
+    for (SchemeType& value : code->constants_) {
+      putValue_(value);
+    }
+    put_<uint32_t>(code->lambdas_.size());
+    for (auto& lambda : code->lambdas_) {
+      put_<uint32_t>(codeIds_[lambda->code_]);
+    }
+  }
+
+  void writeBody_(HeapObject* obj) {
+    switch (obj->kind_) {
+    case HeapKind::PAIR:
+      putValue_(static_cast<SchemePair*>(obj)->car_);
+      putValue_(static_cast<SchemePair*>(obj)->cdr_);
+      break;
+    case HeapKind::CLOSURE: {
+      auto closure = static_cast<SchemeClosure*>(obj);
+      putObject_(closure->env_);
+      put_<uint32_t>(codeIds_[closure->lambda_->code_]);
+      break;
+    }
+    case HeapKind::FRAME: {
+      auto frame = static_cast<Frame*>(obj);
+      putObject_(frame->next());
+      for (int i = 0; i < frame->size(); ++i) {
+        putValue_((*frame)[i]);
+      }
+      break;
+    }
+    case HeapKind::HASHTABLE: {
+      auto table = static_cast<SchemeHashTable*>(obj);
+      put_<uint64_t>(table->count());
+      for (auto& slot : table->slots()) {
+        if (slot.state_ == SchemeHashTable::Slot::FULL) {
+          putValue_(slot.key_);
+          putValue_(slot.value_);
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  void writeTable_(Symtab& table) {
+    put_<uint32_t>(table.size());
+    for (auto& i : table) {
+      putString_(i.first.name());
+      putValue_(i.second);
+    }
+  }
+
+  string buf_;
+  vector<HeapObject*> objects_;
+  unordered_map<HeapObject*, uint32_t> objectIds_;
+  vector<Code*> codes_;
+  unordered_map<Code*, uint32_t> codeIds_;
+};
+
+// Reads an image from a buffer, e.g. a mapped SourceFile, into the tables
+// of a freshly made interpreter.
+class ImageReader {
+ public:
+  ImageReader(const char* begin, const char* end) : cur_(begin), end_(end) { }
+
+  // Returns false, leaving the tables untouched, if the image fails its
+  // checksum, is malformed or names a builtin that globals lack.  Besides
+  // the checksum, which catches corruption, the structure is checked
+  // wherever a bad value would crash: indexes, bools, closure environments
+  // and what the VM assumes of each Code (see checkCode_).
+  bool read(Symtab& globals, SchemeAnalyzer& analyzer) {
+    // Nothing is reachable until the tables are filled in at the end.
+    NoGC noGC;
+    if (size_t(end_ - cur_) < sizeof(kImageMagic) ||
+        memcmp(cur_, kImageMagic, sizeof(kImageMagic))) {
+      return false;
+    }
+    cur_ += sizeof(kImageMagic);
+    if (get_<uint32_t>() != kImageVersion ||
+        get_<uint64_t>() != imageChecksum(cur_, end_) || !ok_) {
+      return false;
+    }
+
+    uint32_t numObjects = get_<uint32_t>();
+    for (uint32_t i = 0; i < numObjects && ok_; ++i) {
+      objects_.push_back(readHeader_(globals));
+    }
+    uint32_t numCodes = get_<uint32_t>();
+    for (uint32_t i = 0; i < numCodes && ok_; ++i) {
+      codes_.push_back(make_shared<Code>());
+    }
+    for (uint32_t i = 0; i < numCodes && ok_; ++i) {
+      readCode_(*codes_[i]);
+    }
+    for (uint32_t i = 0; i < numCodes && ok_; ++i) {
+      ok_ = checkCode_(*codes_[i]);
+    }
+    for (uint32_t i = 0; i < numObjects && ok_; ++i) {
+      readBody_(objects_[i]);
+    }
+    for (TableEntry& entry : entries_) {
+      entry.table_->set(entry.key_, entry.value_);
+    }
+    vector<pair<Atom, SchemeType>> newGlobals = readTable_();
+    vector<pair<Atom, SchemeType>> newMacros = readTable_();
+    if (!ok_ || cur_ != end_) {
+      return false;
+    }
+
+    for (auto& i : newGlobals) {
+      globals[i.first] = i.second;
+    }
+    for (auto& i : newMacros) {
+      analyzer.defineMacro(i.first, i.second);
+    }
+    return true;
+  }
+
+ private:
+  template <typename T>
+  T get_() {
+    T value = T();
+    if (size_t(end_ - cur_) < sizeof(T)) {
+      ok_ = false;
+      return value;
+    }
+    memcpy(&value, cur_, sizeof(T));
+    cur_ += sizeof(T);
+    return value;
+  }
+
+  // Bools are read as bytes, since a bool holding anything but 0 or 1 is
+  // undefined.
+  bool getBool_() {
+    uint8_t byte = get_<uint8_t>();
+    if (byte > 1) {
+      ok_ = false;
+    }
+    return byte == 1;
+  }
+
+  StringView getString_() {
+    uint32_t size = get_<uint32_t>();
+    if (end_ - cur_ < size) {
+      ok_ = false;
+      size = 0;
+    }
+    StringView str(cur_, size);
+    cur_ += size;
+    return str;
+  }
+
+  HeapObject* getObject_() {
+    uint32_t id = get_<uint32_t>();
+    if (id == kNoObject) {
+      return nullptr;
+    }
+    if (id >= objects_.size()) {
+      ok_ = false;
+      return nullptr;
+    }
+    return objects_[id];
+  }
+
+  Code* getCode_() {
+    uint32_t id = get_<uint32_t>();
+    if (id >= codes_.size()) {
+      ok_ = false;
+      return nullptr;
+    }
+    return codes_[id].get();
+  }
+
+  SchemeType getValue_() {
+    using SexpType = SchemeType::SexpType;
+    auto ty = get_<SexpType>();
+    switch (ty) {
+    case SexpType::NUM:
+      return SchemeType(get_<Number>());
+    case SexpType::BOOL:
+      return SchemeType::fromBool(getBool_());
+    case SexpType::ID:
+      return SchemeType(Atom::intern(getString_()));
+    case SexpType::NIL:
+    case SexpType::EOF_:
+    case SexpType::ERR:
+      return SchemeType(ty);
+    case SexpType::STR:
+      return getObjectValue_(ty, HeapKind::STRING);
+    case SexpType::CONS:
+      return getObjectValue_(ty, HeapKind::PAIR);
+    case SexpType::BUILTIN:
+      return getObjectValue_(ty, HeapKind::BUILTIN);
+    case SexpType::CLOSURE:
+      return getObjectValue_(ty, HeapKind::CLOSURE);
+    case SexpType::F64VECTOR:
+      return getObjectValue_(ty, HeapKind::F64VECTOR);
+    case SexpType::S64VECTOR:
+      return getObjectValue_(ty, HeapKind::S64VECTOR);
+    case SexpType::HASHTABLE:
+      return getObjectValue_(ty, HeapKind::HASHTABLE);
+    default:
+      ok_ = false;
+      return SchemeType();
+    }
+  }
+
+  SchemeType getObjectValue_(SchemeType::SexpType ty, HeapKind kind) {
+    HeapObject* obj = getObject_();
+    if (!obj || obj->kind_ != kind) {
+      ok_ = false;
+      return SchemeType();
+    }
+    return SchemeType::fromObject(ty, obj);
+  }
+
+  HeapObject* readHeader_(Symtab& globals) {
+    switch (get_<HeapKind>()) {
+    case HeapKind::PAIR:
+      return heap->make<SchemePair>(schemeNil, schemeNil);
+    case HeapKind::STRING: {
+      StringView str = getString_();
+      return heap->make<SchemeString>(string(str.data_, str.size_));
+    }
+    case HeapKind::BUILTIN: {
+      Atom name = Atom::intern(getString_());
+      auto i = globals.find(name);
+      if (i == globals.end() ||
+          i->second.sexpType() != SchemeType::SexpType::BUILTIN) {
+        schemeError() << "Image needs unknown builtin " << name << "." << endl;
+        ok_ = false;
+        return nullptr;
+      }
+      return i->second.builtin();
+    }
+    case HeapKind::CLOSURE:
+      return heap->make<SchemeClosure>();
+    case HeapKind::FRAME: {
+      int size = get_<int32_t>();
+      if (size < 0 || size > end_ - cur_) {
+        ok_ = false;
+        return nullptr;
+      }
+      return Frame::make(nullptr, size);
+    }
+    case HeapKind::F64VECTOR:
+      return getNumVector_<F64Vector>();
+    case HeapKind::S64VECTOR:
+      return getNumVector_<S64Vector>();
+    case HeapKind::HASHTABLE:
+      return heap->make<SchemeHashTable>(getBool_());
+    default:
+      ok_ = false;
+      return nullptr;
+    }
+  }
+
+  template <class V>
+  V* getNumVector_() {
+    uint64_t size = get_<uint64_t>();
+    size_t bytes = size * sizeof(typename V::Element);
+    if (size > size_t(end_ - cur_) / sizeof(typename V::Element)) {
+      ok_ = false;
+      return nullptr;
+    }
+    V* v = V::make(size);
+    memcpy(v->data(), cur_, bytes);
+    cur_ += bytes;
+    return v;
+  }
+
+  void readCode_(Code& code) {
+    code.argCount_ = get_<int32_t>();
+    code.hasRestArg_ = getBool_();
+    code.frameSize_ = get_<int32_t>();
+    if (getBool_()) {
+      StringView name = getString_();
+      StringView location = getString_();
+      code.info_ = profiler->newProc(string(name.data_, name.size_),
+                                    string(location.data_, location.size_));
+    }
+    uint32_t numCaptures = get_<uint32_t>();
+    for (uint32_t i = 0; i < numCaptures && ok_; ++i) {
+      int depth = get_<int32_t>();
+      code.captures_.push_back(Capture{depth, get_<int32_t>()});
+    }
+    code.chain_ = getBool_();
+    code.heapFrame_ = getBool_();
+    uint32_t numInstrs = get_<uint32_t>();
+    for (uint32_t i = 0; i < numInstrs && ok_; ++i) {
+      Op op = get_<Op>();
+      int a = get_<int32_t>();
+      code.emit(op, a, get_<int32_t>());
+    }
+    uint32_t numAtoms = get_<uint32_t>();
+    for (uint32_t i = 0; i < numAtoms && ok_; ++i) {
+      code.atom(Atom::intern(getString_()));
+    }
+    uint32_t numConstants = get_<uint32_t>();
+    for (uint32_t i = 0; i < numConstants && ok_; ++i) {
+      code.constant(getValue_());
+    }
+    uint32_t numLambdas = get_<uint32_t>();
+    for (uint32_t i = 0; i < numLambdas && ok_; ++i) {
+      uint32_t id = get_<uint32_t>();
+      if (id >= codes_.size()) {
+        ok_ = false;
+        break;
+      }
+      code.lambdas_.push_back(codes_[id]);
+    }
+  }
+
+  void readBody_(HeapObject* obj) {
+    switch (obj->kind_) {
+    case HeapKind::PAIR: {
+      auto pair = static_cast<SchemePair*>(obj);
+      pair->car_ = getValue_();
+      pair->cdr_ = getValue_();
+      break;
+    }
+    case HeapKind::CLOSURE: {
+      auto closure = static_cast<SchemeClosure*>(obj);
+      closure->env_ = getFrame_();
+      uint32_t id = get_<uint32_t>();
+      if (id >= codes_.size()) {
+        ok_ = false;
+        break;
+      }
+      closure->lambda_ = codes_[id];
+      // makeClosure gives a closure a frame of its captures exactly when
+      // it has captures or a chain.
+      Code* code = codes_[id].get();
+      bool hasEnv = !code->captures_.empty() || code->chain_;
+      if (hasEnv != (closure->env_ != nullptr) ||
+          (hasEnv && (closure->env_->size() != int(code->captures_.size()) ||
+                      (code->chain_ && !closure->env_->next())))) {
+        ok_ = false;
+      }
+      break;
+    }
+    case HeapKind::FRAME: {
+      auto frame = static_cast<Frame*>(obj);
+      frame->next_ = getFrame_();
+      for (int i = 0; i < frame->size() && ok_; ++i) {
+        (*frame)[i] = getValue_();
+      }
+      break;
+    }
+    case HeapKind::HASHTABLE: {
+      // Inserted once every object is complete, since equal? hashes look
+      // inside keys, and eq? hashes differ between processes anyway.
+      uint64_t count = get_<uint64_t>();
+      for (uint64_t i = 0; i < count && ok_; ++i) {
+        SchemeType key = getValue_();
+        entries_.push_back(
+          TableEntry{static_cast<SchemeHashTable*>(obj), key, getValue_()});
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  // Whether a variable at depth and slot, as seen from code, is in a frame
+  // code runs with: its own frame, its captures, or, if it chains, some
+  // enclosing frame.  Slots in enclosing frames are left to the checksum.
+  static bool checkLocal_(Code& code, int depth, int slot) {
+    switch (depth) {
+    case 0:
+      return slot >= 0 && slot < code.frameSize_;
+    case 1:
+      return slot >= 0 && slot < int(code.captures_.size());
+    default:
+      return depth > 1 && slot >= 0 && code.chain_;
+    }
+  }
+
+  // Checks what the VM trusts of code without looking: that operands index
+  // what they name, that control stays within the instructions and ends in
+  // a return or tail call, and that the stack never underflows and has the
+  // same depth whichever way an instruction is reached.
+  static bool checkCode_(Code& code) {
+    // Every slot past the arguments is stored by some instruction.
+    int size = code.instrs_.size();
+    int numArgs = code.argCount_ + code.hasRestArg_;
+    if (code.argCount_ < 0 || code.frameSize_ < numArgs ||
+        code.frameSize_ - numArgs > size) {
+      return false;
+    }
+    for (auto& lambda : code.lambdas_) {
+      // A closure that chains keeps the frame it was made in.
+      if (lambda->chain_ && !code.heapFrame_) {
+        return false;
+      }
+      for (const Capture& c : lambda->captures_) {
+        if (c.depth_ != -1 && !checkLocal_(code, c.depth_, c.slot_)) {
+          return false;
+        }
+      }
+    }
+
+    int numConstants = code.constants_.size();
+    int numAtoms = code.atoms_.size();
+    int numLambdas = code.lambdas_.size();
+    // Stack depth on reaching each instruction, or -1 if not yet reached.
+    vector<int> depths(size, -1);
+    vector<int> work;
+    auto reach = [&](int pc, int depth) {
+      if (pc < 0 || pc >= size || depth < 0) {
+        return false;
+      }
+      if (depths[pc] < 0) {
+        depths[pc] = depth;
+        work.push_back(pc);
+      }
+      return depths[pc] == depth;
+    };
+    if (!reach(0, 0)) {
+      return false;
+    }
+    while (!work.empty()) {
+      int pc = work.back();
+      work.pop_back();
+      const Instr& in = code.instrs_[pc];
+      int depth = depths[pc];
+      bool ok;
+      switch (in.op) {
+      case Op::CONST:
+        ok = in.a >= 0 && in.a < numConstants && reach(pc + 1, depth + 1);
+        break;
+      case Op::LOCAL:
+        ok = checkLocal_(code, in.a, in.b) && reach(pc + 1, depth + 1);
+        break;
+      case Op::GLOBAL:
+        ok = in.a >= 0 && in.a < numAtoms && reach(pc + 1, depth + 1);
+        break;
+      case Op::SET_LOCAL:
+        ok = checkLocal_(code, 0, in.a) && reach(pc + 1, depth - 1);
+        break;
+      case Op::DEFINE_LOCAL:
+        ok = checkLocal_(code, 0, in.a) && depth > 0 && reach(pc + 1, depth);
+        break;
+      case Op::DEFINE_GLOBAL:
+      case Op::DEFINE_MACRO:
+        ok = in.a >= 0 && in.a < numAtoms && depth > 0 &&
+          reach(pc + 1, depth);
+        break;
+      case Op::CLOSURE:
+        ok = in.a >= 0 && in.a < numLambdas && reach(pc + 1, depth + 1);
+        break;
+      case Op::POP:
+        ok = reach(pc + 1, depth - 1);
+        break;
+      case Op::JUMP:
+        ok = reach(in.a, depth);
+        break;
+      case Op::JUMP_UNLESS:
+        ok = reach(in.a, depth - 1) && reach(pc + 1, depth - 1);
+        break;
+      case Op::AND_JUMP:
+      case Op::OR_JUMP:
+        ok = depth > 0 && reach(in.a, depth) && reach(pc + 1, depth - 1);
+        break;
+      case Op::CALL:
+        ok = in.a >= 0 && depth > in.a && reach(pc + 1, depth - in.a);
+        break;
+      case Op::TAIL_CALL:
+        ok = in.a >= 0 && depth > in.a;
+        break;
+      case Op::RETURN:
+        ok = depth > 0;
+        break;
+      case Op::MACROEXPAND:
+        ok = depth > 0 && reach(pc + 1, depth);
+        break;
+      default:
+        ok = false;
+        break;
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Frame* getFrame_() {
+    HeapObject* obj = getObject_();
+    if (obj && obj->kind_ != HeapKind::FRAME) {
+      ok_ = false;
+      return nullptr;
+    }
+    return static_cast<Frame*>(obj);
+  }
+
+  vector<pair<Atom, SchemeType>> readTable_() {
+    vector<pair<Atom, SchemeType>> table;
+    uint32_t size = get_<uint32_t>();
+    for (uint32_t i = 0; i < size && ok_; ++i) {
+      Atom name = Atom::intern(getString_());
+      table.emplace_back(name, getValue_());
+    }
+    return table;
+  }
+
+  struct TableEntry {
+    SchemeHashTable* table_;
+    SchemeType key_;
+    SchemeType value_;
+  };
+
+  const char* cur_;
+  const char* end_;
+  bool ok_ = true;
+  vector<HeapObject*> objects_;
+  vector<shared_ptr<Code>> codes_;
+  vector<TableEntry> entries_;
+};
+
+//-----------------------------------------------------------------------------
+// Ahead-of-Time Compiler
+//-----------------------------------------------------------------------------
+
+// --emit-cpp translates a program to C++ that includes scheme.h and is
+// linked with this file as its runtime.  Each lambda becomes a C++
+// function that serves as its Lambda's expr_, so compiled closures are
+// called, and make tail calls, just like analyzed ones; the compiled code
+// only skips the tree walk.  What follows up to CppEmitter is the support
+// the generated code calls.  Generated code keeps its GlobalRefs and
+// constants in statics, which its init() points at the running
+// Interpreter's globals and heap.  So a compiled program can only be run
+// by one Interpreter at a time: it belongs to the one that ran it until
+// that one is destroyed.
+
+class Interpreter;
+
+// The Interpreter each compiled program, known by its forms, belongs to.
+std::mutex compiledOwnersMutex;
+unordered_map<const CompiledForm*, Interpreter*> compiledOwners;
+
+Symtab& compiledGlobals() {
+  return vmAnalyzer->globals();
+}
+
+void compiledDefineMacro(Atom name, SchemeType macro) {
+  vmAnalyzer->defineMacro(name, macro);
+}
+
+SchemeType compiledExpandMacros(SchemeType& form) {
+  return vmAnalyzer->expandMacros(form);
+}
+
+shared_ptr<Lambda> makeCompiledLambda(const CompiledLambda& compiled,
+                                      const Capture* captures) {
+  auto lambda = make_shared<Lambda>();
+  lambda->argCount_ = compiled.argCount_;
+  lambda->hasRestArg_ = compiled.hasRestArg_;
+  lambda->frameSize_ = compiled.frameSize_;
+  lambda->info_ = profiler->newProc(compiled.name_, compiled.location_);
+  captures += compiled.firstCapture_;
+  lambda->captures_.assign(captures, captures + compiled.captures_);
+  lambda->chain_ = compiled.chain_;
+  lambda->heapFrame_ = compiled.heapFrame_;
+  lambda->expr_ = compiled.body_;
+  return lambda;
+}
+
+// Calls the procedure at evalStack[base] with the values above it as its
+// arguments, and pops them all.  A call in tail position is left to the
+// enclosing SchemeClosure::apply, as analyzeCall does.
+SchemeType callCompiled(size_t base, bool tail) {
+  vector<SchemeType>& evalStack = Heap::thread().evalStack_;
+  if (tail) {
+    pendingTailCall.func_ = evalStack[base];
+    pendingTailCall.args_.assign(evalStack.begin() + base + 1,
+                                 evalStack.end());
+    evalStack.resize(base);
+    return SchemeType(SchemeType::SexpType::TAIL_CALL);
+  }
+  Args args(evalStack.data() + base + 1, evalStack.size() - base - 1);
+  SchemeType result = callFunc(evalStack[base], args);
+  evalStack.resize(base);
+  return result;
+}
+
+SchemeType callGlobal(GlobalRef& global,
+                      std::initializer_list<SchemeType*> args, bool tail) {
+  vector<SchemeType>& evalStack = Heap::thread().evalStack_;
+  size_t base = evalStack.size();
+  evalStack.push_back(global.get());
+  for (SchemeType* arg : args) {
+    evalStack.push_back(*arg);
+  }
+  return callCompiled(base, tail);
+}
+
+// Translates macro-expanded top-level forms to a C++ program, following
+// the analyzer's rules for scopes, slots and tail positions, so that the
+// program behaves as if the forms were loaded.  Every subexpression's
+// value goes to a fresh local; values that must survive an allocation are
+// kept where the analyzer keeps them, on the evaluation stack, in a frame
+// or in a ValueRoot.
+class CppEmitter {
+ public:
+  // Whether the interpreter should also run form while compiling: macro
+  // definitions, and definitions of procedures the macros may call, so
+  // that later forms expand.
+  static bool evalAtCompileTime(SchemeType& form) {
+    if (carIsId(form, atomDefineMacro)) {
+      return true;
+    }
+    if (!carIsId(form, atomDefine) || !form.cdr().isCons()) {
+      return false;
+    }
+    SchemeType& rest = form.cdr();
+    return rest.car().isCons() ||
+      (rest.cdr().isCons() && carIsId(rest.cdr().car(), atomLambda));
+  }
+
+  // Compiles one top-level form.  source is the form as read, which the
+  // program echoes, and form its expansion.
+  void add(SchemeType& source, SchemeType& form) {
+    Scope scope(nullptr, form, true);
+    Function fn;
+    fn_ = &fn;
+    string result = emit_(form, &scope, false);
+    fn_ = nullptr;
+
+    string name = "form_" + std::to_string(forms_.size());
+    string prologue;
+    if (scope.size()) {
+      prologue = "  env = Frame::make(nullptr, " +
+        std::to_string(scope.size()) + ");\n  FrameRoot root(env);\n";
+    }
+    define_(name, prologue, fn, result);
+    if (init_.code_.tellp() > 0) {
+      string builder = "constants_" + std::to_string(builders_.size());
+      functions_ << "static void " << builder << "() {\n  NoGC noGC;\n"
+                 << init_.code_.str() << "}\n\n";
+      builders_.push_back(builder);
+      init_.code_.str(string());
+      init_.temps_ = 0;
+    }
+    std::ostringstream text;
+    text << source;
+    forms_.push_back("{" + cppString(text.str()) + ", " + name + "}");
+  }
+
+  void write(ostream& os) {
+    os << "// Generated by scheme --emit-cpp.  Build it with scheme.h on "
+       << "the include path,\n// linked with scheme.cc built without its "
+       << "main:\n"
+       << "//   g++ -std=c++14 -O2 -pthread -DSCHEME_NO_MAIN -c "
+       << "<dir>/scheme.cc\n"
+       << "//   g++ -std=c++14 -O2 -pthread -I<dir> -o prog prog.cc "
+       << "scheme.o\n"
+       << "// The one scheme.o serves every program.  For a shared object "
+       << "exporting\n// scheme_main, build both with -fPIC and add -shared "
+       << "-DSCHEME_AOT_LIBRARY.\n"
+       << "#include \"scheme.h\"\n\n";
+    writeArray_(os, "static GlobalRef globals[]", globals_);
+    if (!lambdas_.empty()) {
+      os << "static shared_ptr<Lambda> lambdas[" << lambdas_.size()
+         << "];\n";
+    }
+    if (constants_) {
+      os << "static vector<SchemeType> constants(" << constants_ << ");\n";
+    }
+    os << "\n" << prototypes_.str() << "\n";
+    writeArray_(os, "static const Capture lambdaCaptures[]", captures_);
+    writeArray_(os, "static const CompiledLambda compiledLambdas[]",
+                lambdas_);
+    os << "\n" << functions_.str();
+
+    writeArray_(os, "static void (*const builders[])()", builders_);
+    // Builds what the forms refer to, for the Interpreter about to run them.
+    os << "\nstatic void init() {\n";
+    if (constants_) {
+      os << "  heap->addRoots(&constants);\n";
+    }
+    if (!globals_.empty()) {
+      os << "  for (GlobalRef& global : globals) {\n"
+         << "    global.intern();\n  }\n";
+    }
+    if (!lambdas_.empty()) {
+      os << "  for (size_t i = 0; i < " << lambdas_.size() << "; ++i) {\n"
+         << "    lambdas[i] = makeCompiledLambda(compiledLambdas[i], "
+         << (captures_.empty() ? "nullptr" : "lambdaCaptures") << ");\n"
+         << "  }\n";
+    }
+    if (!builders_.empty()) {
+      os << "  for (auto build : builders) {\n"
+         << "    build();\n  }\n";
+    }
+    os << "}\n\n";
+
+    os << "static const CompiledForm forms[] = {\n";
+    for (const string& form : forms_) {
+      os << "  " << form << ",\n";
+    }
+    // The sentinel keeps the array from being empty.
+    os << "  {nullptr, nullptr}\n};\n\n"
+       << "extern \"C\" int scheme_main(int argc, const char* argv[]) {\n"
+       << "  return compiledMain(CompiledProgram{init, forms, "
+       << forms_.size() << "}, argc, argv);\n}\n\n"
+       << "#ifndef SCHEME_AOT_LIBRARY\n"
+       << "int main(int argc, const char* argv[]) {\n"
+       << "  return scheme_main(argc, argv);\n}\n"
+       << "#endif\n";
+  }
+
+ private:
+  // A C++ function being written.
+  struct Function {
+    std::ostringstream code_;
+    int depth_ = 1;
+    int temps_ = 0;
+    bool usesStack_ = false;
+  };
+
+  static void writeArray_(ostream& os, const string& decl,
+                          const vector<string>& elements) {
+    if (elements.empty()) {
+      return;
+    }
+    os << decl << " = {\n";
+    for (const string& element : elements) {
+      os << "  " << element << ",\n";
+    }
+    os << "};\n";
+  }
+
+  // Writes out a finished function returning result.
+  void define_(const string& name, const string& prologue, Function& fn,
+               const string& result) {
+    prototypes_ << "static SchemeType " << name << "(Frame* env);\n";
+    functions_ << "static SchemeType " << name << "(Frame* env) {\n"
+               << prologue;
+    if (fn.usesStack_) {
+      functions_ << "  vector<SchemeType>& stack = "
+                 << "Heap::thread().evalStack_;\n";
+    }
+    functions_ << fn.code_.str()
+               << "  return " << result << ";\n}\n\n";
+  }
+
+  string temp_(const char* prefix = "t") {
+    return prefix + std::to_string(fn_->temps_++);
+  }
+
+  void line_(const string& text) {
+    fn_->code_ << string(2 * fn_->depth_, ' ') << text << '\n';
+  }
+
+  void open_(const string& text) {
+    line_(text.empty() ? "{" : text + " {");
+    fn_->depth_++;
+  }
+
+  void close_() {
+    fn_->depth_--;
+    line_("}");
+  }
+
+  // Declares a local holding the value of a C++ expression.
+  string value_(const string& expr) {
+    string t = temp_();
+    line_("SchemeType " + t + " = " + expr + ";");
+    return t;
+  }
+
+  // Each emit function writes the code for an expression to fn_ and
+  // returns the local holding its value.
+  string emit_(SchemeType& sexp, Scope* scope, bool tail = false) {
+    SchemeType let;
+    switch (sexp.sexpType()) {
+    case SchemeType::SexpType::NUM:
+    case SchemeType::SexpType::BOOL:
+    case SchemeType::SexpType::NIL:
+      return value_(immediate_(sexp));
+    case SchemeType::SexpType::STR:
+      return value_(constant_(sexp));
+    case SchemeType::SexpType::ID:
+      return emitVariable_(sexp.atom(), scope);
+    case SchemeType::SexpType::CONS:
+      if (carIsId(sexp, atomLambda))
+        return emitLambda_(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomDefine))
+        return emitDefine_(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomDefineMacro))
+        return emitDefineMacro_(sexp.cdr(), scope);
+      else if (carIsId(sexp, atomQuote)) {
+        SchemeAnalyzer::checkForm(atomQuote, sexp.cdr());
+        return value_(constant_(sexp.cdr().car()));
+      }
+      else if (carIsId(sexp, atomAnd))
+        return emitAndOr_(sexp.cdr(), scope, tail, true);
+      else if (carIsId(sexp, atomOr))
+        return emitAndOr_(sexp.cdr(), scope, tail, false);
+      else if (carIsId(sexp, atomIf))
+        return emitIf_(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomBegin))
+        return emitSequence_(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomLet))
+        return emitLet_(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomCond))
+        return emitCond_(sexp.cdr(), scope, tail);
+      else if (carIsId(sexp, atomMe)) {
+        string form = value_(constant_(sexp.cdr()));
+        return value_("compiledExpandMacros(" + form + ")");
+      }
+      else if (scope && SchemeAnalyzer::letForm(sexp, &let))
+        return emitLet_(let, scope, tail);
+      else
+        return emitApplication_(sexp, scope, tail);
+    default:
+      return value_("SchemeType(SchemeType::SexpType::ERR)");
+    }
+  }
+
+  string emitVariable_(Atom sym, Scope* scope) {
+    int depth, slot;
+    if (scope && scope->resolve(sym, &depth, &slot)) {
+      return value_("env->lookup(" + std::to_string(depth) + ", " +
+                    std::to_string(slot) + ")");
+    }
+    return value_(global_(sym) + ".get()");
+  }
+
+  string emitDefineMacro_(SchemeType& sexp, Scope* scope) {
+    SchemeAnalyzer::checkForm(atomDefineMacro, sexp);
+    string value = emit_(sexp.cdr().car(), scope);
+    line_("compiledDefineMacro(Atom::intern(" +
+          cppString(sexp.car().atom().name()) + "), " + value + ");");
+    return value_("SchemeType::fromBool(true)");
+  }
+
+  string emitAndOr_(SchemeType& sexp, Scope* scope, bool tail, bool isAnd) {
+    if (sexp.isNil()) {
+      return value_(isAnd ? "SchemeType()" : "SchemeType::fromBool(false)");
+    }
+    string result = value_("SchemeType::fromBool(false)");
+    int blocks = 0;
+    for (SchemeType* i = &sexp; i->isCons(); i = &i->cdr()) {
+      string value = emit_(i->car(), scope, tail && i->cdr().isNil());
+      if (i->cdr().isNil()) {
+        line_(result + " = " + value + ";");
+      }
+      else if (isAnd) {
+        open_("if (" + value + ".toBool())");
+        blocks++;
+      }
+      else {
+        open_("if (" + value + ".toBool())");
+        line_(result + " = " + value + ";");
+        close_();
+        open_("else");
+        blocks++;
+      }
+    }
+    while (blocks--) {
+      close_();
+    }
+    return result;
+  }
+
+  string emitIf_(SchemeType& sexp, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkForm(atomIf, sexp);
+    // sexp is (test then [else])
+    string test = emit_(sexp.car(), scope);
+    string result = value_("schemeNil");
+    open_("if (" + test + ".toBool())");
+    line_(result + " = " + emit_(sexp.cdr().car(), scope, tail) + ";");
+    close_();
+    SchemeType& rest = sexp.cdr().cdr();
+    if (rest.isCons()) {
+      open_("else");
+      line_(result + " = " + emit_(rest.car(), scope, tail) + ";");
+      close_();
+    }
+    return result;
+  }
+
+  // Like analyzeLet.  The inits are rooted until they are stored, since
+  // their slots are only known once they have all been compiled.
+  string emitLet_(SchemeType& sexp, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkForm(atomLet, sexp);
+    // sexp is (((var init) ...) body)
+    open_("");
+    vector<string> inits;
+    for (SchemeType& binding : sexp.car()) {
+      string init = emit_(binding.cdr().car(), scope);
+      line_("ValueRoot " + temp_("root") + "(" + init + ");");
+      inits.push_back(init);
+    }
+
+    size_t mark = scope->mark();
+    size_t i = 0;
+    for (SchemeType& binding : sexp.car()) {
+      int slot = scope->declare(binding.car().atom());
+      line_("(*env)[" + std::to_string(slot) + "] = " + inits[i++] + ";");
+    }
+    close_();
+    for (SchemeType& form : sexp.cdr()) {
+      if (carIsId(form, atomDefine)) {
+        scope->declare(SchemeAnalyzer::defineName(form.cdr()), true);
+      }
+    }
+    string result = emitSequence_(sexp.cdr(), scope, tail);
+    scope->release(mark);
+    return result;
+  }
+
+  string emitCond_(SchemeType& sexp, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkForm(atomCond, sexp);
+    // sexp is ((test expr ...) ... [(else expr ...)])
+    string result = value_("schemeNil");
+    int blocks = 0;
+    for (SchemeType& clause : sexp) {
+      if (carIsId(clause, atomElse)) {
+        line_(result + " = " + emitSequence_(clause.cdr(), scope, tail) +
+              ";");
+        break;
+      }
+      string test = emit_(clause.car(), scope);
+      open_("if (" + test + ".toBool())");
+      if (clause.cdr().isNil()) {
+        line_(result + " = " + test + ";");
+      }
+      else {
+        line_(result + " = " + emitSequence_(clause.cdr(), scope, tail) +
+              ";");
+      }
+      close_();
+      open_("else");
+      blocks++;
+    }
+    while (blocks--) {
+      close_();
+    }
+    return result;
+  }
+
+  string emitDefine_(SchemeType& sexp, Scope* scope) {
+    SchemeAnalyzer::checkForm(atomDefine, sexp);
+    Atom id = SchemeAnalyzer::defineName(sexp);
+    int slot = SchemeAnalyzer::defineSlot(id, scope);
+    string value;
+    if (sexp.car().isCons()) {
+      // sexp is like ((funcname arg1 arg2) body)
+      SchemeType lambdaSexp(sexp.car().cdr(), sexp.cdr());
+      profiler->copyLine(sexp, lambdaSexp);
+      value = emitLambda_(lambdaSexp, scope, id, slot);
+    }
+    else if (carIsId(sexp.cdr().car(), atomLambda)) {
+      // Located at the define, like (define (name arg ...) body ...).
+      profiler->copyLine(sexp, sexp.cdr().car().cdr());
+      value = emitLambda_(sexp.cdr().car().cdr(), scope, id, slot);
+    }
+    else {
+      value = emit_(sexp.cdr().car(), scope);
+    }
+    if (slot >= 0) {
+      scope->defined(slot);
+      line_("(*env)[" + std::to_string(slot) + "] = " + value + ";");
+    }
+    else {
+      line_("defineGlobal(compiledGlobals(), " + global_(id) +
+            ".atom(), " + value + ");");
+    }
+    return value_("schemeNil");
+  }
+
+  // sexp is ((arg1 arg2) body)
+  string emitLambda_(SchemeType& sexp, Scope* scope, Atom name = Atom(),
+                     int self = -1) {
+    SchemeAnalyzer::checkForm(atomLambda, sexp);
+    Scope lambdaScope(scope, sexp.cdr());
+    lambdaScope.setSelf(self);
+    int argCount = 0;
+    bool hasRestArg = false;
+    SchemeType* i = &sexp.car();
+    for (; i->isCons(); i = &i->cdr()) {
+      lambdaScope.bind(i->car().atom());
+      argCount++;
+    }
+    if (!i->isNil()) {
+      lambdaScope.bind(i->atom());
+      hasRestArg = true;
+    }
+
+    // Nested lambdas come after this one in compiledLambdas.
+    size_t index = lambdas_.size();
+    lambdas_.emplace_back();
+    Function* outer = fn_;
+    Function body;
+    fn_ = &body;
+    // As analyzeBody: internal defines get their slots up front.
+    for (SchemeType& form : sexp.cdr()) {
+      if (carIsId(form, atomDefine)) {
+        lambdaScope.bind(SchemeAnalyzer::defineName(form.cdr()), true);
+      }
+    }
+    string result = emitSequence_(sexp.cdr(), &lambdaScope, true);
+    fn_ = outer;
+    string function = "lambda_" + std::to_string(index);
+    define_(function, "", body, result);
+
+    const vector<Capture>& captures = lambdaScope.captures();
+    lambdas_[index] = "{" +
+      cppString(name.isNull() ? "lambda" : name.name()) + ", " +
+      cppString(profiler->location(sexp)) + ", " +
+      std::to_string(argCount) + ", " +
+      (hasRestArg ? "true" : "false") + ", " +
+      std::to_string(lambdaScope.size()) + ", " + function + ", " +
+      std::to_string(captures_.size()) + ", " +
+      std::to_string(captures.size()) + ", " +
+      (lambdaScope.chain() ? "true" : "false") + ", " +
+      (lambdaScope.escapes() ? "true" : "false") + "}";
+    for (const Capture& c : captures) {
+      captures_.push_back("{" + std::to_string(c.depth_) + ", " +
+                          std::to_string(c.slot_) + "}");
+    }
+    return value_("makeClosure(lambdas[" + std::to_string(index) +
+                  "], env)");
+  }
+
+  // Returns the value of the last form, or ERR if there are none.
+  string emitSequence_(SchemeType& sexps, Scope* scope, bool tail) {
+    string result;
+    for (SchemeType* i = &sexps; i->isCons(); i = &i->cdr()) {
+      if (!result.empty()) {
+        // Discarded, e.g. a define's value; this keeps -Wall quiet.
+        line_("(void)" + result + ";");
+      }
+      result = emit_(i->car(), scope, tail && i->cdr().isNil());
+    }
+    return result.empty() ? value_("SchemeType()") : result;
+  }
+
+  string emitApplication_(SchemeType& sexp, Scope* scope, bool tail) {
+    SchemeAnalyzer::checkCall(sexp);
+    string result = value_("SchemeType()");
+    string tailArg = tail ? "true" : "false";
+    int depth, slot;
+    const Primitive* primitive = nullptr;
+    if (sexp.car().isId() &&
+        !scope->resolve(sexp.car().atom(), &depth, &slot)) {
+      primitive = findPrimitive(sexp.car().atom(), sexp.cdr());
+    }
+    open_("");
+    if (primitive) {
+      // Unlike the analyzer's inlined calls, these evaluate the arguments
+      // before looking at the global, so that each argument's code is
+      // only emitted once.
+      string call = "compiledPrimitive<" + string(primitive->op_) + ">(" +
+        global_(sexp.car().atom());
+      size_t n = 0;
+      for (SchemeType& arg : sexp.cdr()) {
+        string value = emit_(arg, scope);
+        if (++n < primitive->arity_) {
+          line_("ValueRoot " + temp_("root") + "(" + value + ");");
+        }
+        call += ", " + value;
+      }
+      line_(result + " = " + call + ", " + tailArg + ");");
+    }
+    else {
+      fn_->usesStack_ = true;
+      string base = temp_("base");
+      line_("size_t " + base + " = stack.size();");
+      line_("stack.push_back(" + emit_(sexp.car(), scope) + ");");
+      for (SchemeType& arg : sexp.cdr()) {
+        line_("stack.push_back(" + emit_(arg, scope) + ");");
+      }
+      line_(result + " = callCompiled(" + base + ", " + tailArg + ");");
+    }
+    close_();
+    return result;
+  }
+
+  struct Primitive {
+    const char* name_;
+    size_t arity_;
+    const char* op_;
+  };
+
+  // The primitives SchemeAnalyzer inlines, and the calls it inlines.
+  static const Primitive* findPrimitive(Atom name, SchemeType& args) {
+    static const Primitive primitives[] = {
+      {"+", 2, "NumOp<std::plus<Number>>"},
+      {"-", 2, "NumOp<std::minus<Number>>"},
+      {"*", 2, "NumOp<std::multiplies<Number>>"},
+      {"/", 2, "NumOp<std::divides<Number>>"},
+      {"=", 2, "CmpOp<std::equal_to<Number>>"},
+      {"<", 2, "CmpOp<std::less<Number>>"},
+      {">", 2, "CmpOp<std::greater<Number>>"},
+      {"cons", 2, "ConsOp"},
+      {"eq?", 2, "EqOp"},
+      {"car", 1, "CarOp"},
+      {"cdr", 1, "CdrOp"},
+      {"null?", 1, "NullOp"},
+      {"pair?", 1, "PairOp"},
+    };
+    size_t arity = 0;
+    for (SchemeType* i = &args; i->isCons(); i = &i->cdr()) {
+      arity++;
+    }
+    for (const Primitive& p : primitives) {
+      if (name.name() == p.name_ && arity == p.arity_) {
+        return &p;
+      }
+    }
+    return nullptr;
+  }
+
+  // The GlobalRef for sym, added on first use.
+  string global_(Atom sym) {
+    auto i = globalIndex_.find(sym);
+    if (i == globalIndex_.end()) {
+      i = globalIndex_.emplace(sym, globals_.size()).first;
+      globals_.push_back("{" + cppString(sym.name()) + "}");
+    }
+    return "globals[" + std::to_string(i->second) + "]";
+  }
+
+  // A C++ expression for a number, boolean or the empty list.
+  static string immediate_(SchemeType& value) {
+    if (value.isNil()) {
+      return "schemeNil";
+    }
+    if (value.sexpType() == SchemeType::SexpType::BOOL) {
+      return value.boolVal() ? "SchemeType::fromBool(true)"
+                             : "SchemeType::fromBool(false)";
+    }
+    Number num = value.num();
+    std::ostringstream os;
+    if (std::isnan(num)) {
+      os << "NAN";
+    }
+    else if (std::isinf(num)) {
+      os << (num < 0 ? "-INFINITY" : "INFINITY");
+    }
+    else {
+      os.precision(17);
+      os << num;
+    }
+    return "SchemeType(Number(" + os.str() + "))";
+  }
+
+  // The element of constants that init sets to a copy of datum.
+  string constant_(SchemeType& datum) {
+    Function* outer = fn_;
+    fn_ = &init_;
+    string index = std::to_string(constants_++);
+    line_("constants[" + index + "] = " + datum_(datum) + ";");
+    fn_ = outer;
+    return "constants[" + index + "]";
+  }
+
+  // Writes code to init building datum, and returns a C++ expression for
+  // it.  Lists are built from the end, so long ones don't nest deeply.
+  string datum_(SchemeType& datum) {
+    switch (datum.sexpType()) {
+    case SchemeType::SexpType::ID:
+      return "SchemeType(Atom::intern(" + cppString(datum.id()) + "))";
+    case SchemeType::SexpType::STR:
+      return "SchemeType::userString(" + cppString(datum.str()) + ")";
+    case SchemeType::SexpType::CONS: {
+      vector<SchemeType*> elements;
+      SchemeType* i = &datum;
+      for (; i->isCons(); i = &i->cdr()) {
+        elements.push_back(&i->car());
+      }
+      string list = value_(datum_(*i));
+      for (auto e = elements.rbegin(); e != elements.rend(); ++e) {
+        string car = datum_(**e);
+        line_(list + " = SchemeType(" + car + ", " + list + ");");
+      }
+      return list;
+    }
+    case SchemeType::SexpType::NUM:
+    case SchemeType::SexpType::BOOL:
+    case SchemeType::SexpType::NIL:
+      return immediate_(datum);
+    default:
+      return "SchemeType(SchemeType::SexpType::ERR)";
+    }
+  }
+
+  // A C++ string literal for s.
+  static string cppString(const string& s) {
+    std::ostringstream os;
+    os << '"';
+    for (unsigned char c : s) {
+      if (c == '"' || c == '\\' || c == '?') {
+        os << '\\' << c;
+      }
+      else if (c == '\n') {
+        os << "\\n";
+      }
+      else if (c < ' ' || c > '~') {
+        os << '\\' << char('0' + (c >> 6)) << char('0' + ((c >> 3) & 7))
+           << char('0' + (c & 7));
+      }
+      else {
+        os << c;
+      }
+    }
+    os << '"';
+    return os.str();
+  }
+
+  Function* fn_ = nullptr;
+  // Builds the constants of the form being compiled.
+  Function init_;
+  // Functions that build the constants, one per form that has any.
+  vector<string> builders_;
+  size_t constants_ = 0;
+  unordered_map<Atom, size_t, Atom::Hash> globalIndex_;
+  // Initializers of the elements of globals, lambdaCaptures,
+  // compiledLambdas and forms in the output.
+  vector<string> globals_;
+  vector<string> captures_;
+  vector<string> lambdas_;
+  vector<string> forms_;
+  std::ostringstream prototypes_;
+  // Finished functions, innermost lambdas first.
+  std::ostringstream functions_;
+};
+
+//-----------------------------------------------------------------------------
+// Interpreter
+//-----------------------------------------------------------------------------
+
+// Counters for --stats, summed over one or more Interpreters.
+struct Stats {
+  size_t calls_ = 0;
+  size_t pairs_ = 0;
+  size_t frames_ = 0;
+  // Frames of calls that got one off a FrameStack instead.
+  size_t stackFrames_ = 0;
+  size_t closures_ = 0;
+  size_t collections_ = 0;
+  size_t expansions_ = 0;
+  size_t evictions_ = 0;
+
+  Stats& operator+=(const Stats& other) {
+    calls_ += other.calls_;
+    pairs_ += other.pairs_;
+    frames_ += other.frames_;
+    stackFrames_ += other.stackFrames_;
+    closures_ += other.closures_;
+    collections_ += other.collections_;
+    expansions_ += other.expansions_;
+    evictions_ += other.evictions_;
+    return *this;
+  }
+
+  void print(ostream& os) const {
+    os << "calls: " << calls_ << endl;
+    os << "pairs: " << pairs_ << endl;
+    os << "frames: " << frames_ << endl;
+    os << "stack-frames: " << stackFrames_ << endl;
+    os << "closures: " << closures_ << endl;
+    os << "collections: " << collections_ << endl;
+    os << "macro-expansions: " << expansions_ << endl;
+    os << "macro-evictions: " << evictions_ << endl;
+  }
+};
+
+// Embeds the evaluator: owns the globals, the analyzer and a backend.
+// Output from display and newline, and the echo of forms and results, go
+// to the output stream, cout unless set otherwise; errors go to the error
+// stream, cerr unless set otherwise.  Echoing is off by default.
+//
+// Each Interpreter is an isolate, with its own heap, profiler, worker pool
+// and streams: Interpreters share nothing mutable but the atom table, and
+// different threads may run different ones at once.  One thread at a time
+// may call into a given Interpreter, and values from one must not be
+// passed to another.
+class Interpreter {
+ public:
+  // A procedure looked up once and called any number of times without
+  // re-reading or re-analyzing anything.  It calls the procedure bound at
+  // lookup time, which stays alive as long as the Interpreter.
+  class Procedure {
+   public:
+    Procedure() : interp_(nullptr), index_(0) { }
+
+    bool valid() const { return interp_ != nullptr; }
+
+    // Arguments may be SchemeTypes, numbers, bools or strings.
+    template <typename... Ts>
+    SchemeType operator()(Ts&&... args) const {
+      Enter enter(interp_);
+      vector<SchemeType> eArgs;
+      VectorRoot root(eArgs);
+      int expand[] = { 0, (eArgs.push_back(toScheme(args)), 0)... };
+      (void)expand;
+      return call(eArgs);
+    }
+
+    // ERR if the call fails.
+    SchemeType call(vector<SchemeType>& args) const {
+      Enter enter(interp_);
+      SchemeType func = interp_->handles_[index_];
+      SchemeType result;
+      guard_([&] { result = callFunc(func, Args(args)); });
+      return result;
+    }
+
+   private:
+    friend class Interpreter;
+    Procedure(Interpreter* interp, size_t index) :
+        interp_(interp), index_(index) { }
+
+    static SchemeType toScheme(const SchemeType& value) { return value; }
+    static SchemeType toScheme(Number num) { return SchemeType(num); }
+    static SchemeType toScheme(int num) { return SchemeType(Number(num)); }
+    static SchemeType toScheme(bool b) { return SchemeType::fromBool(b); }
+    static SchemeType toScheme(const string& str) {
+      return SchemeType::userString(str);
+    }
+    static SchemeType toScheme(const char* str) {
+      return SchemeType::userString(str);
+    }
+
+    Interpreter* interp_;
+    size_t index_;
+  };
+
+  explicit Interpreter(bool useVM = false) :
+      workers_(heap_), useVM_(useVM) {
+    Enter enter(this);
+    setupEnv(globals_);
+    analyzer_.reset(new SchemeAnalyzer(globals_));
+    if (useVM) {
+      backend_.reset(new VMBackend(*analyzer_));
+    }
+    else {
+      backend_.reset(new ClosureBackend(*analyzer_));
+    }
+    heap_.addRoots(&handles_);
+  }
+
+  ~Interpreter() {
+    Enter enter(this);
+    // Workers may still be running this interpreter's code.
+    workers_.shutdown();
+    streams_.out_->flush();
+    streams_.err_->flush();
+    heap_.removeRoots(&handles_);
+    backend_.reset();
+    analyzer_.reset();
+    // Compiled programs it ran may run again, in another Interpreter.
+    std::lock_guard<std::mutex> lock(compiledOwnersMutex);
+    for (auto i = compiledOwners.begin(); i != compiledOwners.end();) {
+      i = i->second == this ? compiledOwners.erase(i) : std::next(i);
+    }
+  }
+
+  void setEcho(bool echo) { echo_ = echo; }
+  void setOutput(ostream& out) {
+    std::lock_guard<std::mutex> lock(streams_.mutex_);
+    streams_.out_ = &out;
+  }
+  void setErrors(ostream& err) {
+    std::lock_guard<std::mutex> lock(streams_.mutex_);
+    streams_.err_ = &err;
+  }
+  // How many threads futures and pmap use; see WorkerPool::threads.
+  void setThreads(size_t threads) { workers_.setThreads(threads); }
+  void enableProfiling() { profiler_.enable(); }
+  void reportProfile(ostream& os) { profiler_.report(os); }
+  // Errors reported so far.  An error abandons the top-level form it
+  // happens in, whose value is then ERR; later forms still run.
+  size_t errors() const { return streams_.errors_; }
+
+  void addStats(Stats* stats) {
+    stats->calls_ += calls_ + workers_.calls();
+    stats->pairs_ += heap_.allocations(HeapKind::PAIR);
+    stats->frames_ += heap_.allocations(HeapKind::FRAME);
+    stats->stackFrames_ += heap_.stackFrames();
+    stats->closures_ += heap_.allocations(HeapKind::CLOSURE);
+    stats->collections_ += heap_.collections();
+    stats->expansions_ += analyzer_->expansions();
+    stats->evictions_ += analyzer_->evictions();
+  }
+
+  // Evaluates each form in a file, or stdin if filename is null.  Returns
+  // false if the file can't be read or has a syntax error.  A file is run
+  // even if it was loaded before, but it counts as loaded for import.
+  bool loadFile(const char* filename) {
+    Enter enter(this);
+    generation_++;
+    if (!filename) {
+      Tokenizer t(cin);
+      return load_(t, "<stdin>", nullptr, nullptr);
+    }
+    string key;
+    struct timespec mtime;
+    if (!identify_(filename, &key, &mtime)) {
+      schemeError() << "Couldn't open " << filename << "." << endl;
+      return false;
+    }
+    return loadModule_(key, filename, mtime);
+  }
+
+  // Evaluates each form in source and returns the value of the last, which
+  // is ERR if it failed, or ERR on a syntax error.
+  SchemeType evalString(const string& source) {
+    Enter enter(this);
+    generation_++;
+    Tokenizer t(source.data(), source.data() + source.size());
+    SchemeType result = schemeNil;
+    ValueRoot root(result);
+    if (!load_(t, "<string>", &result, nullptr)) {
+      return SchemeType();
+    }
+    return result;
+  }
+
+  // Writes the globals and macros to an image file.  Only the VM backend's
+  // closures can be saved.
+  bool saveImage(const char* filename) {
+    Enter enter(this);
+    if (!useVM_) {
+      schemeError() << "Images need --vm." << endl;
+      return false;
+    }
+    std::ofstream out(filename, std::ios::binary);
+    if (!ImageWriter().write(out, globals_, analyzer_->macro_table_)) {
+      schemeError() << "Couldn't write image " << filename << "." << endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Restores globals and macros saved by saveImage, before loading any
+  // files.
+  bool loadImage(const char* filename) {
+    Enter enter(this);
+    if (!useVM_) {
+      schemeError() << "Images need --vm." << endl;
+      return false;
+    }
+    SourceFile image;
+    if (!image.open(filename) ||
+        !ImageReader(image.begin(), image.end()).read(globals_, *analyzer_)) {
+      schemeError() << "Couldn't load image " << filename << "." << endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Finds the procedure bound to a global; the handle is invalid if there
+  // is none.
+  Procedure lookup(const string& name) {
+    Enter enter(this);
+    auto i = globals_.find(Atom::intern(name));
+    if (i == globals_.end() ||
+        (i->second.sexpType() != SchemeType::SexpType::CLOSURE &&
+         i->second.sexpType() != SchemeType::SexpType::BUILTIN)) {
+      return Procedure();
+    }
+    handles_.push_back(i->second);
+    return Procedure(this, handles_.size() - 1);
+  }
+
+  // Compiles files, stdin for a null name, to a C++ program written to
+  // os instead of running them; see CppEmitter.  Macro definitions, and
+  // the procedure definitions macros may use, still run.  Fails if a
+  // file can't be read or any form fails.
+  bool emitCpp(const vector<const char*>& files, ostream& os) {
+    CppEmitter emitter;
+    emitter_ = &emitter;
+    bool ok = true;
+    for (const char* filename : files) {
+      if (!loadFile(filename) || streams_.errors_) {
+        ok = false;
+        break;
+      }
+    }
+    emitter_ = nullptr;
+    if (ok) {
+      emitter.write(os);
+    }
+    return ok;
+  }
+
+  // Runs a program compiled by --emit-cpp, echoing its forms as loadFile
+  // would.
+  // It fails if another Interpreter that ran the program still exists.
+  void runCompiled(const CompiledProgram& program) {
+    Enter enter(this);
+    bool first;
+    {
+      std::lock_guard<std::mutex> lock(compiledOwnersMutex);
+      Interpreter*& owner = compiledOwners[program.forms_];
+      if (owner && owner != this) {
+        schemeError() << "A compiled program can only be run by one "
+                      << "Interpreter at a time." << endl;
+        return;
+      }
+      first = !owner;
+      owner = this;
+    }
+    if (first) {
+      program.init_();
+    }
+    for (size_t i = 0; i < program.size_; ++i) {
+      const CompiledForm& form = program.forms_[i];
+      if (echo_) {
+        schemeOutput() << "-->> " << form.source_ << '\n';
+      }
+      SchemeType result;
+      guard_([&] { result = form.run_(nullptr); });
+      if (echo_) {
+        schemeOutput() << result << '\n' << "------- " << '\n';
+      }
+      heap->safePoint();
+    }
+  }
+
+  SchemeAnalyzer& analyzer() { return *analyzer_; }
+
+ private:
+  // Points the calling thread's heap, profiler, pool, streams and VM at
+  // an Interpreter's for the length of a call into it, and back after.
+  // Calls may nest, also across Interpreters.
+  class Enter {
+   public:
+    explicit Enter(Interpreter* interp) :
+        interp_(interp), heap_(heap), profiler_(profiler), workers_(workers),
+        streams_(schemeStreams), vm_(vm),
+        analyzer_(vmAnalyzer), switched_(heap != &interp->heap_) {
+      if (switched_) {
+        if (heap_) {
+          heap_->leave();
+        }
+        interp->heap_.enter();
+        calls_ = callCount;
+      }
+      heap = &interp->heap_;
+      profiler = &interp->profiler_;
+      workers = &interp->workers_;
+      schemeStreams = &interp->streams_;
+      vm = interp->backend_ ? interp->backend_->vm() : nullptr;
+      vmAnalyzer = interp->analyzer_.get();
+    }
+
+    ~Enter() {
+      if (switched_) {
+        interp_->calls_ += callCount - calls_;
+        heap->leave();
+        if (heap_) {
+          heap_->enter();
+        }
+      }
+      heap = heap_;
+      profiler = profiler_;
+      workers = workers_;
+      schemeStreams = streams_;
+      vm = vm_;
+      vmAnalyzer = analyzer_;
+    }
+
+   private:
+    Interpreter* interp_;
+    Heap* heap_;
+    Profiler* profiler_;
+    WorkerPool* workers_;
+    SchemeStreams* streams_;
+    VM* vm_;
+    SchemeAnalyzer* analyzer_;
+    bool switched_;
+    size_t calls_ = 0;
+  };
+
+  // A loaded file.  Its forms are kept compiled, so that when only its
+  // imports have changed it can be re-run without being re-read.
+  struct Module {
+    // One top-level form, or an import of the module keyed import_, which
+    // had been run version_ times when this module last imported it.
+    struct Form {
+      Backend::Thunk run_;
+      string import_;
+      size_t version_;
+    };
+
+    struct timespec mtime_;
+    vector<Form> forms_;
+    // Times the forms have started running.  It is bumped at the start so
+    // that modules in an import cycle see the version they end up with.
+    size_t version_ = 0;
+    // Last generation (see generation_) the module was brought up to date
+    // in.
+    size_t generation_ = 0;
+    // The analyzer's macroVersion() when the forms last finished running.
+    // While it stays the same, they are what expanding them again would
+    // give.
+    size_t macros_ = 0;
+  };
+
+  // The key of a file is its canonical path.
+  static bool identify_(const char* filename, string* key,
+                        struct timespec* mtime) {
+    struct stat st;
+    char* path = realpath(filename, nullptr);
+    if (!path || stat(path, &st) != 0) {
+      free(path);
+      return false;
+    }
+    *key = path;
+    *mtime = st.st_mtim;
+    free(path);
+    return true;
+  }
+
+  // Imports a file: loads it the first time, reloads it if it has been
+  // modified, re-runs it if something it imports was reloaded or re-run,
+  // and otherwise does nothing.  Re-running becomes reloading if macros
+  // have been defined since it last ran, since its forms may expand
+  // differently now.  Each module is only considered once per
+  // generation, which also stops circular imports.  Sets key to the
+  // file's key.
+  bool import_(const string& filename, string* key) {
+    struct timespec mtime;
+    if (!identify_(filename.c_str(), key, &mtime)) {
+      schemeError() << "Couldn't open " << filename << "." << endl;
+      return false;
+    }
+    auto i = modules_.find(*key);
+    if (i == modules_.end()) {
+      return loadModule_(*key, filename.c_str(), mtime);
+    }
+    Module& module = i->second;
+    if (module.generation_ == generation_) {
+      return true;
+    }
+    if (module.mtime_.tv_sec != mtime.tv_sec ||
+        module.mtime_.tv_nsec != mtime.tv_nsec) {
+      return loadModule_(*key, filename.c_str(), mtime);
+    }
+    module.generation_ = generation_;
+    bool stale = false;
+    for (Module::Form& form : module.forms_) {
+      if (!form.import_.empty()) {
+        string key;
+        if (!import_(form.import_, &key)) {
+          return false;
+        }
+        stale |= modules_[form.import_].version_ != form.version_;
+      }
+    }
+    if (stale && module.macros_ != analyzer_->macroVersion()) {
+      return loadModule_(*key, filename.c_str(), mtime);
+    }
+    if (stale) {
+      runModule_(module);
+    }
+    return true;
+  }
+
+  // Reads, analyzes and runs a file, replacing what was kept of any
+  // earlier version.  name is the file as it was given, for messages.
+  bool loadModule_(const string& key, const char* name,
+                   struct timespec mtime) {
+    SourceFile source;
+    if (!source.open(key.c_str())) {
+      schemeError() << "Couldn't open " << name << "." << endl;
+      return false;
+    }
+    Module& module = modules_[key];
+    module.mtime_ = mtime;
+    module.forms_.clear();
+    module.generation_ = generation_;
+    module.version_++;
+    Tokenizer t(source.begin(), source.end());
+    if (!load_(t, name, nullptr, &module)) {
+      // Loaded afresh next time.
+      modules_.erase(key);
+      return false;
+    }
+    module.macros_ = analyzer_->macroVersion();
+    return true;
+  }
+
+  void runModule_(Module& module) {
+    module.version_++;
+    for (Module::Form& form : module.forms_) {
+      if (form.import_.empty()) {
+        guard_(form.run_);
+      }
+      else {
+        form.version_ = modules_[form.import_].version_;
+      }
+      heap->safePoint();
+    }
+    module.macros_ = analyzer_->macroVersion();
+  }
+
+  // Runs f, which evaluates all or part of a top-level form, and returns
+  // whether it finished.  If f fails with an error, the error was reported
+  // and counted, and the calling thread is cleaned up here.
+  template <class F>
+  static bool guard_(F f) {
+    UnwindPoint unwind;
+    try {
+      f();
+      return true;
+    }
+    catch (const SchemeError&) {
+      unwind.restore();
+      return false;
+    }
+  }
+
+  // Runs the forms read by t, keeping them in module if there is one.
+  bool load_(Tokenizer& t, const char* name, SchemeType* result,
+             Module* module) {
+    SchemeParser p(t);
+    for (;;) {
+      SchemeType sexp(p.readSexp());
+
+      if (sexp.isEof()) {
+        break;
+      }
+      if (sexp.sexpType() == SchemeType::SexpType::ERR) {
+        schemeError() << "in " << name << endl;
+        return false;
+      }
+      profiler->setLocation(name, p.line());
+      for (auto& line : p.lambdaLines()) {
+        profiler->setLine(line.first, line.second);
+      }
+
+      if (carIsId(sexp, atomImport)) {
+        if (SchemeAnalyzer::listLength(sexp) != 2 ||
+            sexp.cdr().car().sexpType() != SchemeType::SexpType::STR) {
+          schemeError() << "syntax error: " << sexp << endl;
+          schemeError() << "in " << name << endl;
+          return false;
+        }
+        // Copied: the string object may be collected during the import.
+        string path = sexp.cdr().car().str();
+        string key;
+        if (!import_(path, &key)) {
+          return false;
+        }
+        if (module) {
+          module->forms_.push_back(
+            Module::Form{nullptr, key, modules_[key].version_});
+        }
+      }
+      else if (emitter_) {
+        guard_([&] {
+          auto e_sexp(analyzer_->expandMacros(sexp));
+          emitter_->add(sexp, e_sexp);
+          if (CppEmitter::evalAtCompileTime(e_sexp)) {
+            backend_->compile(e_sexp)();
+          }
+        });
+      }
+      else {
+        if (echo_) {
+          schemeOutput() << "-->> " << sexp << '\n';
+        }
+        Backend::Thunk thunk;
+        SchemeType r_sexp;
+        guard_([&] {
+          auto e_sexp(analyzer_->expandMacros(sexp));
+          thunk = backend_->compile(e_sexp);
+          r_sexp = thunk();
+        });
+        if (echo_) {
+          schemeOutput() << r_sexp << '\n' << "------- " << '\n';
+        }
+        if (result) {
+          *result = r_sexp;
+        }
+        // A form that failed to compile is left out.
+        if (module && thunk) {
+          module->forms_.push_back(Module::Form{thunk, string(), 0});
+        }
+      }
+
+      heap->safePoint();
+    }
+
+    return true;
+  }
+
+  // The isolate's own parts, declared first so that they outlive the
+  // rest.
+  Heap heap_;
+  Profiler profiler_;
+  SchemeStreams streams_;
+  WorkerPool workers_;
+  // Closure and builtin calls made on the threads that called in.
+  size_t calls_ = 0;
+
+  Symtab globals_;
+  std::unique_ptr<SchemeAnalyzer> analyzer_;
+  std::unique_ptr<Backend> backend_;
+  bool useVM_;
+  bool echo_ = false;
+  // Values behind Procedure handles.
+  vector<SchemeType> handles_;
+  // Loaded files by key.
+  unordered_map<string, Module> modules_;
+  // Bumped by each loadFile and evalString.
+  size_t generation_ = 0;
+  // Set while emitCpp is compiling.
+  CppEmitter* emitter_ = nullptr;
+};
+
+
+//-----------------------------------------------------------------------------
+// Batch Driver
+//-----------------------------------------------------------------------------
+
+// How runBatch sets up the Interpreter for each file.
+struct BatchOptions {
+  bool useVM_ = false;
+  bool echo_ = false;
+  // An image each Interpreter starts from, if not null.
+  const char* image_ = nullptr;
+  // Files run at once, each on a thread of its own; 0 means one per core.
+  size_t jobs_ = 0;
+  // Threads each Interpreter's futures and pmap use.
+  size_t threads_ = 1;
+};
+
+// Runs each file in an Interpreter of its own, several at a time.  A
+// file's output and errors are collected and written to out and err once
+// it and every file before it are done, so they come out in file order.
+// Adds the Interpreters' counters to stats if it isn't null.  Returns
+// false if any file failed: couldn't be read or reported an error.  An
+// error only fails the file it happens in.
+bool runBatch(const vector<const char*>& files, const BatchOptions& options,
+              ostream& out, ostream& err, Stats* stats) {
+  struct Result {
+    std::ostringstream out_;
+    std::ostringstream err_;
+    bool ok_ = false;
+    bool done_ = false;
+  };
+  vector<Result> results(files.size());
+  std::atomic<size_t> next(0);
+  std::mutex mutex;
+  std::condition_variable finished;
+  Stats total;
+
+  auto work = [&]() {
+    for (size_t i; (i = next++) < files.size();) {
+      Result& result = results[i];
+      Stats counts;
+      bool ok;
+      {
+        Interpreter interp(options.useVM_);
+        interp.setEcho(options.echo_);
+        interp.setOutput(result.out_);
+        interp.setErrors(result.err_);
+        interp.setThreads(options.threads_);
+        ok = (!options.image_ || interp.loadImage(options.image_)) &&
+          interp.loadFile(files[i]) && interp.errors() == 0;
+        interp.addStats(&counts);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      result.ok_ = ok;
+      result.done_ = true;
+      total += counts;
+      finished.notify_all();
+    }
+  };
+
+  size_t jobs = options.jobs_ ? options.jobs_
+                              : std::max(std::thread::hardware_concurrency(),
+                                         1u);
+  vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(jobs, files.size()); ++i) {
+    threads.emplace_back(work);
+  }
+  bool ok = true;
+  for (Result& result : results) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [&result] { return result.done_; });
+    }
+    out << result.out_.str();
+    err << result.err_.str();
+    result.out_.str(string());
+    result.err_.str(string());
+    ok &= result.ok_;
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  if (stats) {
+    *stats += total;
+  }
+  return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Compiled Programs
+//-----------------------------------------------------------------------------
+
+// Prints --stats counters, and the process's peak memory use.
+void printStats(const Stats& stats, ostream& os) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  stats.print(os);
+  os << "peak-rss-kb: " << usage.ru_maxrss << endl;
+}
+
+// The main function of a program compiled by --emit-cpp.  It takes the
+// interpreter's --quiet, --stats, --profile and --threads.
+int compiledMain(const CompiledProgram& program, int argc,
+                 const char* argv[]) {
+  bool echo = true;
+  bool stats = false;
+  bool profile = false;
+  size_t threads = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--quiet")) {
+      echo = false;
+    }
+    else if (!strcmp(argv[i], "--stats")) {
+      stats = true;
+    }
+    else if (!strcmp(argv[i], "--profile")) {
+      profile = true;
+    }
+    else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(atoi(argv[++i]), 1);
+    }
+  }
+
+  Interpreter interp;
+  interp.setEcho(echo);
+  interp.setThreads(threads);
+  if (profile) {
+    interp.enableProfiling();
+  }
+  interp.runCompiled(program);
+  if (stats) {
+    Stats counts;
+    interp.addStats(&counts);
+    printStats(counts, cerr);
+  }
+  if (profile) {
+    interp.reportProfile(cerr);
+  }
+  return interp.errors() ? 1 : 0;
+}
+
+// Usage: scheme [--vm] [--stats] [--profile] [--quiet] [--threads n]
+//               [--jobs n] [--image file] [--dump-image file]
+//               [--emit-cpp file] [file | --]...
+//
+// Files are interpreted in order; "--" (or no files at all) reads stdin.
+// Each form and its value are echoed unless --quiet is given.  An error
+// abandons the form it happens in, and makes the exit status 1 once every
+// file has run.
+// --vm runs everything on the bytecode VM instead of the closure tree.
+// --image starts from an image instead of an empty environment, and
+// --dump-image writes one after the files have run; both imply --vm.
+// --stats prints counters to stderr on exit, one "name: value" per line.
+// --profile profiles closure and builtin calls and prints a report to
+// stderr on exit; see also the profile-report and profile-folded builtins.
+// --threads sets how many threads futures and pmap use, the caller's
+// included; it defaults to one per core, and --profile makes it 1.
+// --jobs runs each file in an Interpreter of its own instead, n at a time
+// (0 for one per core), and prints their output in file order; see
+// runBatch.  Each starts from the --image if there is one.  --threads
+// then defaults to 1.
+// --emit-cpp compiles the files to a C++ program instead of running them;
+// see CppEmitter and the comment at the top of the output.  The program
+// takes --quiet, --stats, --profile and --threads, and behaves as running
+// the files would.
+#ifndef SCHEME_NO_MAIN
+int main(int argc, const char* argv[]) {
+  vector<const char*> files;
+  const char* image = nullptr;
+  const char* dumpImage = nullptr;
+  const char* emitCpp = nullptr;
+  bool useVM = false;
+  bool stats = false;
+  bool profile = false;
+  bool echo = true;
+  size_t threads = 0;
+  int jobs = -1;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--vm")) {
+      useVM = true;
+    }
+    else if (!strcmp(argv[i], "--stats")) {
+      stats = true;
+    }
+    else if (!strcmp(argv[i], "--profile")) {
+      profile = true;
+    }
+    else if (!strcmp(argv[i], "--quiet")) {
+      echo = false;
+    }
+    else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(atoi(argv[++i]), 1);
+    }
+    else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+      jobs = std::max(atoi(argv[++i]), 0);
+    }
+    else if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+      image = argv[++i];
+      useVM = true;
+    }
+    else if (!strcmp(argv[i], "--dump-image") && i + 1 < argc) {
+      dumpImage = argv[++i];
+      useVM = true;
+    }
+    else if (!strcmp(argv[i], "--emit-cpp") && i + 1 < argc) {
+      emitCpp = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--")) {
+      files.push_back(nullptr);
+    }
+    else {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.empty()) {
+    files.push_back(nullptr);
+  }
+
+  Stats counts;
+  auto printCounts = [stats, &counts]() {
+    if (stats) {
+      printStats(counts, cerr);
+    }
+  };
+  if (emitCpp) {
+    if (jobs >= 0 || image || dumpImage) {
+      cerr << "--emit-cpp can't be used with --jobs or images." << endl;
+      return 1;
+    }
+    std::ofstream out(emitCpp);
+    if (!out) {
+      cerr << "Couldn't write " << emitCpp << "." << endl;
+      return 1;
+    }
+    Interpreter interp(useVM);
+    if (!interp.emitCpp(files, out)) {
+      return 1;
+    }
+  }
+  else if (jobs >= 0) {
+    if (profile || dumpImage ||
+        std::count(files.begin(), files.end(), nullptr)) {
+      cerr << "--jobs can't be used with --profile, --dump-image or stdin."
+           << endl;
+      return 1;
+    }
+    BatchOptions options;
+    options.useVM_ = useVM;
+    options.echo_ = echo;
+    options.image_ = image;
+    options.jobs_ = jobs;
+    options.threads_ = threads ? threads : 1;
+    if (!runBatch(files, options, cout, cerr, &counts)) {
+      return 1;
+    }
+    printCounts();
+  }
+  else {
+    Interpreter interp(useVM);
+    interp.setEcho(echo);
+    interp.setThreads(threads);
+    if (profile) {
+      interp.enableProfiling();
+    }
+
+    if (image && !interp.loadImage(image)) {
+      return 1;
+    }
+    for (const char* filename : files) {
+      if (!interp.loadFile(filename)) {
+        return 1;
+      }
+    }
+    if (dumpImage && !interp.saveImage(dumpImage)) {
+      return 1;
+    }
+    interp.addStats(&counts);
+    printCounts();
+    if (profile) {
+      interp.reportProfile(cerr);
     }
-    if (!interpret(filename, a, env)) {
+    if (interp.errors()) {
       return 1;
     }
   }
 
   return 0;
 }
+#endif  // SCHEME_NO_MAIN
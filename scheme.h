@@ -0,0 +1,1365 @@
+// The runtime that scheme.cc and the programs --emit-cpp generates share:
+// values, the heap and its roots, frames, closures, the primitives the
+// analyzer inlines and the entry points compiled code calls.  Everything
+// else, the interpreter included, is in scheme.cc.
+#ifndef SCHEME_H_
+#define SCHEME_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <unordered_map>
+
+#include <string.h>
+
+using std::cin;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::function;
+using std::istream;
+using std::ostream;
+using std::pair;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::unordered_map;
+using std::unordered_multimap;
+using std::vector;
+
+using Number = double;
+
+// Where display and newline write, and where errors are reported and
+// counted.  Each Interpreter has its own, which the threads of its worker
+// pool share with the thread calling in, so writing or changing a stream
+// holds mutex_.
+struct SchemeStreams {
+  ostream* out_ = &cout;
+  ostream* err_ = &cerr;
+  std::atomic<size_t> errors_{0};
+  std::mutex mutex_;
+};
+
+// The streams of the Interpreter the calling thread is running.
+extern thread_local SchemeStreams* schemeStreams;
+
+// Writes to one of the calling thread's streams, holding their lock until
+// the end of the statement, as in  schemeOutput() << x << '\n';
+class StreamWriter {
+ public:
+  StreamWriter(SchemeStreams& streams, bool err) :
+      lock_(streams.mutex_), os_(err ? *streams.err_ : *streams.out_) { }
+
+  template <typename T>
+  StreamWriter& operator<<(T&& x) {
+    os_ << std::forward<T>(x);
+    return *this;
+  }
+  StreamWriter& operator<<(ostream& (*manipulator)(ostream&)) {
+    os_ << manipulator;
+    return *this;
+  }
+
+ private:
+  std::unique_lock<std::mutex> lock_;
+  ostream& os_;
+};
+
+StreamWriter schemeOutput();
+StreamWriter schemeError();
+
+// Thrown once an error has been reported, to abandon the top-level form
+// being evaluated: nothing after the error in the form runs, and the form
+// fails.  The Interpreter catches it around each form it runs.
+struct SchemeError { };
+
+// Reports that the heap couldn't get memory for an object, and throws
+// SchemeError.
+[[noreturn]] void outOfMemory();
+
+//-----------------------------------------------------------------------------
+// Atoms
+//-----------------------------------------------------------------------------
+
+// A non-owning view of characters, e.g. a token in a source buffer.
+struct StringView {
+  StringView(const char* data, size_t size) : data_(data), size_(size) { }
+  StringView(const string& s) : data_(s.data()), size_(s.size()) { }
+
+  bool operator==(StringView other) const {
+    return size_ == other.size_ && !memcmp(data_, other.data_, size_);
+  }
+
+  struct Hash {
+    size_t operator()(StringView s) const {
+      // FNV-1a
+      size_t h = 14695981039346656037ull;
+      for (size_t i = 0; i < s.size_; ++i) {
+        h = (h ^ (unsigned char)s.data_[i]) * 1099511628211ull;
+      }
+      return h;
+    }
+  };
+
+  const char* data_;
+  size_t size_;
+};
+
+// An Atom is an interned symbol name.  Each distinct name is stored exactly
+// once in a global table, so atoms compare and hash by address instead of
+// by string contents.  The table is the one thing every Interpreter shares;
+// it only grows, under a lock.
+class Atom {
+ public:
+  constexpr Atom() : name_(nullptr) { }
+
+  static Atom intern(StringView name) {
+    Table& atoms = table();
+    std::lock_guard<std::mutex> lock(atoms.mutex_);
+    auto i = atoms.index_.find(name);
+    if (i != atoms.index_.end()) {
+      return Atom(i->second);
+    }
+    atoms.names_.emplace_back(name.data_, name.size_);
+    const string* interned = &atoms.names_.back();
+    atoms.index_.emplace(StringView(*interned), interned);
+    return Atom(interned);
+  }
+
+  static Atom intern(const string& name) { return intern(StringView(name)); }
+  static Atom intern(const char* name) {
+    return intern(StringView(name, strlen(name)));
+  }
+
+  const string& name() const { return *name_; }
+  bool isNull() const { return name_ == nullptr; }
+
+  bool operator==(Atom other) const { return name_ == other.name_; }
+  bool operator!=(Atom other) const { return name_ != other.name_; }
+
+  struct Hash {
+    size_t operator()(Atom a) const {
+      return std::hash<const string*>()(a.name_);
+    }
+  };
+
+ private:
+  explicit Atom(const string* name) : name_(name) { }
+
+  // Keys view the names, which a deque never moves.
+  struct Table {
+    std::mutex mutex_;
+    std::deque<string> names_;
+    unordered_map<StringView, const string*, StringView::Hash> index_;
+  };
+
+  // Function-local so that it is constructed before any static Atom below.
+  static Table& table() {
+    static Table atoms;
+    return atoms;
+  }
+
+  const string* name_;
+};
+
+ostream& operator<<(ostream& os, Atom a);
+
+//-----------------------------------------------------------------------------
+// Type System
+//-----------------------------------------------------------------------------
+class SchemeType;
+class Frame;
+class Args;
+struct SchemeBuiltin;
+struct SchemeClosure;
+struct SchemeHashTable;
+struct SchemeFuture;
+struct ProcInfo;
+struct Lambda;
+
+// Builtins take their arguments as a span and return their result by value.
+// Besides the general entry point, a builtin may have fixed-arity ones that
+// calls with exactly that many arguments use instead.
+using BuiltinFunc = SchemeType (*)(Args args);
+using Builtin0 = SchemeType (*)();
+using Builtin1 = SchemeType (*)(SchemeType& a);
+using Builtin2 = SchemeType (*)(SchemeType& a, SchemeType& b);
+using Builtin3 = SchemeType (*)(SchemeType& a, SchemeType& b, SchemeType& c);
+
+// STACK_FRAME objects live on a FrameStack rather than in the heap proper.
+enum class HeapKind : char {
+  FREE, PAIR, STRING, BUILTIN, CLOSURE, FRAME, STACK_FRAME, F64VECTOR,
+  S64VECTOR, HASHTABLE, FUTURE, NUM_KINDS
+};
+
+// Header shared by every object allocated from the garbage-collected Heap.
+// Numbers, booleans, symbols and nil are stored inline in a SchemeType;
+// everything else is a pointer to one of these.
+struct HeapObject {
+  HeapObject(HeapKind kind) : kind_(kind), marked_(false) { }
+  HeapKind kind_;
+  bool marked_;
+};
+
+class SchemeType {
+ public:
+  // Alternatively, should we use inheritance and polymorphism?
+  // TAIL_CALL is internal to the evaluator and never escapes a closure call.
+  enum class SexpType : char {
+    ID, NUM, BOOL, STR, EOF_, ERR, CONS, BUILTIN, CLOSURE, NIL, TAIL_CALL,
+    F64VECTOR, S64VECTOR, HASHTABLE, FUTURE
+  };
+
+  SchemeType(Number num) : ty_(SexpType::NUM) { num_ = num; }
+  SchemeType(Atom atom) : ty_(SexpType::ID) { atom_ = atom; }
+  SchemeType() : ty_(SexpType::ERR) { obj_ = nullptr; }
+  SchemeType(SexpType ty) : ty_(ty) { obj_ = nullptr; }
+  SchemeType(SchemeType car, SchemeType cdr);
+  SchemeType(SchemeBuiltin* builtin);
+  SchemeType(SchemeClosure* closure);
+
+  static SchemeType fromBool(bool b) {
+    SchemeType ret(SexpType::BOOL);
+    ret.boolVal_ = b;
+    return ret;
+  }
+
+  static SchemeType userString(const string& str);
+
+  // A value of type ty for an existing heap object of the matching kind.
+  static SchemeType fromObject(SexpType ty, HeapObject* obj) {
+    SchemeType ret(ty);
+    ret.obj_ = obj;
+    return ret;
+  }
+
+  SexpType sexpType() { return ty_; }
+  Atom atom() const { return atom_; }
+  const string& id() const { return atom_.name(); }
+  const string& str() const;
+  Number num() { return num_; }
+  bool boolVal() { return boolVal_; }
+  SchemeType& car();
+  SchemeType& cdr();
+  SchemeBuiltin* builtin();
+  SchemeClosure* closure();
+  // V is F64Vector or S64Vector.
+  template <class V>
+  V* numVector() { return static_cast<V*>(obj_); }
+  SchemeHashTable* hashTable();
+  SchemeFuture* future();
+
+  // The heap object this value points to, or null for immediates.
+  HeapObject* heapObject() const {
+    return (ty_ == SexpType::STR || ty_ == SexpType::CONS ||
+            ty_ == SexpType::BUILTIN || ty_ == SexpType::CLOSURE ||
+            ty_ == SexpType::F64VECTOR || ty_ == SexpType::S64VECTOR ||
+            ty_ == SexpType::HASHTABLE || ty_ == SexpType::FUTURE)
+      ? obj_ : nullptr;
+  }
+
+  bool isNil()  { return ty_ == SexpType::NIL;  }
+  bool isCons() { return ty_ == SexpType::CONS; }
+  bool isId()   { return ty_ == SexpType::ID;   }
+  bool isNum()  { return ty_ == SexpType::NUM;  }
+  bool isEof()  { return ty_ == SexpType::EOF_; }
+
+  bool toBool() {
+    return (ty_ == SexpType::BOOL && boolVal_) ||
+      (ty_ != SexpType::BOOL);
+  }
+
+  bool eq(SchemeType& other);
+  // Like eq?, but compares pairs and numeric vectors by their contents.
+  bool equal(SchemeType& other);
+
+  void print(ostream& os);
+
+ private:
+  template <class V>
+  static void printNumVector_(ostream& os, const char* prefix, V* v);
+
+  SexpType ty_;
+  union {
+    Number num_;
+    bool boolVal_;
+    Atom atom_;
+    HeapObject* obj_;
+  };
+};
+
+static_assert(sizeof(SchemeType) == 16, "SchemeType should be two words");
+
+// A view of call arguments, usually a slice of an evaluation stack.  It is
+// only valid until the callee runs Scheme code, which may grow the stack.
+class Args {
+ public:
+  Args(SchemeType* data, size_t size) : data_(data), size_(size) { }
+  Args(vector<SchemeType>& v) : data_(v.data()), size_(v.size()) { }
+
+  size_t size() const { return size_; }
+  SchemeType* begin() const { return data_; }
+  SchemeType* end() const { return data_ + size_; }
+  SchemeType& operator[](size_t i) const { return data_[i]; }
+
+ private:
+  SchemeType* data_;
+  size_t size_;
+};
+
+struct SchemePair : HeapObject {
+  static const HeapKind kKind = HeapKind::PAIR;
+  SchemePair(SchemeType car, SchemeType cdr) :
+      HeapObject(kKind), car_(car), cdr_(cdr) { }
+  SchemeType car_;
+  SchemeType cdr_;
+};
+
+struct SchemeString : HeapObject {
+  static const HeapKind kKind = HeapKind::STRING;
+  SchemeString(const string& str) : HeapObject(kKind), str_(str) { }
+  string str_;
+};
+
+// Entry points a builtin doesn't have are null.
+struct SchemeBuiltin : HeapObject {
+  static const HeapKind kKind = HeapKind::BUILTIN;
+  SchemeBuiltin() : HeapObject(kKind) { }
+  BuiltinFunc func_ = nullptr;
+  Builtin0 fixed0_ = nullptr;
+  Builtin1 fixed1_ = nullptr;
+  Builtin2 fixed2_ = nullptr;
+  Builtin3 fixed3_ = nullptr;
+  ProcInfo* info_ = nullptr;
+};
+
+// A homogeneous numeric vector (as in SRFI 4): size_ elements of type T,
+// allocated inline after the header like a Frame's slots.
+template <typename T, HeapKind K, SchemeType::SexpType Ty>
+struct NumVector : HeapObject {
+  using Element = T;
+  static const HeapKind kKind = K;
+  static const SchemeType::SexpType kType = Ty;
+
+  // Fails with outOfMemory if size is over maxSize() or can't be had.
+  static NumVector* make(size_t size);
+  // The most elements whose size in bytes, with the header, fits a size_t.
+  static size_t maxSize() {
+    return (SIZE_MAX - sizeof(NumVector)) / sizeof(T);
+  }
+
+  size_t size() const { return size_; }
+  T* data() { return reinterpret_cast<T*>(this + 1); }
+  T& operator[](size_t i) { return data()[i]; }
+
+  SchemeType value() { return SchemeType::fromObject(kType, this); }
+
+ private:
+  explicit NumVector(size_t size) : HeapObject(kKind), size_(size) { }
+
+  size_t size_;
+};
+
+using F64Vector = NumVector<double, HeapKind::F64VECTOR,
+                            SchemeType::SexpType::F64VECTOR>;
+using S64Vector = NumVector<int64_t, HeapKind::S64VECTOR,
+                            SchemeType::SexpType::S64VECTOR>;
+
+size_t hashValue(SchemeType& x, bool equal);
+
+// A hash table keyed on Scheme values, which compares keys with eq? or,
+// if equal_ is set, equal?.  It uses open addressing with linear probing
+// over a power-of-two number of slots.  Removing a key leaves a tombstone,
+// which is reused by later inserts and dropped when the table is resized.
+struct SchemeHashTable : HeapObject {
+  static const HeapKind kKind = HeapKind::HASHTABLE;
+  explicit SchemeHashTable(bool equal) : HeapObject(kKind), equal_(equal) { }
+
+  struct Slot {
+    enum State : char { EMPTY, FULL, DELETED };
+    SchemeType key_;
+    SchemeType value_;
+    size_t hash_;
+    State state_ = EMPTY;
+  };
+
+  bool equal() const { return equal_; }
+  size_t count() const { return count_; }
+  vector<Slot>& slots() { return slots_; }
+
+  // The value stored under key, or null.
+  SchemeType* find(SchemeType& key) {
+    if (count_ == 0) {
+      return nullptr;
+    }
+    Slot* slot = probe_(key, hashValue(key, equal_));
+    return slot->state_ == Slot::FULL ? &slot->value_ : nullptr;
+  }
+
+  void set(SchemeType& key, SchemeType& value) {
+    if ((count_ + tombstones_ + 1) * 4 > slots_.size() * 3) {
+      resize_((count_ + 1) * 2);
+    }
+    size_t hash = hashValue(key, equal_);
+    Slot* slot = probe_(key, hash);
+    if (slot->state_ != Slot::FULL) {
+      // Reuse the first tombstone on the way, if there was one.
+      Slot* free = firstFree_ ? firstFree_ : slot;
+      if (free->state_ == Slot::DELETED) {
+        tombstones_--;
+      }
+      free->key_ = key;
+      free->hash_ = hash;
+      free->state_ = Slot::FULL;
+      slot = free;
+      count_++;
+    }
+    slot->value_ = value;
+  }
+
+  bool remove(SchemeType& key) {
+    if (count_ == 0) {
+      return false;
+    }
+    Slot* slot = probe_(key, hashValue(key, equal_));
+    if (slot->state_ != Slot::FULL) {
+      return false;
+    }
+    slot->state_ = Slot::DELETED;
+    slot->key_ = SchemeType();
+    slot->value_ = SchemeType();
+    count_--;
+    tombstones_++;
+    return true;
+  }
+
+ private:
+  static const size_t kMinSlots = 8;
+
+  // Finds key's slot, or the empty slot that ends its probe sequence.
+  // Remembers the first tombstone passed in firstFree_.
+  Slot* probe_(SchemeType& key, size_t hash) {
+    size_t mask = slots_.size() - 1;
+    firstFree_ = nullptr;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Slot& slot = slots_[i];
+      if (slot.state_ == Slot::EMPTY) {
+        return &slot;
+      }
+      if (slot.state_ == Slot::DELETED) {
+        if (!firstFree_) {
+          firstFree_ = &slot;
+        }
+      }
+      else if (slot.hash_ == hash &&
+               (equal_ ? slot.key_.equal(key) : slot.key_.eq(key))) {
+        return &slot;
+      }
+    }
+  }
+
+  // Rehashes into the smallest power of two of at least minSlots.
+  void resize_(size_t minSlots) {
+    size_t size = kMinSlots;
+    while (size < minSlots) {
+      size *= 2;
+    }
+    vector<Slot> old(size);
+    old.swap(slots_);
+    tombstones_ = 0;
+    for (Slot& slot : old) {
+      if (slot.state_ == Slot::FULL) {
+        size_t i = slot.hash_ & (size - 1);
+        while (slots_[i].state_ != Slot::EMPTY) {
+          i = (i + 1) & (size - 1);
+        }
+        slots_[i] = slot;
+      }
+    }
+  }
+
+  bool equal_;
+  size_t count_ = 0;
+  size_t tombstones_ = 0;
+  vector<Slot> slots_;
+  Slot* firstFree_ = nullptr;
+};
+
+// The value of (make-future thunk).  Whichever thread claims it first,
+// a worker or the first to touch it, calls the thunk.
+struct SchemeFuture : HeapObject {
+  static const HeapKind kKind = HeapKind::FUTURE;
+  enum State { PENDING, RUNNING, DONE };
+
+  explicit SchemeFuture(SchemeType thunk) :
+      HeapObject(kKind), thunk_(thunk) { }
+
+  bool claim() {
+    int pending = PENDING;
+    return state_.compare_exchange_strong(pending, RUNNING);
+  }
+  bool done() const { return state_.load() == DONE; }
+
+  SchemeType thunk_;
+  SchemeType result_;
+  std::atomic<int> state_{PENDING};
+  // Whether the thunk failed with an error instead of returning result_.
+  bool failed_ = false;
+  // Where the future is in the pool's list of queued futures, if it is.
+  size_t queued_ = 0;
+};
+
+//-----------------------------------------------------------------------------
+// Heap
+//-----------------------------------------------------------------------------
+
+// Fixed-size object pool.  Objects are bump-allocated out of large chunks
+// and, once swept, recycled through a free list.
+class Pool {
+ public:
+  explicit Pool(size_t objSize) : objSize_(objSize) { }
+  ~Pool() {
+    for (char* chunk : chunks_) {
+      free(chunk);
+    }
+  }
+
+  size_t objSize() const { return objSize_; }
+
+  void* alloc() {
+    if (free_) {
+      FreeSlot* slot = free_;
+      free_ = slot->next_;
+      return slot;
+    }
+    if (bump_ + objSize_ > end_) {
+      newChunk_();
+    }
+    void* p = bump_;
+    bump_ += objSize_;
+    return p;
+  }
+
+  void release(HeapObject* obj) {
+    FreeSlot* slot = new (obj) FreeSlot();
+    slot->next_ = free_;
+    free_ = slot;
+  }
+
+  // Calls f on every slot ever handed out, including free ones.
+  template <typename F>
+  void forEach(F f) {
+    for (char* chunk : chunks_) {
+      char* end = (chunk == chunks_.back()) ? bump_ :
+        chunk + (kChunkBytes / objSize_) * objSize_;
+      for (char* p = chunk; p < end; p += objSize_) {
+        f(reinterpret_cast<HeapObject*>(p));
+      }
+    }
+  }
+
+ private:
+  static const size_t kChunkBytes = 64 * 1024;
+
+  struct FreeSlot : HeapObject {
+    FreeSlot() : HeapObject(HeapKind::FREE) { }
+    FreeSlot* next_;
+  };
+
+  void newChunk_() {
+    char* chunk = static_cast<char*>(malloc(kChunkBytes));
+    if (!chunk) {
+      outOfMemory();
+    }
+    chunks_.push_back(chunk);
+    bump_ = chunk;
+    end_ = chunk + kChunkBytes;
+  }
+
+  size_t objSize_;
+  vector<char*> chunks_;
+  char* bump_ = nullptr;
+  char* end_ = nullptr;
+  FreeSlot* free_ = nullptr;
+};
+
+// Memory for frames that nothing but their own call can reach (see
+// Frame::makeOnStack), taken and given back in LIFO order.  Chunks are
+// kept once made, so deep recursion pays for them only the first time.
+class FrameStack {
+ public:
+  ~FrameStack() {
+    for (char* chunk : chunks_) {
+      free(chunk);
+    }
+  }
+
+  // Returns null if bytes would not fit in a chunk.
+  void* push(size_t bytes) {
+    if (top_ + bytes > end_) {
+      if (bytes > kChunkBytes) {
+        return nullptr;
+      }
+      nextChunk_();
+    }
+    void* p = top_;
+    top_ += bytes;
+    pushes_++;
+    return p;
+  }
+
+  // Gives back p and everything pushed after it.
+  void pop(void* p) {
+    char* block = static_cast<char*>(p);
+    while (block < end_ - kChunkBytes || block >= end_) {
+      current_--;
+      top_ = tops_.back();
+      tops_.pop_back();
+      end_ = chunks_[current_] + kChunkBytes;
+    }
+    top_ = block;
+  }
+
+  size_t pushes() const { return pushes_; }
+
+ private:
+  static const size_t kChunkBytes = 64 * 1024;
+
+  void nextChunk_() {
+    if (end_) {
+      tops_.push_back(top_);
+      current_++;
+    }
+    if (current_ == chunks_.size()) {
+      chunks_.push_back(static_cast<char*>(malloc(kChunkBytes)));
+    }
+    top_ = chunks_[current_];
+    end_ = top_ + kChunkBytes;
+  }
+
+  vector<char*> chunks_;
+  size_t current_ = 0;
+  // Where top_ was in each chunk below the current one.
+  vector<char*> tops_;
+  char* top_ = nullptr;
+  char* end_ = nullptr;
+  size_t pushes_ = 0;
+};
+
+// Global bindings.  Everything not bound by an enclosing lambda lives here.
+using Symtab = unordered_map<Atom, SchemeType, Atom::Hash>;
+
+// Mark-sweep garbage collector over size-class pools.
+//
+// Roots are the registered symbol tables, the code of top-level forms that
+// may still run (see CodeRoot), and whatever C++ locals are registered
+// through the *Root guards below.  The constants a lambda's code uses are
+// traced from the closures over it, so they live exactly as long as code
+// that can use them.  Collection only happens at safe points, where every
+// value the evaluator still needs is reachable from those roots.
+//
+// Each Interpreter has a heap of its own, which the threads running it
+// enter (see Interpreter::Enter) and reach through the thread-local heap
+// pointer below.  Several threads may evaluate in one heap at once (see
+// WorkerPool).  Each allocates from pools of its own and has its own *Root
+// guards.  Collecting, and anything else that needs every thread to keep
+// still, stops the world: it waits until each other thread in the heap is
+// parked at a safe point, blocked (see Blocking) or gone, and keeps them
+// there until it is done.
+class Heap {
+ public:
+  static const size_t kNumPools = 16;
+
+  // What the heap keeps for each thread that uses it.
+  struct ThreadState {
+    explicit ThreadState(std::thread::id id) : id_(id) {
+      for (size_t i = 0; i < kNumPools; ++i) {
+        pools_.emplace_back(new Pool((i + 1) * kGranule));
+      }
+    }
+
+    std::thread::id id_;
+    vector<std::unique_ptr<Pool>> pools_;
+    vector<HeapObject*> large_;
+    size_t bytesSinceGC_ = 0;
+    size_t allocations_[(int)HeapKind::NUM_KINDS] = { };
+
+    // The tree-walking evaluator pushes each call's callee and arguments
+    // here and passes the arguments on as an Args span.
+    vector<SchemeType> evalStack_;
+    vector<SchemeType*> values_;
+    vector<vector<SchemeType>*> vectors_;
+    vector<Frame*> frames_;
+    FrameStack frameStack_;
+    int inhibit_ = 0;
+  };
+
+  Heap() { }
+  ~Heap();
+
+  template <typename T, typename... Args>
+  T* make(Args&&... args) {
+    return new (allocate(sizeof(T), T::kKind)) T(std::forward<Args>(args)...);
+  }
+
+  void* allocate(size_t bytes, HeapKind kind) {
+    ThreadState& ts = thread();
+    ts.allocations_[(int)kind]++;
+    ts.bytesSinceGC_ += bytes;
+    if (bytes > kMaxPooled) {
+      void* p = malloc(bytes);
+      if (!p) {
+        outOfMemory();
+      }
+      ts.large_.push_back(static_cast<HeapObject*>(p));
+      return p;
+    }
+    return ts.pools_[(bytes - 1) / kGranule]->alloc();
+  }
+  // Takes bytes from the calling thread's FrameStack, or returns null.
+  void* pushFrame(size_t bytes) { return thread().frameStack_.push(bytes); }
+  void popFrame(void* p) { thread().frameStack_.pop(p); }
+
+  void addRoots(Symtab* table) { add_(tables_, table); }
+  void addRoots(vector<SchemeType>* values) { add_(stacks_, values); }
+  void addRoots(vector<Frame*>* frames) { add_(frameStacks_, frames); }
+  void addRoots(Lambda* lambda) { add_(lambdas_, lambda); }
+
+  void removeRoots(Symtab* table) { erase_(tables_, table); }
+  void removeRoots(vector<SchemeType>* values) { erase_(stacks_, values); }
+  void removeRoots(vector<Frame*>* frames) { erase_(frameStacks_, frames); }
+  void removeRoots(Lambda* lambda) { erase_(lambdas_, lambda); }
+
+  // Collects if enough has been allocated since the last collection, and
+  // parks while another thread has the world stopped.
+  void safePoint() {
+    ThreadState& ts = thread();
+    if ((ts.bytesSinceGC_ >= threshold_ && ts.inhibit_ == 0) ||
+        stopRequested_.load(std::memory_order_relaxed)) {
+      safePointSlow_(ts);
+    }
+  }
+
+  void collect();
+
+  // Brackets code that must run with every other thread parked, such as
+  // collection or changing a global binding.  Cheap while only one thread
+  // runs.
+  void stopWorld();
+  void resumeWorld();
+
+  // Makes the calling thread one of those running in this heap, until it
+  // leaves.  A thread is in at most one heap at a time.  Objects it made
+  // stay where they are after it leaves, until they are collected.
+  void enter();
+  void leave();
+
+  // The calling thread's state in the heap it is in.
+  static ThreadState& thread() { return *current_; }
+
+  size_t allocations(HeapKind kind) {
+    std::lock_guard<std::mutex> lock(worldMutex_);
+    size_t total = 0;
+    for (auto& ts : threads_) {
+      total += ts->allocations_[(int)kind];
+    }
+    return total;
+  }
+  // Frames made on FrameStacks rather than allocated.
+  size_t stackFrames() {
+    std::lock_guard<std::mutex> lock(worldMutex_);
+    size_t total = 0;
+    for (auto& ts : threads_) {
+      total += ts->frameStack_.pushes();
+    }
+    return total;
+  }
+  // Allocations made by the calling thread.
+  size_t totalAllocations() {
+    ThreadState& ts = thread();
+    return std::accumulate(std::begin(ts.allocations_),
+                           std::end(ts.allocations_), size_t(0));
+  }
+  size_t collections() const { return collections_; }
+
+ private:
+  friend class ValueRoot;
+  friend class VectorRoot;
+  friend class FrameRoot;
+  friend class NoGC;
+  friend class Blocking;
+
+  static const size_t kGranule = 16;
+  static const size_t kMaxPooled = kGranule * kNumPools;
+  static const size_t kMinThreshold = 4 * 1024 * 1024;
+
+  template <typename T>
+  void add_(vector<T*>& roots, T* root) {
+    std::lock_guard<std::mutex> lock(rootsMutex_);
+    roots.push_back(root);
+  }
+
+  template <typename T>
+  void erase_(vector<T*>& roots, T* root) {
+    std::lock_guard<std::mutex> lock(rootsMutex_);
+    roots.erase(std::remove(roots.begin(), roots.end(), root), roots.end());
+  }
+
+  void safePointSlow_(ThreadState& ts);
+  void park_(std::unique_lock<std::mutex>& lock);
+  void collect_();
+
+  void mark_(const SchemeType& value) { markObject_(value.heapObject()); }
+  void markObject_(HeapObject* obj) {
+    if (obj && !obj->marked_) {
+      obj->marked_ = true;
+      markStack_.push_back(obj);
+    }
+  }
+  // Only roots refer to stack frames, and sweeping never sees them, so
+  // they are traced without being marked.
+  void markFrame_(HeapObject* frame) {
+    if (frame && frame->kind_ == HeapKind::STACK_FRAME) {
+      trace_(frame);
+    }
+    else {
+      markObject_(frame);
+    }
+  }
+  void trace_(HeapObject* obj);
+  void traceLambda_(Lambda* lambda);
+  static void finalize_(HeapObject* obj);
+
+  static thread_local ThreadState* current_;
+  vector<std::unique_ptr<ThreadState>> threads_;
+
+  std::mutex rootsMutex_;
+  vector<Symtab*> tables_;
+  vector<vector<SchemeType>*> stacks_;
+  vector<vector<Frame*>*> frameStacks_;
+  vector<Lambda*> lambdas_;
+  // NoGC guards held by all threads.
+  std::atomic<int> inhibit_{0};
+
+  // Guards threads_, running_ and stopRequested_.
+  std::mutex worldMutex_;
+  std::condition_variable worldChanged_;
+  // Registered threads that are neither parked nor blocked.
+  int running_ = 0;
+  std::atomic<bool> stopRequested_{false};
+
+  vector<HeapObject*> markStack_;
+  size_t threshold_ = kMinThreshold;
+  size_t collections_ = 0;
+};
+
+// The heap the calling thread is in.
+extern thread_local Heap* heap;
+
+// Keeps a single C++ local alive across safe points.
+class ValueRoot {
+ public:
+  ValueRoot(SchemeType& value) { Heap::thread().values_.push_back(&value); }
+  ~ValueRoot() { Heap::thread().values_.pop_back(); }
+};
+
+// Keeps every element of a C++ vector alive across safe points.
+class VectorRoot {
+ public:
+  VectorRoot(vector<SchemeType>& values) {
+    Heap::thread().vectors_.push_back(&values);
+  }
+  ~VectorRoot() { Heap::thread().vectors_.pop_back(); }
+};
+
+// Keeps an active frame alive while its closure body runs, and gives it
+// back if it is a stack frame once the body is done.
+class FrameRoot {
+ public:
+  FrameRoot(Frame* frame) { Heap::thread().frames_.push_back(frame); }
+  ~FrameRoot();
+};
+
+// Disables collection, for code that holds values in places the collector
+// cannot see (e.g. the macro expander's partially built trees).  While any
+// thread holds one, no thread collects.
+class NoGC {
+ public:
+  NoGC() {
+    Heap::thread().inhibit_++;
+    heap->inhibit_++;
+  }
+  ~NoGC() {
+    heap->inhibit_--;
+    Heap::thread().inhibit_--;
+  }
+};
+
+// Marks the calling thread as blocked, e.g. waiting for another thread,
+// so that the world can stop without it.  A blocked thread must not touch
+// the heap or its roots until it is unblocked, which waits for any stop
+// to end.
+class Blocking {
+ public:
+  Blocking() {
+    std::lock_guard<std::mutex> lock(heap->worldMutex_);
+    heap->running_--;
+    heap->worldChanged_.notify_all();
+  }
+  ~Blocking() {
+    std::unique_lock<std::mutex> lock(heap->worldMutex_);
+    heap->worldChanged_.wait(lock, [] { return !heap->stopRequested_; });
+    heap->running_++;
+  }
+};
+
+// Takes a lock that another evaluating thread may hold, as blocked while
+// waiting for it.
+template <class Lock>
+void lockBlocking(Lock& lock) {
+  if (!lock.try_lock()) {
+    Blocking blocking;
+    lock.lock();
+  }
+}
+
+inline SchemeType::SchemeType(SchemeType car, SchemeType cdr) :
+    ty_(SexpType::CONS) {
+  obj_ = heap->make<SchemePair>(car, cdr);
+}
+
+// The elements are left uninitialized.
+template <typename T, HeapKind K, SchemeType::SexpType Ty>
+NumVector<T, K, Ty>* NumVector<T, K, Ty>::make(size_t size) {
+  if (size > maxSize()) {
+    outOfMemory();
+  }
+  void* mem = heap->allocate(sizeof(NumVector) + size * sizeof(T), kKind);
+  return new (mem) NumVector(size);
+}
+
+inline SchemeType::SchemeType(SchemeBuiltin* builtin) :
+    ty_(SexpType::BUILTIN) {
+  obj_ = builtin;
+}
+
+inline SchemeType SchemeType::userString(const string& str) {
+  SchemeType ret(SexpType::STR);
+  ret.obj_ = heap->make<SchemeString>(str);
+  return ret;
+}
+
+inline const string& SchemeType::str() const {
+  return static_cast<SchemeString*>(obj_)->str_;
+}
+
+inline SchemeType& SchemeType::car() {
+  return static_cast<SchemePair*>(obj_)->car_;
+}
+
+inline SchemeType& SchemeType::cdr() {
+  return static_cast<SchemePair*>(obj_)->cdr_;
+}
+
+inline SchemeBuiltin* SchemeType::builtin() {
+  return static_cast<SchemeBuiltin*>(obj_);
+}
+
+inline bool SchemeType::eq(SchemeType& other) {
+  if (ty_ != other.ty_) return false;
+  switch (ty_) {
+  case SexpType::ID:
+    return atom_ == other.atom_;
+  case SexpType::STR:
+    return str() == other.str();
+  case SexpType::NUM:
+    return num_ == other.num_;
+  case SexpType::BOOL:
+    return boolVal_ == other.boolVal_;
+  case SexpType::CONS:
+  case SexpType::BUILTIN:
+  case SexpType::CLOSURE:
+  case SexpType::F64VECTOR:
+  case SexpType::S64VECTOR:
+  case SexpType::HASHTABLE:
+  case SexpType::FUTURE:
+    return obj_ == other.obj_;
+  case SexpType::NIL:
+  case SexpType::ERR:
+  case SexpType::EOF_:
+  case SexpType::TAIL_CALL:
+    return true;
+  }
+  return false;
+}
+
+inline SchemeHashTable* SchemeType::hashTable() {
+  return static_cast<SchemeHashTable*>(obj_);
+}
+
+inline SchemeFuture* SchemeType::future() {
+  return static_cast<SchemeFuture*>(obj_);
+}
+
+// Shared by every Interpreter, so it must never change.
+const SchemeType schemeNil = SchemeType::SexpType::NIL;
+
+//-----------------------------------------------------------------------------
+// Symbol Table
+//-----------------------------------------------------------------------------
+
+// Binds a global.  Other threads may be looking globals up, so this stops
+// the world while the table changes.
+void defineGlobal(Symtab& globals, Atom name, const SchemeType& value);
+
+// An inline cache for references to a global.  The cell bound to the name
+// is looked up on first use and kept.  That needs no invalidation: globals
+// are never removed, a define of a bound global stores into its existing
+// cell, and lexical shadowing is settled before any code runs.  The table
+// is the running Interpreter's, so a GlobalRef must only be used with one
+// Interpreter until intern() starts it over.
+class GlobalRef {
+ public:
+  explicit GlobalRef(Atom name) : text_(nullptr), name_(name) { }
+  // Constant-initialized, for the statics of compiled code; intern()
+  // then sets the name.
+  constexpr GlobalRef(const char* text) : text_(text) { }
+
+  // Also forgets the cell of any Interpreter the ref was used with before.
+  void intern() {
+    name_ = Atom::intern(text_);
+    cell_.store(nullptr, std::memory_order_relaxed);
+    builtin_.store(nullptr, std::memory_order_relaxed);
+  }
+  Atom atom() const { return name_; }
+
+  // The cell bound to the name, or null if the global is unbound.
+  SchemeType* cell() {
+    SchemeType* cell = cell_.load(std::memory_order_acquire);
+    return cell ? cell : find_();
+  }
+
+  // The value, or ERR if the global is unbound.
+  SchemeType get() {
+    SchemeType* cell = this->cell();
+    return cell ? *cell : unbound_();
+  }
+
+  // True if the global is bound to the builtin the analyzer would inline.
+  bool primitive() {
+    SchemeType* cell = this->cell();
+    if (!cell) {
+      return false;
+    }
+    SchemeBuiltin* builtin = builtin_.load(std::memory_order_relaxed);
+    return builtin && cell->sexpType() == SchemeType::SexpType::BUILTIN &&
+      cell->builtin() == builtin;
+  }
+
+ private:
+  SchemeType* find_();
+  SchemeType unbound_();
+
+  const char* text_;
+  Atom name_;
+  std::atomic<SchemeType*> cell_{nullptr};
+  std::atomic<SchemeBuiltin*> builtin_{nullptr};
+};
+
+// A Frame is the activation record of one closure call.  Variables are
+// resolved to (depth, slot) pairs by the analyzer, so a frame is nothing
+// more than a flat array of values plus a link to the next frame out,
+// which holds its closure's captured variables (see Scope).  Closures
+// keep their captures in a Frame too.  The slots are allocated inline,
+// directly after the Frame itself.
+class Frame : public HeapObject {
+ public:
+  static const HeapKind kKind = HeapKind::FRAME;
+
+  static Frame* make(Frame* next, int size) {
+    void* mem = heap->allocate(sizeof(Frame) + size * sizeof(SchemeType),
+                              kKind);
+    return new (mem) Frame(next, size);
+  }
+  // A frame for a call that no closure can outlive (see Scope::escapes()).
+  // It must be given back with release() when the call returns.
+  static Frame* makeOnStack(Frame* next, int size) {
+    void* mem = heap->pushFrame(sizeof(Frame) + size * sizeof(SchemeType));
+    if (!mem) {
+      return make(next, size);
+    }
+    Frame* frame = new (mem) Frame(next, size);
+    frame->kind_ = HeapKind::STACK_FRAME;
+    return frame;
+  }
+  // Gives back a stack frame along with any made after it.  Heap frames
+  // are left to the collector.
+  static void release(Frame* frame) {
+    if (frame && frame->kind_ == HeapKind::STACK_FRAME) {
+      heap->popFrame(frame);
+    }
+  }
+
+  Frame* next() { return next_; }
+  int size() { return size_; }
+  SchemeType* slots() { return reinterpret_cast<SchemeType*>(this + 1); }
+
+  SchemeType& operator[](int slot) { return slots()[slot]; }
+
+  SchemeType& lookup(int depth, int slot) {
+    Frame* cur = this;
+    while (depth-- > 0) {
+      cur = cur->next_;
+    }
+    return (*cur)[slot];
+  }
+
+ private:
+  friend class ImageReader;
+
+  Frame(Frame* next, int size) : HeapObject(kKind), next_(next), size_(size) {
+    for (int i = 0; i < size; ++i) {
+      new (&slots()[i]) SchemeType();
+    }
+  }
+
+  Frame* next_;
+  int size_;
+};
+
+inline FrameRoot::~FrameRoot() {
+  vector<Frame*>& frames = Heap::thread().frames_;
+  Frame::release(frames.back());
+  frames.pop_back();
+}
+
+// How a closure gets one of its captured values when it is made: from slot
+// slot_ of the frame the lambda is evaluated in (depth_ 0) or of that
+// frame's captures (depth_ 1).  A depth_ of -1 captures the closure itself.
+struct Capture {
+  int depth_;
+  int slot_;
+};
+
+//-----------------------------------------------------------------------------
+// Closures
+//-----------------------------------------------------------------------------
+struct Code;
+
+// What every closure over one lambda form shares.  The body is either an
+// analyzed expression tree (expr_) or, when running on the bytecode VM,
+// compiled code (code_).
+struct Lambda {
+  int argCount_ = 0;
+  bool hasRestArg_ = false;
+  int frameSize_ = 0;
+  // Null for top-level code.
+  ProcInfo* info_ = nullptr;
+  vector<Capture> captures_;
+  // Whether captures are chained to the frame the closure is made in.
+  bool chain_ = false;
+  // Whether calls need a heap frame rather than a stack one.
+  bool heapFrame_ = true;
+  function<SchemeType(Frame*)> expr_;
+  // The Lambda itself if it is a Code.
+  Code* code_ = nullptr;
+  // The constants the body uses, e.g. quoted lists, and the lambdas it
+  // makes closures over.  The collector traces them from each closure,
+  // so they stay alive as long as something can still run the body.
+  vector<SchemeType> constants_;
+  vector<shared_ptr<Lambda>> lambdas_;
+  // The collection that last traced this, counting from 1.
+  size_t traced_ = 0;
+};
+
+struct SchemeClosure : HeapObject {
+  static const HeapKind kKind = HeapKind::CLOSURE;
+  SchemeClosure() : HeapObject(kKind) { }
+
+  // The captured variables, or null if the lambda captures none.
+  Frame* env_ = nullptr;
+  shared_ptr<Lambda> lambda_;
+
+  // Makes a new frame for this closure with args bound to its arguments.
+  Frame* bind(SchemeType* args, size_t nargs);
+  SchemeType apply(Args eArgs);
+};
+
+SchemeType vmApply(SchemeClosure* closure, Args args);
+
+inline SchemeType::SchemeType(SchemeClosure* closure) :
+    ty_(SexpType::CLOSURE) {
+  obj_ = closure;
+}
+
+inline SchemeClosure* SchemeType::closure() {
+  return static_cast<SchemeClosure*>(obj_);
+}
+
+// Makes a closure over lambda, whose lambda form is being evaluated in
+// env.  Nothing here reaches a safe point, so env needs no rooting.
+inline SchemeType makeClosure(shared_ptr<Lambda> lambda, Frame* env) {
+  auto closure = heap->make<SchemeClosure>();
+  const vector<Capture>& captures = lambda->captures_;
+  if (!captures.empty() || lambda->chain_) {
+    closure->env_ = Frame::make(lambda->chain_ ? env : nullptr,
+                                captures.size());
+    for (size_t i = 0; i < captures.size(); ++i) {
+      const Capture& c = captures[i];
+      (*closure->env_)[i] = c.depth_ < 0 ? SchemeType(closure) :
+        env->lookup(c.depth_, c.slot_);
+    }
+  }
+  closure->lambda_ = std::move(lambda);
+  return SchemeType(closure);
+}
+
+//-----------------------------------------------------------------------------
+// Primitives
+//-----------------------------------------------------------------------------
+
+// Reports that x, an argument, is not what was expected, e.g. "a number",
+// and throws SchemeError.  It never returns; its type is for use in return
+// statements.
+[[noreturn]] SchemeType badArgument(const char* expected, SchemeType& x);
+
+// Operations behind the builtins the analyzer can inline.  setupEnv uses
+// them for the builtins' own entry points.
+template <class Op>
+struct NumOp {
+  SchemeType operator()(SchemeType& a, SchemeType& b) const {
+    if (!a.isNum() || !b.isNum()) {
+      return badArgument("a number", a.isNum() ? b : a);
+    }
+    return SchemeType(Op()(a.num(), b.num()));
+  }
+};
+
+template <class Op>
+struct CmpOp {
+  SchemeType operator()(SchemeType& a, SchemeType& b) const {
+    if (!a.isNum() || !b.isNum()) {
+      return badArgument("a number", a.isNum() ? b : a);
+    }
+    return SchemeType::fromBool(Op()(a.num(), b.num()));
+  }
+};
+
+struct ConsOp {
+  SchemeType operator()(SchemeType& a, SchemeType& b) const {
+    return SchemeType(a, b);
+  }
+};
+
+struct EqOp {
+  SchemeType operator()(SchemeType& a, SchemeType& b) const {
+    return SchemeType::fromBool(a.eq(b));
+  }
+};
+
+struct CarOp {
+  SchemeType operator()(SchemeType& p) const {
+    return p.isCons() ? p.car() : badArgument("a pair", p);
+  }
+};
+
+struct CdrOp {
+  SchemeType operator()(SchemeType& p) const {
+    return p.isCons() ? p.cdr() : badArgument("a pair", p);
+  }
+};
+
+struct NullOp {
+  SchemeType operator()(SchemeType& x) const {
+    return SchemeType::fromBool(x.isNil());
+  }
+};
+
+struct PairOp {
+  SchemeType operator()(SchemeType& x) const {
+    return SchemeType::fromBool(x.isCons());
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Compiled Code
+//-----------------------------------------------------------------------------
+
+// What programs compiled by --emit-cpp call; see CppEmitter in scheme.cc.
+
+// A top-level form of a compiled program: its source, for echoing, and
+// its code.
+struct CompiledForm {
+  const char* source_;
+  SchemeType (*run_)(Frame*);
+};
+
+struct CompiledProgram {
+  // Builds the program's constants; called before any form runs.
+  void (*init_)();
+  const CompiledForm* forms_;
+  size_t size_;
+};
+
+// A lambda of a compiled program.  Its captures are the captures_ entries
+// of the program's capture table starting at firstCapture_.
+struct CompiledLambda {
+  const char* name_;
+  const char* location_;
+  int argCount_;
+  bool hasRestArg_;
+  int frameSize_;
+  SchemeType (*body_)(Frame*);
+  int firstCapture_;
+  int captures_;
+  bool chain_;
+  bool heapFrame_;
+};
+
+shared_ptr<Lambda> makeCompiledLambda(const CompiledLambda& compiled,
+                                      const Capture* captures);
+
+// The running Interpreter's globals and macros.
+Symtab& compiledGlobals();
+void compiledDefineMacro(Atom name, SchemeType macro);
+SchemeType compiledExpandMacros(SchemeType& form);
+
+SchemeType callCompiled(size_t base, bool tail);
+SchemeType callGlobal(GlobalRef& global,
+                      std::initializer_list<SchemeType*> args, bool tail);
+
+// A call to one of the analyzer's primitives, with the arguments already
+// evaluated.  It is inlined if the global is still bound to the builtin.
+template <class Op>
+SchemeType compiledPrimitive(GlobalRef& global, SchemeType& a, bool tail) {
+  if (global.primitive()) {
+    return Op()(a);
+  }
+  return callGlobal(global, {&a}, tail);
+}
+
+template <class Op>
+SchemeType compiledPrimitive(GlobalRef& global, SchemeType& a, SchemeType& b,
+                             bool tail) {
+  if (global.primitive()) {
+    return Op()(a, b);
+  }
+  return callGlobal(global, {&a, &b}, tail);
+}
+
+// The main function of a compiled program.
+int compiledMain(const CompiledProgram& program, int argc,
+                 const char* argv[]);
+
+#endif  // SCHEME_H_
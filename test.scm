@@ -52,3 +52,147 @@
 (> 4 3)
 (> 3 4)
 
+
+;; symbols are interned
+(eq? 'foo 'foo)
+(eq? 'foo 'bar)
+
+;; lexical scoping: internal defines and shadowed globals
+(define x 100)
+(define (add-to x)
+  (define (inner y) (+ x y))
+  (inner 5))
+(add-to 10)
+((lambda (x) ((lambda (y) (+ x y)) 1)) 2)
+x
+
+;; tail calls run in constant stack
+(define (count-down n)
+  (if (= n 0) 'done (count-down (- n 1))))
+(count-down 100000)
+
+;; native if, begin, let and cond
+(if #t #f 5)
+(if #f 1)
+(begin 1 2 3)
+(let ((x 1) (y 2)) (let ((x y) (y x)) (list x y)))
+(define (make-counter)
+  (let ((n 0))
+    (lambda () (define m (+ n 1)) m)))
+((make-counter))
+(cond ((eq? 1 2) 'a) ((= 1 1) 'b 'c) (else 'd))
+(cond ((eq? 1 2) 'a))
+(cond (#f) (3))
+
+;; macro expansions are cached until a macro is redefined
+(define-macro unless (lambda (c . body) (list 'if c #f (cons 'begin body))))
+(unless #f (unless #f 1) (unless #f 2))
+(define-macro unless (lambda (c . body) 42))
+(unless #f 1)
+
+;; inlined primitives still see redefinitions and shadowing
+(define (add a b) (+ a b))
+(define plus +)
+(define + (lambda (a b) (cons a b)))
+(add 1 2)
+(define + plus)
+(add 1 2)
+((lambda (car) (car 5)) (lambda (x) (* x 2)))
+
+;; reader: dotted tails and nested quotes
+'(1 2 . (3 4))
+'(1 . 2)
+''a
+
+;; importing an unchanged module again does nothing
+(define (cadr p) 'kept)
+(import "lib.scm")
+(cadr '(1 2))
+
+;; numeric vectors
+(define fv (list->f64vector '(1 2 3 4 5)))
+(f64vector-set! fv 0 10)
+(f64vector-ref fv 0)
+(f64vector-add fv fv)
+(f64vector-map + fv fv)
+(f64vector-map (lambda (x) (* x x)) fv)
+(list (f64vector-sum fv) (f64vector-dot fv fv) (f64vector-min fv))
+(f64vector->list (make-f64vector 3 0.5))
+(s64vector-div (s64vector 7 8 9) (s64vector 1 2 3))
+(define s64min (s64vector (- 0 9223372036854775808)))
+(s64vector-sub s64min (s64vector 1))
+(s64vector-div s64min (s64vector (- 0 1)))
+(eq? fv fv)
+
+;; hash tables
+(define ht (make-hash-table))
+(hash-table-set! ht '(1 "two") 'equal-key)
+(hash-table-set! ht 'sym 1)
+(hash-table-ref ht (list 1 "two"))
+(hash-table-ref ht 'other 'default)
+(hash-table-delete! ht 'sym)
+(list (hash-table-count ht) (hash-table-contains? ht 'sym))
+(define eqt (make-hash-table eq?))
+(hash-table-set! eqt ht 'by-identity)
+(list (hash-table-ref eqt ht) (hash-table-ref eqt (list 1) #f))
+(hash-table->alist ht)
+(equal? '(1 (2 "x")) (list 1 (list 2 "x")))
+
+;; futures and parallel maps
+(define fut (future (+ 1 2)))
+(list (future? fut) (touch fut) (touch fut))
+(pmap (lambda (x) (* x x)) '(1 2 3 4 5 6 7 8))
+(map touch (pmap (lambda (x) (future (cons x x))) '(1 2 3)))
+(parallel-for-each (lambda (x) x) '(1 2 3))
+
+;; cached global references see later definitions and redefinitions
+(define (use-later x) (defined-later x))
+(define (defined-later x) (* x 2))
+(use-later 5)
+(define (defined-later x) (* x 3))
+(use-later 5)
+
+;; closures capture what they use, including internal defines that are
+;; only bound after the closure is made
+(define (make-adder n) (lambda (x) (+ x n)))
+((make-adder 3) 4)
+(define (parity n)
+  (define (ev? n) (if (= n 0) #t (od? (- n 1))))
+  (define (od? n) (if (= n 0) #f (ev? (- n 1))))
+  (list (ev? n) (od? n)))
+(parity 7)
+(define (nested a)
+  (let ((b (* a 10)))
+    (lambda (c) (lambda () (list a b c)))))
+(((nested 1) 2))
+(define (redefined)
+  (define x 1)
+  (define (get) x)
+  (define x 2)
+  (get))
+(redefined)
+;; a lambda applied where it is made runs in the caller's frame, and
+;; calls whose frames nothing can keep reuse stack space
+((lambda (a b) (list b a)) 1 2)
+(define (keep x) ((lambda (y) (lambda () (list x y))) (* x 2)))
+((keep 5))
+(define (count-down n) (if (= n 0) 'done (count-down (- n 1))))
+(count-down 100000)
+(define (depth n) (if (= n 0) 0 (+ 1 (depth (- n 1)))))
+(depth 10000)
+;; malformed special forms are reported and evaluate to an error
+(if)
+(if 1)
+(let ((x)) x)
+(let x)
+(cond ())
+(cond (else))
+;; apply in tail position; on the VM the applied procedure runs in a
+;; nested activation that may grow the call stack under the caller
+(define (tail-apply l) (apply depth l))
+(tail-apply '(2000))
+(define (tail-apply-list . l) (apply list l))
+(tail-apply-list 1 2 3)
+;; numbers may start with a point; a dotted application is an error
+(+ 1 .5)
+(list 1 . 2)